@@ -5,33 +5,112 @@
 #include <utility>
 #include <iomanip>
 #include <cmath>
-#include <ctime>
+#include <chrono>
+#include <memory>
+#include <deque>
+#include <limits>
+#include <cstdlib>
+#include <cstring>
 
 #include "matrix.h"
 #include "frame.h"
+#include "input.h"
+#include "thread_pool.h"
+#include "gop_index.h"
+#include "packet.h"
+#include "simd.h"
+#include "global_variable.h"
+
+typedef std::chrono::steady_clock CLOCK_T;
+
+static double l_seconds_between(CLOCK_T::time_point begin, CLOCK_T::time_point end)
+{
+	return std::chrono::duration<double>(end - begin).count();
+}
+
+// A frame whose bitstream has been read but which hasn't been reconstructed yet
+struct ParsedFrame
+{
+	std::unique_ptr<IFrame> ifr;
+	std::unique_ptr<PFrame> pf;
+	Frame decode_frame;
+	double seconds;
+	
+	ParsedFrame() : decode_frame(0x80, 0, 0), seconds(0) {};
+};
+typedef std::vector<ParsedFrame> GOP_T;
+
+// A GOP that can be decoded apart from the others: how many frames it has and where its data starts (the offset
+// of its first packet for a packet file, in the two streams otherwise)
+struct GopSpan
+{
+	unsigned int num_frames;
+	std::uint64_t mvs_offset;
+	std::uint64_t res_offset;
+};
+
+static bool l_is_number(const char* str)
+{
+	return *str != '\0' && std::strspn(str, "0123456789") == std::strlen(str);
+}
+
+// Length of a stream that can seek, leaving its position where it was; false for one that can't (stdin)
+static bool l_stream_size(std::istream& in, std::uint64_t& size)
+{
+	std::streampos pos = in.tellg();
+	if(pos == std::streampos(-1) || !in.seekg(0, std::ios_base::end))
+	{
+		in.clear();
+		return false;
+	}
+	size = (std::uint64_t)in.tellg();
+	in.seekg(pos);
+	return !in.fail();
+}
 
 int main(int argc, char* argv[])
 {
-	if (argc < 2)
+	if (argc < 3)
 	{
-		std::cout << "Usage: decode.exe <path to cfg file> <mvs db file> <res db file>" << std::endl;
+		std::cout << "Usage: decode.exe <path to cfg file> <mvs db file> <res db file> [<first frame> [<last frame>]]" << std::endl;
+		std::cout << "       decode.exe <path to cfg file> <packet file> [<first frame> [<last frame>]]" << std::endl;
 		return 0;
 	}
 	
 	const char* cfg_file = argv[1];
 	CFG::inst().init(cfg_file);
+	PARAMS::inst().load();
 	
 	unsigned int num_frames, frame_width, frame_height;
 	unsigned int block_size, qp;
 	bool all_values_loaded = true;
-	CFG_LOAD_OPT_MANDATORY("num_frames", num_frames, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("frame_width", frame_width, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("frame_height", frame_height, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("block_size", block_size, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("qp", qp, all_values_loaded)
 	
+	// Only used to check the stream; 0 means unknown
+	CFG_LOAD_OPT_DEFAULT("num_frames", num_frames, 0);
+	
+	// Two streams are given as two file names; otherwise it's a packet file (the frame range being numbers)
+	bool packet_file = argc < 4 || l_is_number(argv[3]);
+	int range_arg = packet_file ? 3 : 4;
+	
 	std::string mvs_filename(argv[2]);
-	std::string res_filename(argv[3]);
+	std::string res_filename(packet_file ? "" : argv[3]);
+	
+	// Optionally only frames first_frame to last_frame (inclusive) are written out
+	unsigned int first_frame = 0;
+	unsigned int last_frame = std::numeric_limits<unsigned int>::max();
+	if(argc > range_arg)
+		first_frame = (unsigned int)std::strtoul(argv[range_arg], nullptr, 10);
+	if(argc > range_arg + 1)
+		last_frame = (unsigned int)std::strtoul(argv[range_arg + 1], nullptr, 10);
+	if(last_frame < first_frame)
+	{
+		std::cout << "ERROR: Frame range " << first_frame << "-" << last_frame << " is empty" << std::endl;
+		return 0;
+	}
 
 	if(!all_values_loaded)
 	{
@@ -46,58 +125,432 @@ int main(int argc, char* argv[])
 		frame_height = temp_frame.get_height();
 	}
 	
+	// Rescaling the residuals goes through the same kernels as in the encoder
+	bool simd_enable;
+	CFG_LOAD_OPT_DEFAULT("SIMDEnable", simd_enable, true);
+	SIMD::init(simd_enable ? SIMD::SIMD_AVX2 : SIMD::SIMD_NONE);
+	std::cout << "INFO: SIMD kernels: " << SIMD::level_name(SIMD::get_level()) << std::endl;
+	
 	unsigned int max_refs;
 	CFG_LOAD_OPT_DEFAULT ("nRefFrames", max_refs, 1)
+	// Sub-pel vectors are looked up in interpolated copies of the reference frames, made as each one is decoded
+	const unsigned int subpel_precision = PARAMS::inst().subpel_precision;
 		
-	std::ifstream mvs_db(mvs_filename, std::ifstream::binary);
-	std::ifstream res_db(res_filename, std::ifstream::binary);
+	// Frames come either from the two streams, or from a packet file with both parts of each frame side by side.
+	// Files are mapped when possible.
+	std::unique_ptr<InputStream> mvs_input, res_input;
+	std::unique_ptr<PacketReader> packets;
+	std::istream* mvs_db;
+	std::istream* res_db;
+	if(packet_file)
+	{
+		packets.reset(new PacketReader(mvs_filename.c_str(), PACKET::max_payload_bytes(frame_width, frame_height)));
+		if(!packets->is_open())
+		{
+			return 0;
+		}
+		mvs_db = &packets->mvs();
+		res_db = &packets->res();
+	}
+	else
+	{
+		mvs_input.reset(new InputStream(mvs_filename.c_str()));
+		res_input.reset(new InputStream(res_filename.c_str()));
+		if(!mvs_input->is_open() || !res_input->is_open())
+		{
+			return 0;
+		}
+		mvs_db = &mvs_input->get();
+		res_db = &res_input->get();
+	}
+	
+	// Move on to the next frame, leaving both streams at its data
+	auto next_frame = [&](char& frame_type) -> bool
+	{
+		if(packets)
+		{
+			return packets->next(frame_type);
+		}
+		if(GOLOMB::stream_at_end(*mvs_db) || GOLOMB::stream_at_end(*res_db))
+		{
+			return false;
+		}
+		frame_type = GOLOMB::read_byte_from_stream(*mvs_db);
+		return true;
+	};
+	
+	unsigned int num_threads, parallel_gops;
+	CFG_LOAD_OPT_DEFAULT("nThreads", num_threads, 0);
+	CFG_LOAD_OPT_DEFAULT("ParallelGOPs", parallel_gops, 0);
+	ThreadPool::inst().init(num_threads);
+	std::cout << "INFO: Threads: " << ThreadPool::inst().get_num_threads() << std::endl;
 	
-	std::ofstream out("out_decode.yuv", std::ofstream::binary);
-
 	unsigned int iframe = 0;
 	char frame_type;
 	
-	clock_t overall_begin = std::clock();
+	// The two streams can be entered at any GOP listed in the index written alongside them, as long as the index
+	// matches them and they can seek. That serves both a frame range and decoding GOPs apart from each other.
+	GOP_INDEX_T gop_index;
+	unsigned int indexed_frames = 0;
+	bool have_index = false;
+	std::string index_filename = GOP_INDEX::filename_for(mvs_filename);
+	if(!packets && (first_frame > 0 || parallel_gops > 1))
+	{
+		std::uint64_t indexed_mvs_size, indexed_res_size, mvs_size, res_size;
+		if(!GOP_INDEX::read(index_filename, gop_index, indexed_frames, indexed_mvs_size, indexed_res_size))
+		{
+			std::cout << "WARNING: No usable GOP index " << index_filename << std::endl;
+		}
+		else if(!l_stream_size(*mvs_db, mvs_size) || !l_stream_size(*res_db, res_size))
+		{
+			std::cout << "WARNING: Streams can't seek, so GOP index " << index_filename << " can't be used" << std::endl;
+		}
+		else if(mvs_size != indexed_mvs_size || res_size != indexed_res_size)
+		{
+			std::cout << "WARNING: GOP index " << index_filename << " doesn't match the streams" << std::endl;
+		}
+		else
+		{
+			have_index = true;
+		}
+	}
+	
+	// Frames before the requested range only need decoding from the GOP the range starts in. Packet headers say
+	// where each frame is; for the two streams, the index does.
+	if(first_frame > 0 && packets && !packets->can_seek())
+	{
+		std::cout << "WARNING: Input can't seek; decoding from the first frame" << std::endl;
+	}
+	else if(first_frame > 0 && packets)
+	{
+		std::uint64_t gop_offset = packets->tell();
+		unsigned int gop_frame = 0, num_skipped = 0;
+		std::uint64_t offset = packets->tell();
+		while(num_skipped <= first_frame && packets->skip(frame_type))
+		{
+			if(frame_type == IFRAME_ID)
+			{
+				gop_offset = offset;
+				gop_frame = num_skipped;
+			}
+			offset = packets->tell();
+			++num_skipped;
+		}
+		if(num_skipped <= first_frame)
+		{
+			std::cout << "ERROR: Asked for frame " << first_frame << ", the stream has " << num_skipped << " frames" << std::endl;
+			return 0;
+		}
+		bool seeked = packets->seek(gop_offset);
+		assert(seeked);
+		std::cout << "INFO: Starting at the GOP of frame " << gop_frame << std::endl;
+		iframe = gop_frame;
+	}
+	else if(first_frame > 0 && !have_index)
+	{
+		std::cout << "WARNING: Decoding from the first frame" << std::endl;
+	}
+	else if(first_frame > 0)
+	{
+		if(first_frame >= indexed_frames)
+		{
+			std::cout << "ERROR: Asked for frame " << first_frame << ", the stream has " << indexed_frames << " frames" << std::endl;
+			return 0;
+		}
+		
+		const GOP_ENTRY_T& gop = GOP_INDEX::find(gop_index, first_frame);
+		mvs_db->seekg(gop.mvs_offset);
+		res_db->seekg(gop.res_offset);
+		if(mvs_db->fail() || res_db->fail() || mvs_db->peek() != IFRAME_ID)
+		{
+			std::cout << "WARNING: GOP index " << index_filename << " doesn't point at an I-frame; decoding from the first frame" << std::endl;
+			mvs_db->clear();
+			res_db->clear();
+			mvs_db->seekg(0);
+			res_db->seekg(0);
+			have_index = false;
+		}
+		else
+		{
+			std::cout << "INFO: Starting at the GOP of frame " << gop.frame << std::endl;
+			iframe = gop.frame;
+		}
+	}
+	
+	// With the start of every GOP from iframe on known up front, each GOP is parsed as well as reconstructed on its
+	// own, from its own view of the input
+	std::vector<GopSpan> gop_spans;
+	bool gops_known = false;
+	if(parallel_gops > 1 && packets && packets->can_seek())
+	{
+		unsigned int next_frame_num = iframe;
+		std::uint64_t offset = packets->tell();
+		while(next_frame_num <= last_frame && packets->skip(frame_type))
+		{
+			assert(frame_type == IFRAME_ID || frame_type == PFRAME_ID);
+			if(frame_type == IFRAME_ID)
+			{
+				gop_spans.push_back(GopSpan{ 0, offset, 0 });
+			}
+			assert(!gop_spans.empty());
+			++gop_spans.back().num_frames;
+			offset = packets->tell();
+			++next_frame_num;
+		}
+		gops_known = true;
+	}
+	else if(parallel_gops > 1 && have_index)
+	{
+		for(std::size_t igop = 0; igop < gop_index.size(); ++igop)
+		{
+			const GOP_ENTRY_T& gop = gop_index[igop];
+			if(gop.frame < iframe || gop.frame > last_frame)
+			{
+				continue;
+			}
+			unsigned int gop_end = (igop + 1 < gop_index.size()) ? gop_index[igop + 1].frame : indexed_frames;
+			if(last_frame < gop_end)
+			{
+				gop_end = last_frame + 1;
+			}
+			gop_spans.push_back(GopSpan{ gop_end - gop.frame, gop.mvs_offset, gop.res_offset });
+		}
+		gops_known = true;
+	}
+	
+	std::ofstream out("out_decode.yuv", std::ofstream::binary);
+	
+	CLOCK_T::time_point overall_begin = CLOCK_T::now();
 	
 	std::deque<Frame> ref_frames;
 	
-	while (mvs_db.good() && !mvs_db.eof() && mvs_db.peek() != EOF && res_db.good() && !res_db.eof() && res_db.peek() != EOF)
+	if(gops_known)
+	{
+		// Parse and reconstruct one GOP, on whichever thread picks it up
+		auto decode_gop = [&](const GopSpan& span, GOP_T& gop)
+		{
+			std::unique_ptr<PacketReader> gop_packets;
+			std::unique_ptr<InputStream> gop_mvs_input, gop_res_input;
+			std::istream* gop_mvs_db;
+			std::istream* gop_res_db;
+			if(packets)
+			{
+				gop_packets.reset(new PacketReader(mvs_filename.c_str(), PACKET::max_payload_bytes(frame_width, frame_height)));
+				if(!gop_packets->is_open() || !gop_packets->seek(span.mvs_offset))
+				{
+					return;
+				}
+				gop_mvs_db = &gop_packets->mvs();
+				gop_res_db = &gop_packets->res();
+			}
+			else
+			{
+				gop_mvs_input.reset(new InputStream(mvs_filename.c_str()));
+				gop_res_input.reset(new InputStream(res_filename.c_str()));
+				if(!gop_mvs_input->is_open() || !gop_res_input->is_open())
+				{
+					return;
+				}
+				gop_mvs_db = &gop_mvs_input->get();
+				gop_res_db = &gop_res_input->get();
+				gop_mvs_db->seekg(span.mvs_offset);
+				gop_res_db->seekg(span.res_offset);
+			}
+			
+			std::deque<Frame> gop_refs;
+			char gop_frame_type;
+			for(unsigned int i = 0; i < span.num_frames; ++i)
+			{
+				CLOCK_T::time_point frame_begin = CLOCK_T::now();
+				if(gop_packets ? !gop_packets->next(gop_frame_type) :
+					(GOLOMB::stream_at_end(*gop_mvs_db) || GOLOMB::stream_at_end(*gop_res_db)))
+				{
+					break;
+				}
+				if(!gop_packets)
+				{
+					gop_frame_type = GOLOMB::read_byte_from_stream(*gop_mvs_db);
+				}
+				assert(gop_frame_type == (i == 0 ? IFRAME_ID : PFRAME_ID));
+				
+				gop.emplace_back();
+				ParsedFrame& decoded = gop.back();
+				if(gop_frame_type == IFRAME_ID)
+				{
+					IFrame ifr(*gop_mvs_db, *gop_res_db, block_size, frame_width, frame_height, qp);
+					decoded.decode_frame = Frame(ifr);
+				}
+				else
+				{
+					PFrame pf(*gop_mvs_db, *gop_res_db, block_size, frame_width, frame_height, qp);
+					decoded.decode_frame = Frame(pf, gop_refs);
+				}
+				gop_refs.push_front(decoded.decode_frame);
+				if(subpel_precision > 1)
+					gop_refs.front().build_subpel_planes(subpel_precision);
+				if(gop_refs.size() > max_refs)
+					gop_refs.pop_back();
+				decoded.seconds = l_seconds_between(frame_begin, CLOCK_T::now());
+			}
+			if(!gop_packets)
+			{
+				GOLOMB::release_stream(*gop_mvs_db);
+				GOLOMB::release_stream(*gop_res_db);
+			}
+		};
+		
+		// Up to parallel_gops GOPs at a time, so only that many are held before being written out
+		bool complete = true;
+		for(std::size_t ibatch = 0; complete && ibatch < gop_spans.size(); ibatch += parallel_gops)
+		{
+			std::size_t batch_end = std::min<std::size_t>(gop_spans.size(), ibatch + parallel_gops);
+			std::vector<GOP_T> gops(batch_end - ibatch);
+			ThreadPool::inst().parallel_for(ibatch, batch_end, [&](unsigned int igop)
+			{
+				decode_gop(gop_spans[igop], gops[igop - ibatch]);
+			});
+			
+			for(std::size_t igop = ibatch; complete && igop < batch_end; ++igop)
+			{
+				for(ParsedFrame& decoded : gops[igop - ibatch])
+				{
+					if(iframe >= first_frame)
+						decoded.decode_frame.write(out);
+					std::cout << "Decoding Frame " << iframe++ << "... Elapsed time: " << decoded.seconds << std::endl;
+				}
+				// A GOP cut short leaves a gap, so nothing after it is written
+				complete = gops[igop - ibatch].size() == gop_spans[igop].num_frames;
+			}
+		}
+	}
+	else if(parallel_gops > 1)
+	{
+		// Without knowing where each GOP starts, the entropy decoding has to follow the bitstream; once up to
+		// parallel_gops GOPs have been parsed they are reconstructed concurrently, each one starting from its own I-frame
+		std::vector<GOP_T> gops;
+		auto reconstruct_and_write = [&]()
+		{
+			ThreadPool::inst().parallel_for(0, gops.size(), [&](unsigned int igop)
+			{
+				std::deque<Frame> gop_refs;
+				for(ParsedFrame& parsed : gops[igop])
+				{
+					CLOCK_T::time_point recon_begin = CLOCK_T::now();
+					if(parsed.ifr)
+					{
+						parsed.ifr->reconstruct();
+						parsed.decode_frame = Frame(*parsed.ifr);
+						parsed.ifr.reset();
+					}
+					else
+					{
+						parsed.decode_frame = Frame(*parsed.pf, gop_refs);
+						parsed.pf.reset();
+					}
+					gop_refs.push_front(parsed.decode_frame);
+					if(subpel_precision > 1)
+						gop_refs.front().build_subpel_planes(subpel_precision);
+					if(gop_refs.size() > max_refs)
+						gop_refs.pop_back();
+					parsed.seconds += l_seconds_between(recon_begin, CLOCK_T::now());
+				}
+			});
+			
+			for(GOP_T& gop : gops)
+			{
+				for(ParsedFrame& parsed : gop)
+				{
+					if(iframe >= first_frame)
+						parsed.decode_frame.write(out);
+					std::cout << "Decoding Frame " << iframe++ << "... Elapsed time: " << parsed.seconds << std::endl;
+				}
+			}
+			gops.clear();
+		};
+		
+		unsigned int iparsed = iframe;
+		CLOCK_T::time_point parse_begin = CLOCK_T::now();
+		while (iparsed <= last_frame && next_frame(frame_type))
+		{
+			assert(frame_type == IFRAME_ID || frame_type == PFRAME_ID);
+			if (frame_type == IFRAME_ID)
+			{
+				if(gops.size() == parallel_gops)
+				{
+					reconstruct_and_write();
+				}
+				gops.emplace_back();
+			}
+			assert(!gops.empty());
+			
+			gops.back().emplace_back();
+			ParsedFrame& parsed = gops.back().back();
+			if (frame_type == IFRAME_ID)
+			{
+				parsed.ifr.reset(new IFrame(*mvs_db, *res_db, block_size, frame_width, frame_height, qp, true));
+			}
+			else
+			{
+				parsed.pf.reset(new PFrame(*mvs_db, *res_db, block_size, frame_width, frame_height, qp));
+			}
+			CLOCK_T::time_point parse_end = CLOCK_T::now();
+			parsed.seconds = l_seconds_between(parse_begin, parse_end);
+			parse_begin = parse_end;
+			++iparsed;
+		}
+		reconstruct_and_write();
+	}
+	
+	CLOCK_T::time_point frame_begin = CLOCK_T::now();
+	while (!gops_known && iframe <= last_frame && next_frame(frame_type))
 	{
 		std::cout << "Decoding Frame " << iframe++ << "..." << std::flush;
 		Frame decode_frame(0x80, frame_width, frame_height);
 		
-		clock_t frame_begin = std::clock();
-		
-		mvs_db.get(frame_type);
 		assert(frame_type == IFRAME_ID || frame_type == PFRAME_ID);
 		if (frame_type == IFRAME_ID)
 		{
-			IFrame ifr(mvs_db, res_db, block_size, frame_width, frame_height, qp);
+			IFrame ifr(*mvs_db, *res_db, block_size, frame_width, frame_height, qp);
 			decode_frame = Frame(ifr);
 			ref_frames.clear();
 		}
 		else
 		{
-			PFrame pf(mvs_db, res_db, block_size, frame_width, frame_height, qp);
+			PFrame pf(*mvs_db, *res_db, block_size, frame_width, frame_height, qp);
 			decode_frame = Frame(pf, ref_frames);
 		}
-		decode_frame.write(out);
+		if(iframe > first_frame)
+			decode_frame.write(out);
 		ref_frames.push_front(decode_frame);
+		if(subpel_precision > 1)
+			ref_frames.front().build_subpel_planes(subpel_precision);
 		if(ref_frames.size() > max_refs)
 			ref_frames.pop_back();
 		
-		clock_t frame_end = std::clock();
-		std::cout << " Elapsed time: "  << double(frame_end - frame_begin) / CLOCKS_PER_SEC << std::endl;
+		CLOCK_T::time_point frame_end = CLOCK_T::now();
+		std::cout << " Elapsed time: "  << l_seconds_between(frame_begin, frame_end) << std::endl;
+		frame_begin = frame_end;
 	}
 	out.close();
-	mvs_db.close();
-	res_db.close();
+	GOLOMB::release_stream(*mvs_db);
+	GOLOMB::release_stream(*res_db);
 	
-	if(iframe != num_frames)
+	if(last_frame != std::numeric_limits<unsigned int>::max())
+	{
+		if(iframe <= last_frame)
+		{
+			std::cout << "ERROR: Asked for frames up to " << last_frame << ", only decoded " << iframe << std::endl;
+		}
+	}
+	else if(num_frames != 0 && iframe < num_frames)
 	{
 		std::cout << "ERROR: Expected " << num_frames << " frames, only decoded " << iframe << std::endl;
 	}
+	else if(num_frames != 0 && iframe > num_frames)
+	{
+		std::cout << "ERROR: Expected " << num_frames << " frames, the stream has " << iframe << std::endl;
+	}
 	
-	clock_t overall_end = std::clock();
-	std::cout << "Overall_Time:" << std::setw(12) << double(overall_end - overall_begin) / CLOCKS_PER_SEC << std::endl;
+	CLOCK_T::time_point overall_end = CLOCK_T::now();
+	std::cout << "Overall_Time:" << std::setw(12) << l_seconds_between(overall_begin, overall_end) << std::endl;
 }
\ No newline at end of file
@@ -5,42 +5,83 @@
 #include <utility>
 #include <iomanip>
 #include <cmath>
-#include <ctime>
+#include <chrono>
 #include <string>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <sstream>
+#include <cstdio>
 
 #include "util.h"
 #include "matrix.h"
 #include "frame.h"
+#include "simd.h"
+#include "input.h"
+#include "thread_pool.h"
+#include "gop_index.h"
+#include "packet.h"
 #include "global_variable.h"
 
-BYTEVEC_T read_byte_istream(std::istream& in)
+// Times are wall-clock; with the thread pool running, CPU time would count every thread
+typedef std::chrono::steady_clock CLOCK_T;
+
+static double l_seconds_between(CLOCK_T::time_point begin, CLOCK_T::time_point end)
 {
-	if(in.eof() || in.fail())
-	{
-		return BYTEVEC_T();
-	}
-	std::streampos orig_pos = in.tellg();
+	return std::chrono::duration<double>(end - begin).count();
+}
+
+// A frame that's been coded and reconstructed, on its way to being written out
+struct CodedFrame
+{
+	CodedFrame(unsigned int i, CLOCK_T::time_point t, Frame&& cur)
+	: iframe(i), begin(t), cur_frame(std::move(cur)), recon_frame(0x80, cur_frame.get_width(), cur_frame.get_height()) {};
 	
-	in.seekg(0, std::ios_base::end);
-	unsigned int size = (unsigned int)in.tellg() - orig_pos;
-	BYTEVEC_T result(size);
+	unsigned int iframe;
+	CLOCK_T::time_point begin;
+	Frame cur_frame;
+	Frame recon_frame;
 	
-	in.seekg(orig_pos);
-	in.read(reinterpret_cast<char*>(&result[0]), size);
-	return result;
-}
+	// Exactly one of these is set
+	std::unique_ptr<IFrame> ifr;
+	std::unique_ptr<PFrame> pf;
+};
 
-BYTEVEC_T read_byte_file(const char* filename)
+// Where the output stage puts coded frames, and running totals of what went there
+struct FrameOutputs
 {
-	std::ifstream ifs(filename, std::ifstream::binary);
-	if (!ifs || !ifs.is_open())
-	{
-		std::cout << "Could not open file " << filename << std::endl;
-		return BYTEVEC_T();
-	}
-	BYTEVEC_T ret = read_byte_istream(ifs);
-	ifs.close();
-	return ret;
+	FrameOutputs(std::ostream& mvs_out, std::ostream& res_out, std::ostream& recon_out, std::ostream& log_out)
+	: mvs(mvs_out), res(res_out), recon(recon_out), log(log_out), total_bytes_written(0), total_PSNR(0.0) {};
+	
+	std::ostream& mvs;
+	std::ostream& res;
+	std::ostream& recon;
+	std::ostream& log;
+	unsigned int total_bytes_written;
+	double total_PSNR;
+	
+	// Where each I-frame went, relative to the start of mvs and res
+	GOP_INDEX_T gop_index;
+};
+
+// A run of frames starting at an I-frame, coded on its own into its share of each output
+struct GOPFragment
+{
+	GOPFragment(unsigned int first) : first_frame(first), outputs(mvs, res, recon, log) {};
+	
+	unsigned int first_frame;
+	std::vector<BYTEVEC_T> frames;
+	std::stringstream mvs;
+	std::stringstream res;
+	std::stringstream recon;
+	std::stringstream log;
+	FrameOutputs outputs;
+};
+
+static void l_append(std::ostream& out, const std::stringstream& fragment)
+{
+	const std::string bytes = fragment.str();
+	out.write(bytes.data(), bytes.size());
 }
 
 int main(int argc, char* argv[])
@@ -53,12 +94,12 @@ int main(int argc, char* argv[])
 	
 	const char* cfg_file = argv[1];
 	CFG::inst().init(cfg_file);
+	PARAMS::inst().load();
 	
 	unsigned int num_frames, frame_width, frame_height;
 	unsigned int block_size, search_range, qp;
 	
 	bool all_values_loaded = true;
-	CFG_LOAD_OPT_MANDATORY("num_frames", num_frames, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("frame_width", frame_width, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("frame_height", frame_height, all_values_loaded)
 	CFG_LOAD_OPT_MANDATORY("block_size", block_size, all_values_loaded)
@@ -71,15 +112,34 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 	
-	BYTEVEC_T bytes = read_byte_file(argv[2]);
+	// Frames are encoded as they're read: at most num_frames of them, or all of the input for 0
+	CFG_LOAD_OPT_DEFAULT("num_frames", num_frames, 0);
 	
 	std::cout << "INFO: Frames: " << frame_width << "x" << frame_height << ", Blocks: " << block_size << "x" << block_size << ", r=" << search_range << " qp=" << qp << std::endl;
 	int bytes_per_frame = frame_width * frame_height /* y values */ + frame_width * frame_height / 4 /* u values */ + frame_width * frame_height / 4 /* v values */;
-	std::cout << "INFO: Bytestring is " << bytes.size() << " bytes. Expected: " << num_frames << " frames * " << bytes_per_frame << " bytes/frame = " << bytes_per_frame * num_frames << std::endl;
-	if (bytes.size() % bytes_per_frame != 0)
+	
+	// Input file is mapped when possible; otherwise (or for "-", stdin) it's streamed a frame at a time
+	FrameSource source(argv[2], bytes_per_frame);
+	if(!source.is_open())
 	{
-			std::cout << "Error: Unexpected bytestream length; " << bytes.size() % bytes_per_frame << " extra bytes!" << std::endl;
-			return 0;
+		return 0;
+	}
+	if(source.is_mapped())
+	{
+		std::cout << "INFO: Bytestring is " << source.get_size() << " bytes. Expected: " << num_frames << " frames * " << bytes_per_frame << " bytes/frame = " << bytes_per_frame * num_frames << std::endl;
+		if (source.get_size() % bytes_per_frame != 0)
+		{
+				std::cout << "Error: Unexpected bytestream length; " << source.get_size() % bytes_per_frame << " extra bytes!" << std::endl;
+				return 0;
+		}
+		if (num_frames != 0 && source.get_size() > (std::size_t)bytes_per_frame * num_frames)
+		{
+			std::cout << "INFO: Input holds " << source.get_size() / bytes_per_frame << " frames; coding the first " << num_frames << std::endl;
+		}
+		else if (num_frames != 0 && source.get_size() != (std::size_t)bytes_per_frame * num_frames)
+		{
+			std::cout << "WARNING: Input holds " << source.get_size() / bytes_per_frame << " frames, not num_frames=" << num_frames << std::endl;
+		}
 	}
 	
 	
@@ -99,16 +159,22 @@ int main(int argc, char* argv[])
 	bool dump_debug_files;
 	CFG_LOAD_OPT_DEFAULT("dump_debug_files", dump_debug_files, false);
 	
-	clock_t overall_begin = std::clock();
+	bool simd_enable;
+	CFG_LOAD_OPT_DEFAULT("SIMDEnable", simd_enable, true);
+	SIMD::init(simd_enable ? SIMD::SIMD_AVX2 : SIMD::SIMD_NONE);
+	std::cout << "INFO: SIMD kernels: " << SIMD::level_name(SIMD::get_level()) << std::endl;
 	
-	// Pull the bytes from the stream into separate frames
-	std::vector<Frame> frames;
-	for(auto it = bytes.begin(); it != bytes.end(); it += bytes_per_frame)
+	// 0 = one per hardware thread
+	unsigned int num_threads;
+	CFG_LOAD_OPT_DEFAULT("nThreads", num_threads, 0);
+	ThreadPool::inst().init(num_threads);
+	std::cout << "INFO: Threads: " << ThreadPool::inst().get_num_threads() << std::endl;
+	if(PARAMS::inst().hw_enable)
 	{
-		frames.push_back(Frame(BYTEVEC_T(it, it + bytes_per_frame), frame_width, frame_height));
+		std::cout << "INFO: HwModeEnable=on; P-frame rows, reference frames and GOPs are coded one at a time" << std::endl;
 	}
-	std::cout << "INFO: Captured " << frames.size() << " frames!" << std::endl;
-	assert(frames.size() == num_frames);
+	
+	CLOCK_T::time_point overall_begin = CLOCK_T::now();
 	
 	std::ofstream real_outfile, ref_outfile, res_outfile, mvs_txt, res_txt;
 	if(dump_debug_files)
@@ -120,10 +186,28 @@ int main(int argc, char* argv[])
 		res_txt = std::ofstream ("res.txt");
 	}
 	
-	std::ofstream mvs_ostream("mvs.db", std::ofstream::binary);
-	std::ofstream res_ostream("res.db", std::ofstream::binary);
+	// The bitstream goes either to the two streams, or to a single file of per-frame packets (which can be a pipe)
+	std::string stream_file;
+	CFG_LOAD_OPT_DEFAULT("stream_file", stream_file, std::string());
+	const bool packet_file = !stream_file.empty();
+	std::ofstream mvs_ostream, res_ostream;
+	if(packet_file)
+	{
+		mvs_ostream.open(stream_file, std::ofstream::binary);
+		PACKET::write_file_header(mvs_ostream);
+	}
+	else
+	{
+		// An index from an earlier encode must not outlive the streams it describes, whether or not a new one is written
+		std::remove(GOP_INDEX::filename_for("mvs.db").c_str());
+		mvs_ostream.open("mvs.db", std::ofstream::binary);
+		res_ostream.open("res.db", std::ofstream::binary);
+	}
 	std::ofstream recon_outfile("out_recon.yuv", std::ofstream::binary);
 	
+	// Frames are read at the input size and padded from there
+	const unsigned int input_width = frame_width;
+	const unsigned int input_height = frame_height;
 	{
 		Frame temp_frame(0x80, frame_width, frame_height);
 		temp_frame.pad_for_block_size(block_size);
@@ -141,14 +225,271 @@ int main(int argc, char* argv[])
 	unsigned int P_PERIOD = I_Period - 1;
 	unsigned int num_P_frames = P_PERIOD;
 	
-	unsigned int total_bytes_written = 0;
-	double average_PSNR = 0.0;
-	
+	FrameOutputs file_outputs(mvs_ostream, res_ostream, recon_outfile, std::cout);
 	std::deque<Frame> ref_frames;
+	MV_FIELD_T mv_field;
 	
-	for (auto cur_frame : frames)
+	// Coding a frame (search, residuals, reconstruction) is all the next frame has to wait for. Writing the
+	// bitstream, the reconstruction and the metrics out is handed to a second thread through a short queue.
+	unsigned int pipeline_depth;
+	CFG_LOAD_OPT_DEFAULT("pipeline_depth", pipeline_depth, 2);
+	
+	auto write_frame = [&](CodedFrame& coded, FrameOutputs& out)
+	{
+		out.log << std::setw(6) << coded.iframe;
+		
+		// A packet carries the frame type in its header, and both parts of the frame after it
+		std::stringstream packet_mvs, packet_res;
+		std::ostream& mvs_out = packet_file ? packet_mvs : out.mvs;
+		std::ostream& res_out = packet_file ? packet_res : out.res;
+		
+		unsigned int stream_bytes_written = 0;
+		if(coded.ifr)
+		{
+			// Packet files have no res stream, and no index either
+			if(!packet_file)
+				out.gop_index.push_back(GOP_ENTRY_T{ coded.iframe, (std::uint64_t)out.mvs.tellp(), (std::uint64_t)out.res.tellp() });
+			
+			// Signal that the next frame is an IFrame
+			if(!packet_file)
+				out.mvs.put(IFRAME_ID);
+			stream_bytes_written += 1;
+			stream_bytes_written = coded.ifr->write(mvs_out, res_out);
+			
+			if(dump_debug_files)
+			{
+				mvs_txt << "Frame " << coded.iframe << ":";
+				res_txt << "Frame " << coded.iframe << ":";
+				coded.ifr->print(mvs_txt, res_txt);
+			}
+		}
+		else
+		{
+			// Signal that the next frame is a PFrame
+			if(!packet_file)
+				out.mvs.put(PFRAME_ID);
+			stream_bytes_written += 1;
+			stream_bytes_written = coded.pf->write(mvs_out, res_out);
+			
+			if(dump_debug_files)
+			{
+				mvs_txt << "Frame " << coded.iframe << ":";
+				res_txt << "Frame " << coded.iframe << ":";
+				coded.pf->print(mvs_txt, res_txt);
+			}
+		}
+		
+		if(packet_file)
+		{
+			PACKET::write(out.mvs, coded.ifr ? IFRAME_ID : PFRAME_ID, packet_mvs.str(), packet_res.str());
+			// Whatever's reading the other end of a pipe can start on the frame right away
+			out.mvs.flush();
+		}
+		
+		// We need to construct the reconstructed frame as a reference anyway, so dump it
+		// so that we can diff it vs. the decoded video later.
+		coded.recon_frame.write(out.recon, false);
+		
+		// Collect and dump debug statistics
+		unsigned int SAD = coded.cur_frame.SAD(coded.recon_frame);
+		double PSNR = coded.cur_frame.PSNR(coded.recon_frame);
+		double SSIM = coded.cur_frame.SSIM(coded.recon_frame);
+		CLOCK_T::time_point frame_end = CLOCK_T::now();
+		out.log << std::setw(12) << SAD;
+		out.log << std::setw(12) << PSNR;
+		out.log << std::setw(12) << SSIM;
+		out.log << std::setw(12) << stream_bytes_written;
+		out.log << std::setw(12) << l_seconds_between(coded.begin, frame_end);
+		out.log << std::endl;
+		out.total_bytes_written += stream_bytes_written;
+		out.total_PSNR += PSNR;
+	};
+	
+	// Code one (padded) frame against ref_frames, updating them with its reconstruction for the next one. mv_field
+	// carries the previous P-frame's vectors over as predictors for the predictive search. With pyramid motion search
+	// each reconstruction gets its pyramid once here, before it's shared out as a reference, and the same goes for the
+	// block sum tables of successive elimination. The interpolated planes of sub-pel vectors only go on the copy kept as
+	// a reference, so they aren't held on to while the reconstruction waits to be written out.
+	const unsigned int pyramid_levels = PARAMS::inst().me_pyramid_levels;
+	bool successive_elimination = PARAMS::inst().me_successive_elimination;
+	if(successive_elimination && (block_size % 2 != 0 || !Frame::y_block_sums_fit(block_size / 2)))
+	{
+		std::cout << "WARNING: MESuccessiveElimination needs an even block_size of 32 or less; searching without it" << std::endl;
+		successive_elimination = false;
+	}
+	const unsigned int subpel_precision = PARAMS::inst().subpel_precision;
+	auto code_frame = [&](std::unique_ptr<CodedFrame>& coded, bool is_iframe, std::deque<Frame>& ref_frames, MV_FIELD_T& mv_field)
+	{
+		if(is_iframe)
+		{
+			coded->ifr.reset(new IFrame(coded->cur_frame, block_size, qp));
+			
+			if(dump_debug_files)
+			{
+				coded->ifr->mode_frame().write(ref_outfile);
+				coded->ifr->res_frame().write(res_outfile);
+			}
+			
+			coded->recon_frame = Frame(*coded->ifr);
+			ref_frames.clear();
+			mv_field = MV_FIELD_T();
+		}
+		else
+		{
+			if(pyramid_levels > 0)
+			{
+				coded->cur_frame.build_pyramid(pyramid_levels);
+			}
+			coded->pf.reset(new PFrame(coded->cur_frame, ref_frames, block_size, search_range, qp, mv_field.mvs.empty() ? nullptr : &mv_field));
+			mv_field = coded->pf->get_mv_field();
+			
+			if(dump_debug_files)
+			{
+				coded->pf->mv_frame(ref_frames).write(ref_outfile);
+				coded->pf->res_frame().write(res_outfile);
+			}
+			
+			coded->recon_frame = Frame(*coded->pf, ref_frames);
+		}
+		
+		if(pyramid_levels > 0)
+		{
+			coded->recon_frame.build_pyramid(pyramid_levels);
+		}
+		if(successive_elimination)
+		{
+			// The search goes by the quadrants of its blocks, the VBS halves included
+			coded->recon_frame.build_y_block_sums(block_size / 2);
+			if(PARAMS::inst().vbs_enable && block_size % 4 == 0)
+			{
+				coded->recon_frame.build_y_block_sums(block_size / 4);
+			}
+		}
+		ref_frames.push_front(coded->recon_frame);
+		if(subpel_precision > 1)
+		{
+			ref_frames.front().build_subpel_planes(subpel_precision);
+		}
+		if(ref_frames.size() > max_refs)
+		{
+			ref_frames.pop_back();
+		}
+	};
+	
+	BoundedQueue< std::unique_ptr<CodedFrame> > coded_frames(std::max(pipeline_depth, 1u));
+	std::thread writer;
+	if(pipeline_depth > 0)
+	{
+		writer = std::thread([&]()
+		{
+			std::unique_ptr<CodedFrame> coded;
+			while(coded_frames.pop(coded))
+			{
+				write_frame(*coded, file_outputs);
+			}
+		});
+	}
+	
+	// Every GOP starts from an I-frame with no references, so with ParallelGOPs=N the input is read N GOPs at a time and
+	// those are coded side by side into in-memory fragments of the outputs, which are then appended in order. The debug
+	// dumps (and the hardware model's stimulus) are written while a frame is being coded, so those keep to one at a time.
+	unsigned int parallel_gops;
+	CFG_LOAD_OPT_DEFAULT("ParallelGOPs", parallel_gops, 0);
+#ifdef JUAN_DEBUG
+	parallel_gops = 0;
+#endif
+	if(parallel_gops > 1 && (I_Period == 0 || dump_debug_files || debug_res_est || PARAMS::inst().hw_enable))
+	{
+		std::cout << "WARNING: ParallelGOPs needs I_Period > 0, no debug dumps and no hardware model; coding one frame at a time" << std::endl;
+		parallel_gops = 0;
+	}
+	
+	// The source stops handing out frames once num_frames have been read
+	unsigned int num_read = 0;
+	auto next_input_frame = [&]() -> const BYTE_T*
+	{
+		if(num_frames != 0 && num_read == num_frames)
+		{
+			return nullptr;
+		}
+		const BYTE_T* frame_bytes = source.next_frame();
+		if(frame_bytes != nullptr)
+		{
+			++num_read;
+		}
+		return frame_bytes;
+	};
+	
+	bool input_left = true;
+	while(parallel_gops > 1 && input_left)
+	{
+		// A stream's frame buffer is reused, so frames are copied out as they're read
+		std::vector< std::unique_ptr<GOPFragment> > gops;
+		while(gops.size() < parallel_gops && input_left)
+		{
+			std::unique_ptr<GOPFragment> gop(new GOPFragment(iframe));
+			while(gop->frames.size() < I_Period)
+			{
+				const BYTE_T* frame_bytes = next_input_frame();
+				if(frame_bytes == nullptr)
+				{
+					input_left = false;
+					break;
+				}
+				gop->frames.push_back(BYTEVEC_T(frame_bytes, frame_bytes + bytes_per_frame));
+			}
+			iframe += gop->frames.size();
+			if(!gop->frames.empty())
+			{
+				gops.push_back(std::move(gop));
+			}
+		}
+		
+		ThreadPool::inst().parallel_for(0, gops.size(), [&](unsigned int igop)
+		{
+			GOPFragment& gop = *gops[igop];
+			std::deque<Frame> gop_ref_frames;
+			MV_FIELD_T gop_mv_field;
+			for(unsigned int i = 0; i < gop.frames.size(); ++i)
+			{
+				CLOCK_T::time_point frame_begin = CLOCK_T::now();
+				Frame cur_frame(gop.frames[i].data(), input_width, input_height);
+				cur_frame.pad_for_block_size(block_size);
+				BYTEVEC_T().swap(gop.frames[i]);
+				
+				std::unique_ptr<CodedFrame> coded(new CodedFrame(gop.first_frame + i, frame_begin, std::move(cur_frame)));
+				code_frame(coded, i == 0, gop_ref_frames, gop_mv_field);
+				write_frame(*coded, gop.outputs);
+			}
+		});
+		
+		for(auto& gop : gops)
+		{
+			if(!packet_file)
+			{
+				for(GOP_ENTRY_T entry : gop->outputs.gop_index)
+				{
+					entry.mvs_offset += (std::uint64_t)mvs_ostream.tellp();
+					entry.res_offset += (std::uint64_t)res_ostream.tellp();
+					file_outputs.gop_index.push_back(entry);
+				}
+			}
+			l_append(mvs_ostream, gop->mvs);
+			if(!packet_file)
+				l_append(res_ostream, gop->res);
+			l_append(recon_outfile, gop->recon);
+			l_append(std::cout, gop->log);
+			file_outputs.total_bytes_written += gop->outputs.total_bytes_written;
+			file_outputs.total_PSNR += gop->outputs.total_PSNR;
+		}
+	}
+	
+	// Frames are pulled from the source one at a time; only the reference frames are kept around. If the GOPs above
+	// already ran out of input, asking the source again would lose its count of trailing bytes.
+	while (const BYTE_T* frame_bytes = input_left ? next_input_frame() : nullptr)
 	{	
-		clock_t frame_begin = std::clock();
+		CLOCK_T::time_point frame_begin = CLOCK_T::now();
+		Frame cur_frame(frame_bytes, input_width, input_height);
 #ifdef JUAN_DEBUG
 		std::string filename = "p_mb_info_" + std::to_string(iframe) + ".txt";
 		std::string filename2 = "p_cache_rtl" + std::to_string(iframe) + ".txt";
@@ -178,88 +519,23 @@ int main(int argc, char* argv[])
 		p_MEcache_rtl.open(filename5);
 		p_MEmv_rtl.open(filename6);
 #endif
-		std::cout << std::setw(6) << iframe;
 		cur_frame.pad_for_block_size(block_size);
 		
 		if(dump_debug_files)
 			cur_frame.write(real_outfile, true);
 		
-		Frame recon_frame(0x80, frame_width, frame_height);
-		unsigned int stream_bytes_written = 0;
-		if(num_P_frames == P_PERIOD)
+		std::unique_ptr<CodedFrame> coded(new CodedFrame(iframe, frame_begin, std::move(cur_frame)));
+		bool is_iframe = (num_P_frames == P_PERIOD);
+		code_frame(coded, is_iframe, ref_frames, mv_field);
+		num_P_frames = is_iframe ? 0 : num_P_frames + 1;
+		
+		if(pipeline_depth > 0)
 		{
-			IFrame ifr(cur_frame, block_size, qp);
-			
-			if(dump_debug_files)
-			{
-				ifr.mode_frame().write(ref_outfile);
-				ifr.res_frame().write(res_outfile);
-			}
-			
-			// Signal that the next frame is an IFrame
-			mvs_ostream.put(IFRAME_ID);
-			stream_bytes_written += 1;
-			stream_bytes_written = ifr.write(mvs_ostream, res_ostream);
-			
-			if(dump_debug_files)
-			{
-				mvs_txt << "Frame " << iframe << ":";
-				res_txt << "Frame " << iframe << ":";
-				ifr.print(mvs_txt, res_txt);
-			}
-			
-			recon_frame = Frame(ifr);
-			num_P_frames = 0;
-			ref_frames.clear();
+			coded_frames.push(std::move(coded));
 		}
 		else
 		{
-			PFrame pf(cur_frame, ref_frames, block_size, search_range, qp);
-			
-			if(dump_debug_files)
-			{
-				pf.mv_frame(ref_frames).write(ref_outfile);
-				pf.res_frame().write(res_outfile);
-			}
-			
-			// Signal that the next frame is a PFrame
-			mvs_ostream.put(PFRAME_ID);
-			stream_bytes_written += 1;
-			stream_bytes_written = pf.write(mvs_ostream, res_ostream);
-			
-			if(dump_debug_files)
-			{
-				mvs_txt << "Frame " << iframe << ":";
-				res_txt << "Frame " << iframe << ":";
-				pf.print(mvs_txt, res_txt);
-			}
-			
-			recon_frame = Frame(pf, ref_frames);
-			++num_P_frames;
-		}
-		
-		// We need to construct the reconstructed frame as a reference anyway, so dump it
-		// so that we can diff it vs. the decoded video later.
-		recon_frame.write(recon_outfile, false);
-		
-		// Collect and dump debug statistics
-		unsigned int SAD = cur_frame.SAD(recon_frame);
-		double PSNR = cur_frame.PSNR(recon_frame);
-		double SSIM = cur_frame.SSIM(recon_frame);
-		clock_t frame_end = std::clock();
-		std::cout << std::setw(12) << SAD;
-		std::cout << std::setw(12) << PSNR;
-		std::cout << std::setw(12) << SSIM;
-		std::cout << std::setw(12) << stream_bytes_written;
-		std::cout << std::setw(12) << double(frame_end - frame_begin) / CLOCKS_PER_SEC;
-		std::cout << std::endl;
-		total_bytes_written += stream_bytes_written;
-		average_PSNR += PSNR;
-		
-		ref_frames.push_front(recon_frame);
-		if(ref_frames.size() > max_refs)
-		{
-			ref_frames.pop_back();
+			write_frame(*coded, file_outputs);
 		}
 		
 		++iframe;
@@ -281,24 +557,48 @@ int main(int argc, char* argv[])
 		p_MEmv_rtl.close();
 #endif
 	}
+	coded_frames.close();
+	if(writer.joinable())
+	{
+		writer.join();
+	}
+	
 	std::cout << std::endl;
+	if (source.get_trailing_bytes() != 0)
+	{
+		std::cout << "Error: Unexpected bytestream length; " << source.get_trailing_bytes() << " extra bytes!" << std::endl;
+	}
+	if (num_frames != 0 && iframe != num_frames)
+	{
+		std::cout << "WARNING: Expected " << num_frames << " frames, encoded " << iframe << std::endl;
+	}
 	real_outfile.close();
 	ref_outfile.close();
 	res_outfile.close();
 	recon_outfile.close();
+	const std::uint64_t mvs_size = (std::uint64_t)mvs_ostream.tellp();
+	const std::uint64_t res_size = (std::uint64_t)res_ostream.tellp();
 	mvs_ostream.close();
 	res_ostream.close();
 	
-	clock_t overall_end = std::clock();
-	std::cout << "Total_Time:" << std::setw(12) << double(overall_end - overall_begin) / CLOCKS_PER_SEC << std::endl;
-	std::cout << "Total_Bytes:" << std::setw(12) << total_bytes_written << std::endl;
-	std::cout << "Average_PSNR:" << std::setw(12) << average_PSNR / (double)num_frames << std::endl;
+	// Lets the decoder start at any GOP; packet files don't need one, their packet headers say where each frame is
+	bool gop_index;
+	CFG_LOAD_OPT_DEFAULT("GOPIndex", gop_index, true);
+	if(gop_index && !packet_file)
+	{
+		GOP_INDEX::write(GOP_INDEX::filename_for("mvs.db"), file_outputs.gop_index, iframe, mvs_size, res_size);
+	}
+	
+	CLOCK_T::time_point overall_end = CLOCK_T::now();
+	std::cout << "Total_Time:" << std::setw(12) << l_seconds_between(overall_begin, overall_end) << std::endl;
+	std::cout << "Total_Bytes:" << std::setw(12) << file_outputs.total_bytes_written << std::endl;
+	std::cout << "Average_PSNR:" << std::setw(12) << file_outputs.total_PSNR / (double)std::max(iframe, 1u) << std::endl;
 	if(debug_csv || debug_res_est)
 	{
 		if(debug_res_est)
 			DEBUG_CSV::push(std::vector<std::string>({ "" }));
-		DEBUG_CSV::push( std::vector<std::string>({ "Total Time", std::to_string(double(overall_end - overall_begin) / CLOCKS_PER_SEC ) }) );
-		DEBUG_CSV::push( std::vector<std::string>({ "Total Bytes", std::to_string(total_bytes_written) }) );
-		DEBUG_CSV::push( std::vector<std::string>({ "Average PSNR", std::to_string(average_PSNR / (double)num_frames) }) );
+		DEBUG_CSV::push( std::vector<std::string>({ "Total Time", std::to_string(l_seconds_between(overall_begin, overall_end) ) }) );
+		DEBUG_CSV::push( std::vector<std::string>({ "Total Bytes", std::to_string(file_outputs.total_bytes_written) }) );
+		DEBUG_CSV::push( std::vector<std::string>({ "Average PSNR", std::to_string(file_outputs.total_PSNR / (double)std::max(iframe, 1u)) }) );
 	}
 }
\ No newline at end of file
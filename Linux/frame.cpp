@@ -4,8 +4,15 @@
 #include <map>
 #include <tuple>
 #include <limits>
+#include <iterator>
+#include <algorithm>
+#include <numeric>
+#include <mutex>
+#include <condition_variable>
 
 #include "frame.h"
+#include "simd.h"
+#include "thread_pool.h"
 
 COORD_T calculate_next_coord(const COORD_T& cur_coord, unsigned int full_block_size, unsigned int cur_block_size, unsigned int frame_width)
 {
@@ -54,24 +61,31 @@ m_height(height)
 		assert (bytes.size() == (m_width*height));
 	}
 	
-	auto it = bytes.begin();
-	y_values = ByteMatrix(BYTEVEC_T(it, it + m_width*m_height), m_width, m_height);
-	it += m_width*m_height;
+	const BYTE_T* plane = &bytes[0];
+	y_values = ByteMatrix(ByteBlockView(plane, m_width, m_width, m_height));
+	plane += m_width*m_height;
 	
 	if (y_only)
 	{
-		u_values = ByteMatrix(BYTEVEC_T(m_width*m_height/4, 0x80), m_width/2, m_height/2);
-		v_values = ByteMatrix(BYTEVEC_T(m_width*m_height/4, 0x80), m_width/2, m_height/2);
+		u_values = ByteMatrix(0x80, m_width/2, m_height/2);
+		v_values = ByteMatrix(0x80, m_width/2, m_height/2);
 	}
 	else
 	{
-		u_values = ByteMatrix(BYTEVEC_T(it, it + m_width*m_height/4), m_width/2, m_height/2);
-		it += m_width*m_height/4;
+		u_values = ByteMatrix(ByteBlockView(plane, m_width/2, m_width/2, m_height/2));
+		plane += m_width*m_height/4;
 		
-		v_values = ByteMatrix(BYTEVEC_T(it, it + m_width*m_height/4), m_width/2, m_height/2);
-		it += m_width*m_height/4;
+		v_values = ByteMatrix(ByteBlockView(plane, m_width/2, m_width/2, m_height/2));
 	}
-	assert(it == bytes.end());
+}
+
+Frame::Frame(const BYTE_T* bytes, unsigned int width, unsigned int height) :
+m_width(width),
+m_height(height),
+y_values(ByteBlockView(bytes, width, width, height)),
+u_values(ByteBlockView(bytes + width*height, width/2, width/2, height/2)),
+v_values(ByteBlockView(bytes + width*height + width*height/4, width/2, width/2, height/2))
+{
 }
 
 Frame::Frame(BLOCKVEC_T y_blocks, unsigned int block_size, unsigned int width, unsigned int height) 
@@ -100,32 +114,39 @@ Frame::Frame(std::vector<ResidualBlock> residuals, unsigned int block_size, unsi
 Frame::Frame(const PFrame& pf, const std::deque<Frame>& refs)
 {
 	unsigned int block_size = pf.get_block_size();
-	BLOCKVEC_T recon_blocks;
 
 	unsigned int frame_width  = refs[0].get_width();
 	unsigned int frame_height = refs[0].get_height();
 	
-	auto pf_refs = pf.get_refs();
-	COORD_T block_coord({0, 0});
+	const PF_REF_VEC_T& pf_refs = pf.get_refs();
+	BLOCKVEC_T recon_blocks(pf_refs.size());
 	
-	unsigned int i = 0;
-	while(block_coord.first < frame_height)
+	// Where each block goes only depends on the sizes of the ones before it
+	COORD_T block_coord({0, 0});
+	for(unsigned int i = 0; i < pf_refs.size(); ++i)
 	{
-		MV_T ref_mv = pf_refs[i].first;
-		COORD_T ref_coord = PFrame::mv_to_coord(ref_mv, block_coord);
-		unsigned int iref = (unsigned int)ref_mv.i;
-		assert(iref < refs.size());
-	
-		auto ref_block = refs[iref].get_y_block_at(ref_coord, pf_refs[i].second.get_block_size());
-		ByteMatrix recon_block = pf_refs[i].second.reconstruct_from(ref_block);
-		
-		recon_blocks.push_back(BLOCK_T(block_coord, recon_block));
-		
+		assert(block_coord.first < frame_height);
+		recon_blocks[i].first = block_coord;
 		block_coord = calculate_next_coord(block_coord, block_size, pf_refs[i].second.get_block_size(), frame_width);
-		++i;
 	}
 	assert(block_coord.first == frame_height);
 	
+	// Given the reference frames the blocks are independent of each other, so they're reconstructed in parallel
+	const unsigned int blocks_per_job = 64;
+	ThreadPool::inst().parallel_for(0, (pf_refs.size() + blocks_per_job - 1) / blocks_per_job, [&](unsigned int ijob)
+	{
+		for(unsigned int i = ijob * blocks_per_job; i < std::min<std::size_t>((ijob + 1) * blocks_per_job, pf_refs.size()); ++i)
+		{
+			MV_T ref_mv = pf_refs[i].first;
+			COORD_T ref_coord = PFrame::mv_to_coord(ref_mv, recon_blocks[i].first);
+			unsigned int iref = (unsigned int)ref_mv.i;
+			assert(iref < refs.size());
+			
+			ByteBlockView ref_block = refs[iref].get_y_block_view_at(ref_coord, pf_refs[i].second.get_block_size(), ref_mv.fy, ref_mv.fx);
+			recon_blocks[i].second = pf_refs[i].second.reconstruct_from(ref_block);
+		}
+	});
+	
 	init_from_y_blocks(recon_blocks, block_size, frame_width, frame_height, pf.get_block_colours());
 }
 
@@ -152,11 +173,8 @@ BYTE_T v_colour(const int icolour)
 
 ByteMatrix get_u_block(const int icolour, const unsigned int block_size)
 {
-	bool colour_blocks;
-	CFG_LOAD_OPT_DEFAULT("debug_colour_blocks", colour_blocks, false);
-	
 	ByteMatrix ret(0x80, block_size, block_size);
-	if(colour_blocks)
+	if(PARAMS::inst().debug_colour_blocks)
 	{
 		ret = ByteMatrix::generate_border_block(u_colour(icolour), 0xFF, block_size, block_size);
 	}
@@ -165,11 +183,8 @@ ByteMatrix get_u_block(const int icolour, const unsigned int block_size)
 
 ByteMatrix get_v_block(const int icolour, const unsigned int block_size)
 {
-	bool colour_blocks;
-	CFG_LOAD_OPT_DEFAULT("debug_colour_blocks", colour_blocks, false);
-	
 	ByteMatrix ret(0x80, block_size, block_size);
-	if(colour_blocks)
+	if(PARAMS::inst().debug_colour_blocks)
 	{
 		ret = ByteMatrix::generate_border_block(v_colour(icolour), 0x40, block_size, block_size);
 	}
@@ -285,17 +300,18 @@ void Frame::pad_height(unsigned int n)
 
 void Frame::write(std::ostream& out, bool write_y_only)
 {
-	out.write(reinterpret_cast<char*>(&y_values.as_vec()[0]), y_values.as_vec().size());
+	y_values.write(out);
 	
 	if (write_y_only)
 	{
-		out.write(reinterpret_cast<char*>(&BYTEVEC_T(u_values.as_vec().size(), 0x80)[0]), u_values.as_vec().size());
-		out.write(reinterpret_cast<char*>(&BYTEVEC_T(v_values.as_vec().size(), 0x80)[0]), v_values.as_vec().size());
+		BYTEVEC_T blank(u_values.get_size(), 0x80);
+		out.write(reinterpret_cast<char*>(&blank[0]), blank.size());
+		out.write(reinterpret_cast<char*>(&blank[0]), blank.size());
 	}
 	else
 	{
-		out.write(reinterpret_cast<char*>(&u_values.as_vec()[0]), u_values.as_vec().size());
-		out.write(reinterpret_cast<char*>(&v_values.as_vec()[0]), v_values.as_vec().size());
+		u_values.write(out);
+		v_values.write(out);
 	}
 }
 
@@ -341,6 +357,108 @@ void Frame::pad_for_block_size(unsigned int i)
 	}
 }
 
+void Frame::build_pyramid(unsigned int num_levels)
+{
+	std::shared_ptr< std::vector<ByteMatrix> > levels = std::make_shared< std::vector<ByteMatrix> >();
+	levels->reserve(num_levels);
+	const ByteMatrix* finer = &y_values;
+	for(unsigned int level = 1; level <= num_levels && finer->get_width() >= 2 && finer->get_height() >= 2; ++level)
+	{
+		levels->push_back(finer->downsample());
+		finer = &levels->back();
+	}
+	m_pyramid = levels;
+}
+
+void Frame::build_y_block_sums(unsigned int i)
+{
+	assert(y_block_sums_fit(i) && i > 0 && i <= m_width && i <= m_height);
+	// Sums of i pixels down each column, slid down a row at a time; each row of block sums slides i of those across
+	const unsigned int cols = m_width - i + 1, rows = m_height - i + 1;
+	std::vector<unsigned int> column_sums(m_width, 0);
+	for(unsigned int y = 0; y < i; ++y)
+	{
+		for(unsigned int x = 0; x < m_width; ++x)
+		{
+			column_sums[x] += y_values[y][x];
+		}
+	}
+	std::shared_ptr< std::vector<std::uint16_t> > sums = std::make_shared< std::vector<std::uint16_t> >(rows * cols);
+	for(unsigned int y = 0; y < rows; ++y)
+	{
+		unsigned int sum = std::accumulate(column_sums.begin(), column_sums.begin() + i, 0u);
+		(*sums)[y * cols] = sum;
+		for(unsigned int x = 1; x < cols; ++x)
+		{
+			sum += column_sums[x + i - 1] - column_sums[x - 1];
+			(*sums)[y * cols + x] = sum;
+		}
+		for(unsigned int x = 0; y + 1 < rows && x < m_width; ++x)
+		{
+			column_sums[x] += y_values[y + i][x] - y_values[y][x];
+		}
+	}
+	m_y_block_sums[i] = sums;
+}
+
+void Frame::add_y_block_sum_distances(COORD_T coord, unsigned int i, unsigned int num_blocks, unsigned int sum, unsigned int* distances) const
+{
+	auto table = m_y_block_sums.find(i);
+	assert(table != m_y_block_sums.end());
+	assert(coord.first + i <= m_height && coord.second + i + num_blocks - 1 <= m_width);
+	SIMD::block_sum_distances(&(*table->second)[coord.first * (m_width - i + 1) + coord.second], sum, num_blocks, distances);
+}
+
+void Frame::build_subpel_planes(unsigned int precision)
+{
+	assert(precision == 2 || precision == 4);
+	const int step = SUBPEL_UNITS / precision;
+	
+	// Bilinear interpolation between each pixel and its neighbours right, below, and below right, with the last row and
+	// column repeated past the edge. Plane frac_y*SUBPEL_UNITS + frac_x; the whole-pel plane (0) is y_values itself.
+	std::shared_ptr< std::vector<ByteMatrix> > planes = std::make_shared< std::vector<ByteMatrix> >(SUBPEL_UNITS * SUBPEL_UNITS);
+	ThreadPool::inst().parallel_for(1, SUBPEL_UNITS * SUBPEL_UNITS, [&](unsigned int iplane)
+	{
+		const int frac_y = iplane / SUBPEL_UNITS, frac_x = iplane % SUBPEL_UNITS;
+		if(frac_y % step != 0 || frac_x % step != 0)
+		{
+			return;
+		}
+		
+		ByteMatrix plane(0x00, m_width, m_height);
+		const int w00 = (SUBPEL_UNITS - frac_y) * (SUBPEL_UNITS - frac_x), w01 = (SUBPEL_UNITS - frac_y) * frac_x;
+		const int w10 = frac_y * (SUBPEL_UNITS - frac_x), w11 = frac_y * frac_x;
+		for(unsigned int i = 0; i < m_height; ++i)
+		{
+			const BYTE_T* r0 = y_values[i];
+			const BYTE_T* r1 = y_values[std::min(i + 1, m_height - 1)];
+			BYTE_T* dst = plane[i];
+			for(unsigned int j = 0; j < m_width; ++j)
+			{
+				const unsigned int j1 = std::min(j + 1, m_width - 1);
+				dst[j] = BYTE_T((w00*r0[j] + w01*r0[j1] + w10*r1[j] + w11*r1[j1] + SUBPEL_UNITS*SUBPEL_UNITS/2) / (SUBPEL_UNITS*SUBPEL_UNITS));
+			}
+		}
+		(*planes)[iplane] = std::move(plane);
+	});
+	m_subpel_planes = planes;
+}
+
+ByteBlockView Frame::get_y_block_view_at(COORD_T coord, unsigned int i, unsigned int frac_y, unsigned int frac_x) const
+{
+	assert(frac_y < (unsigned int)SUBPEL_UNITS && frac_x < (unsigned int)SUBPEL_UNITS);
+	if(frac_y == 0 && frac_x == 0)
+	{
+		return get_y_block_view_at(coord, i);
+	}
+	if(!m_subpel_planes || (*m_subpel_planes)[frac_y * SUBPEL_UNITS + frac_x].get_width() == 0)
+	{
+		std::cout << "ERROR: No interpolated plane for a vector of +" << frac_y << "/4, +" << frac_x << "/4; is SubPelPrecision the same as the encoder's?" << std::endl;
+		assert(false);
+	}
+	return (*m_subpel_planes)[frac_y * SUBPEL_UNITS + frac_x].get_block_view_at(coord, i);
+}
+
 BLOCKVEC_T Frame::get_y_block_vec(unsigned int i) const
 {
 	if (m_width % i != 0 || m_height % i != 0)
@@ -363,81 +481,557 @@ BLOCKVEC_T Frame::get_y_block_vec(unsigned int i) const
 // BEGIN PFRAME
 //**************************************************************************
 
+// Queue of search vectors within a fixed window; each vector is only ever queued once. Storage is
+// sized for the whole window up front so that queueing candidates never allocates.
 class SearchQ
 {
 public:
-	SearchQ() {}
+	SearchQ(int min_i, int max_i, int min_j, int max_j) 
+	: m_min_i(min_i), m_min_j(min_j), m_window_width(max_j - min_j + 1), m_next(0), 
+	  m_vecs_pushed((max_i - min_i + 1) * (max_j - min_j + 1), false)
+	{
+		m_vecs_to_search.reserve(m_vecs_pushed.size());
+	}
 	
 	void push(const std::pair<int, int>& v)
 	{
-		if(m_vecs_pushed.find(v) == m_vecs_pushed.end())
+		unsigned int index = (v.first - m_min_i) * m_window_width + (v.second - m_min_j);
+		assert(v.first >= m_min_i && v.second >= m_min_j && v.second - m_min_j < m_window_width && index < m_vecs_pushed.size());
+		if(!m_vecs_pushed[index])
 		{
-			m_vecs_to_search.push(v);
-			m_vecs_pushed[v] = true;
+			m_vecs_to_search.push_back(v);
+			m_vecs_pushed[index] = true;
 		}
 	}
 	
 	std::pair<int, int> pop()
 	{
-		std::pair<int, int> ret = m_vecs_to_search.front();
-		m_vecs_to_search.pop();
-		return ret;
+		return m_vecs_to_search[m_next++];
 	}
 	
-	bool empty() { return m_vecs_to_search.empty(); }
+	bool empty() { return m_next == m_vecs_to_search.size(); }
 	
 private:
-	std::queue < std::pair<int, int> > m_vecs_to_search;
-	std::map < std::pair<int, int>, bool > m_vecs_pushed;
+	int m_min_i;
+	int m_min_j;
+	int m_window_width;
+	unsigned int m_next;
+	std::vector < std::pair<int, int> > m_vecs_to_search;
+	std::vector < bool > m_vecs_pushed;
 };
 
-std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref (
+// Tie-breaks between equal costs favour the shorter vector, then the smaller |x|, then the smaller |y|
+static bool l_is_better_candidate(unsigned int cost, const MV_T& mv, unsigned int min_cost, const MV_T& best_mv)
+{
+	return 	( cost <   min_cost ) ||
+			( cost == min_cost && (PFrame::dx_plus_dy(mv) <   PFrame::dx_plus_dy(best_mv)) ) ||
+			( cost == min_cost && (PFrame::dx_plus_dy(mv) == PFrame::dx_plus_dy(best_mv)) && (abs(mv.x) < abs(best_mv.x))	) ||
+			( cost == min_cost && (PFrame::dx_plus_dy(mv) == PFrame::dx_plus_dy(best_mv)) && (abs(mv.x) == abs(best_mv.x)) && (abs(mv.y) < abs(best_mv.y))	);
+}
+
+std::tuple<unsigned int, ByteBlockView, MV_T> PFrame::full_search_ref (
 	const COORD_T& cur_coord, 
-	const ByteMatrix& cur_block,
-	const std::deque<Frame>& ref_frames, 
+	const ByteBlockView& cur_block,
+	const Frame& ref_frame, 
+	unsigned int iref,
 	int r, 
 	unsigned int block_size,
 	unsigned int qp,
-	bool fast_me,
-	const MV_T& last_mv ) 
+	const MV_T& last_mv,
+	const ME_PREDICTORS_T& predictors ) 
 {
-	static int search_i, search_j, i_x, i_y;
+	const unsigned int good_enough_cost = PARAMS::inst().me_good_enough * block_size * block_size;
 	
-	unsigned int min_cost = 0;
-	ByteMatrix best_ref_block;
-	MV_T res_mv;
+	// Start from the zero vector: static areas match there, and anything costing more can be given up on as soon
+	// as its partial SAD goes past it. The cost is never less than the SAD, so those can't have been any better.
+	// (0, 0) wins ties with every other vector, so scoring it again in the scan below changes nothing.
+	ByteBlockView best_ref_block = ref_frame.get_y_block_view_at(cur_coord, block_size);
+	MV_T res_mv = PFrame::coords_to_mv(cur_coord, cur_coord);
+	unsigned int min_cost = ResidualBlock::estimate_rd_cost(cur_block, best_ref_block, qp, (res_mv == last_mv)? 0 : MV_COST_BYTES);
+	res_mv.i = iref;
+	// A perfect match there can't be beaten either
+	if(min_cost <= good_enough_cost)
+	{
+		return std::make_tuple(min_cost, best_ref_block, res_mv);
+	}
 	
-	for(unsigned int iref = 0; iref < ref_frames.size(); ++iref)
+	int min_i = std::max(-r, -int(cur_coord.first));
+	int max_i = std::min( r, int(ref_frame.get_height()) - int(block_size) - int(cur_coord.first));
+	int min_j = std::max(-r, -int(cur_coord.second));
+	int max_j = std::min( r, int(ref_frame.get_width()) - int(block_size) - int(cur_coord.second));
+	
+	// With successive elimination, the SAD is at least |sum(cur) - sum(ref)| added up over the quadrants of the blocks,
+	// and so a vector whose quadrant sums are further apart than that from the current block's can't win once it's past
+	// the SAD budget (below); its SAD isn't taken. The ones skipped couldn't have changed the result. Going by quadrants
+	// rather than whole blocks rules out about twice as many.
+	const unsigned int half = block_size / 2;
+	const bool successive_elimination = (block_size % 2 == 0) && ref_frame.has_y_block_sums(half);
+	unsigned int cur_quadrant_sums[4] = {};
+	for(unsigned int q = 0; successive_elimination && q < 4; ++q)
+	{
+		cur_quadrant_sums[q] = ByteBlockView(cur_block[(q / 2) * half] + (q % 2) * half, cur_block.get_stride(), half, half).sum();
+	}
+	
+	// The predictors are in the window too, so the scan can't end up any worse than the best of them, and anything costing
+	// more can be given up on from the start. They're only used for that bound: which vector wins is still up to the
+	// scan, so the result is the same as without them. (Stopping at a good enough vector depends on which one the scan
+	// meets first, so they're left out of that.)
+	unsigned int predicted_cost = min_cost;
+	for(const MV_T& mv : predictors.mvs)
 	{
-		SearchQ search_vectors;
+		if(good_enough_cost > 0 || mv.y < min_i || mv.y > max_i || mv.x < min_j || mv.x > max_j)
+		{
+			continue;
+		}
+		ByteBlockView ref_block = ref_frame.get_y_block_view_at(COORD_T(cur_coord.first + mv.y, cur_coord.second + mv.x), block_size);
+		unsigned int SAD_bound = ResidualBlock::max_SAD_within_cost(qp, predicted_cost);
+		unsigned int SAD = cur_block.SAD(ref_block, SAD_bound);
+		if(SAD <= SAD_bound)
+		{
+			unsigned int mv_bytes = (MV_T(mv.x, mv.y, 0) == last_mv)? 0 : MV_COST_BYTES;
+			predicted_cost = std::min(predicted_cost, ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes, SAD));
+		}
+	}
+	
+	// A vector can only win by costing no more than the best so far. The RD cost never goes down as the SAD goes up, so
+	// SADs are given up on once they're past the largest one that could still cost that little (the cost itself for
+	// rdo_estimation 0 and 2, less for 1, whose estimate only goes by the SAD).
+	auto SAD_budget_for = [&](unsigned int cost)
+	{
+		return ResidualBlock::max_SAD_within_cost(qp, std::min(cost, predicted_cost));
+	};
+	unsigned int SAD_budget = SAD_budget_for(min_cost);
+	
+	// Cost a vector whose SAD is within budget, keeping it if it's the best yet; true once one is good enough
+	auto consider = [&](int search_i, int search_j, const ByteBlockView& ref_block, unsigned int SAD) -> bool
+	{
+		COORD_T search_coord(cur_coord.first + search_i, cur_coord.second + search_j);
+		MV_T search_mv = PFrame::coords_to_mv(cur_coord, search_coord);
+		unsigned int mv_bytes = (search_mv == last_mv)? 0 : MV_COST_BYTES;
+		unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes, SAD);
 		
-		if(fast_me)
+		if ( l_is_better_candidate(cost, search_mv, min_cost, res_mv) )
+		{
+			best_ref_block = ref_block;
+			
+			res_mv = search_mv;
+			res_mv.i = iref;
+			
+			min_cost = cost;
+			SAD_budget = SAD_budget_for(min_cost);
+			return good_enough_cost > 0 && min_cost <= good_enough_cost;
+		}
+		return false;
+	};
+	
+	// Every vector in the window gets searched, so there's nothing for the nearest neighbour pushes of the fast search to add.
+	// Score the legal part of each row of the window at once instead, in raster order.
+	std::vector<unsigned int> row_sads(2*r + 1), row_bounds(2*r + 1);
+	for(int search_i = min_i; search_i <= max_i && min_j <= max_j; ++search_i)
+	{
+		COORD_T row_coord(cur_coord.first + search_i, cur_coord.second + min_j);
+		ByteBlockView row_start = ref_frame.get_y_block_view_at(row_coord, block_size);
+		if(successive_elimination)
 		{
-			// Search in a cross around 0,0; and also the previous mv
-			for (i_x = 3; i_x <= r; i_x += 3)
+			std::fill(row_bounds.begin(), row_bounds.end(), 0u);
+			for(unsigned int q = 0; q < 4; ++q)
 			{
-				search_vectors.push(std::make_pair( 0, i_x ) );
-				search_vectors.push(std::make_pair( 0, -i_x ) );
+				COORD_T quadrant_coord(row_coord.first + (q / 2) * half, row_coord.second + (q % 2) * half);
+				ref_frame.add_y_block_sum_distances(quadrant_coord, half, max_j - min_j + 1, cur_quadrant_sums[q], row_bounds.data());
 			}
-			for (i_y = 3; i_y <= r; i_y += 3)
+		}
+		SIMD::sad_row(cur_block[0], cur_block.get_stride(), row_start[0], row_start.get_stride(), block_size, block_size, max_j - min_j + 1, 
+			row_sads.data(), SAD_budget, successive_elimination ? row_bounds.data() : nullptr);
+		
+		for(int k = 0; k <= max_j - min_j; ++k)
+		{
+			// Also covers the SADs cut short or ruled out by the quadrant sums, which are past the budget
+			if(row_sads[k] > SAD_budget)
+			{
+				continue;
+			}
+			
+			ByteBlockView ref_block(row_start[0] + k, row_start.get_stride(), block_size, block_size);
+			if(consider(search_i, min_j + k, ref_block, row_sads[k]))
 			{
-				search_vectors.push(std::make_pair( i_y, 0 ) );
-				search_vectors.push(std::make_pair( -i_y, 0  ) );
+				return std::make_tuple(min_cost, best_ref_block, res_mv);
 			}
-			search_vectors.push(std::make_pair( 0, 0 ) );
-			search_vectors.push(std::make_pair( (int)last_mv.y, (int)last_mv.x ) );
 		}
-		else
+	}
+	return std::make_tuple(min_cost, best_ref_block, res_mv);
+}
+
+// Round down, unlike /, for negative numerators too
+static int l_floor_div(int n, int d)
+{
+	return (n >= 0) ? n / d : -((-n + d - 1) / d);
+}
+
+std::tuple<unsigned int, ByteBlockView, MV_T> PFrame::subpel_refine (
+	const COORD_T& cur_coord,
+	const ByteBlockView& cur_block,
+	const std::deque<Frame>& ref_frames,
+	unsigned int block_size,
+	unsigned int qp,
+	const MV_T& last_mv,
+	const std::tuple<unsigned int, ByteBlockView, MV_T>& whole_pel_result )
+{
+	unsigned int min_cost;
+	ByteBlockView best_ref_block;
+	MV_T res_mv;
+	std::tie(min_cost, best_ref_block, res_mv) = whole_pel_result;
+	
+	const Frame& ref_frame = ref_frames[res_mv.i];
+	if(!ref_frame.has_subpel_planes())
+	{
+		return whole_pel_result;
+	}
+	
+	// Each pass looks at the 8 positions a step away from the best so far, half a pixel first and then a quarter. Only a
+	// strictly lower cost moves the vector, so ties stay with the whole-pel (and shorter) one.
+	for(int step = SUBPEL_UNITS / 2; step >= SUBPEL_UNITS / int(PARAMS::inst().subpel_precision); step /= 2)
+	{
+		const int centre_y = res_mv.y * SUBPEL_UNITS + res_mv.fy, centre_x = res_mv.x * SUBPEL_UNITS + res_mv.fx;
+		for(int dy = -step; dy <= step; dy += step)
 		{
-			for(search_i = -r; search_i <= r; ++search_i)
+			for(int dx = -step; dx <= step; dx += step)
 			{
-				for(search_j = -r; search_j <= r; ++search_j)
+				if(dy == 0 && dx == 0)
 				{
-					search_vectors.push( std::make_pair(search_i, search_j) );
+					continue;
 				}
+				
+				MV_T search_mv(l_floor_div(centre_x + dx, SUBPEL_UNITS), l_floor_div(centre_y + dy, SUBPEL_UNITS), 0);
+				search_mv.fx = centre_x + dx - search_mv.x * SUBPEL_UNITS;
+				search_mv.fy = centre_y + dy - search_mv.y * SUBPEL_UNITS;
+				
+				// The whole-pel part has to be on the frame; past the last row and column the interpolation repeats the edge
+				int ref_i = int(cur_coord.first) + search_mv.y, ref_j = int(cur_coord.second) + search_mv.x;
+				if(ref_i < 0 || ref_j < 0 || ref_i + int(block_size) > int(ref_frame.get_height()) || ref_j + int(block_size) > int(ref_frame.get_width()))
+				{
+					continue;
+				}
+				
+				ByteBlockView ref_block = ref_frame.get_y_block_view_at(COORD_T(ref_i, ref_j), block_size, search_mv.fy, search_mv.fx);
+				unsigned int SAD = cur_block.SAD(ref_block, min_cost);
+				if(SAD > min_cost)
+				{
+					continue;
+				}
+				unsigned int mv_bytes = (search_mv == last_mv)? 0 : MV_COST_BYTES;
+				unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes, SAD);
+				if(cost < min_cost)
+				{
+					search_mv.i = res_mv.i;
+					res_mv = search_mv;
+					best_ref_block = ref_block;
+					min_cost = cost;
+				}
+			}
+		}
+	}
+	return std::make_tuple(min_cost, best_ref_block, res_mv);
+}
+
+// Blocks aren't downsampled below this size; there's too little left of them to match
+static const unsigned int PYRAMID_MIN_BLOCK_SIZE = 4;
+// Vectors carried from the coarsest level down to full resolution
+static const unsigned int PYRAMID_NUM_CANDIDATES = 3;
+
+std::vector<MV_T> PFrame::pyramid_search_ref (
+	const COORD_T& cur_coord,
+	const Frame& cur_frame,
+	const Frame& ref_frame,
+	int r,
+	unsigned int block_size )
+{
+	std::vector<MV_T> candidates;
+	unsigned int num_levels = std::min(cur_frame.get_num_pyramid_levels(), ref_frame.get_num_pyramid_levels());
+	while(num_levels > 0 && (block_size >> num_levels) < PYRAMID_MIN_BLOCK_SIZE)
+	{
+		--num_levels;
+	}
+	if(num_levels == 0)
+	{
+		return candidates;
+	}
+	
+	// SAD of the block against vector (i, j) at one level, or false if that's off the frame or out of the (scaled) search range
+	auto level_SAD = [&](unsigned int level, int search_i, int search_j, unsigned int bound, unsigned int& SAD) -> bool
+	{
+		const ByteMatrix& cur_level = cur_frame.get_pyramid_level(level);
+		const ByteMatrix& ref_level = ref_frame.get_pyramid_level(level);
+		const unsigned int level_block_size = block_size >> level;
+		const int level_r = r >> level;
+		const int cur_i = int(cur_coord.first >> level), cur_j = int(cur_coord.second >> level);
+		if( std::abs(search_i) > level_r || std::abs(search_j) > level_r ||
+			cur_i + search_i < 0 || cur_i + search_i + int(level_block_size) > int(ref_level.get_height()) ||
+			cur_j + search_j < 0 || cur_j + search_j + int(level_block_size) > int(ref_level.get_width()) )
+		{
+			return false;
+		}
+		ByteBlockView cur_block = cur_level.get_block_view_at(COORD_T(cur_i, cur_j), level_block_size);
+		SAD = cur_block.SAD(ref_level.get_block_view_at(COORD_T(cur_i + search_i, cur_j + search_j), level_block_size), bound);
+		return true;
+	};
+	
+	// Search the coarsest level in full, keeping the few best vectors (best first)
+	std::vector< std::pair<unsigned int, MV_T> > best;
+	const int coarse_r = r >> num_levels;
+	for(int search_i = -coarse_r; search_i <= coarse_r; ++search_i)
+	{
+		for(int search_j = -coarse_r; search_j <= coarse_r; ++search_j)
+		{
+			const bool full = best.size() == PYRAMID_NUM_CANDIDATES;
+			unsigned int SAD = 0;
+			MV_T search_mv(search_j, search_i, 0);
+			if(!level_SAD(num_levels, search_i, search_j, full ? best.back().first : SIMD::SAD_NO_BOUND, SAD) ||
+				(full && !l_is_better_candidate(SAD, search_mv, best.back().first, best.back().second)))
+			{
+				continue;
+			}
+			if(full)
+			{
+				best.pop_back();
+			}
+			auto it = best.begin();
+			while(it != best.end() && !l_is_better_candidate(SAD, search_mv, it->first, it->second))
+			{
+				++it;
+			}
+			best.insert(it, std::make_pair(SAD, search_mv));
+		}
+	}
+	
+	// Each finer level only has to look at the 3x3 square around the vector scaled up from the level above. Full
+	// resolution is left to the caller.
+	for(auto& candidate : best)
+	{
+		MV_T mv = candidate.second;
+		for(unsigned int level = num_levels - 1; level > 0; --level)
+		{
+			const int centre_i = 2*mv.y, centre_j = 2*mv.x;
+			unsigned int min_SAD = SIMD::SAD_NO_BOUND;
+			bool found = false;
+			for(int search_i = centre_i - 1; search_i <= centre_i + 1; ++search_i)
+			{
+				for(int search_j = centre_j - 1; search_j <= centre_j + 1; ++search_j)
+				{
+					unsigned int SAD = 0;
+					MV_T search_mv(search_j, search_i, 0);
+					if(level_SAD(level, search_i, search_j, min_SAD, SAD) && (!found || l_is_better_candidate(SAD, search_mv, min_SAD, mv)))
+					{
+						min_SAD = SAD;
+						mv = search_mv;
+						found = true;
+					}
+				}
+			}
+			if(!found)
+			{
+				mv = MV_T(centre_j, centre_i, 0);
+			}
+		}
+		candidates.push_back(MV_T(2*mv.x, 2*mv.y, 0));
+	}
+	return candidates;
+}
+
+// Large and small diamond search patterns, as (dy, dx)
+static const int LARGE_DIAMOND[8][2] = { {-2, 0}, {-1, -1}, {-1, 1}, {0, -2}, {0, 2}, {1, -1}, {1, 1}, {2, 0} };
+static const int SMALL_DIAMOND[4][2] = { {-1, 0}, {0, -1}, {0, 1}, {1, 0} };
+
+std::tuple<unsigned int, ByteBlockView, MV_T> PFrame::predictive_search_ref (
+	const COORD_T& cur_coord, 
+	const ByteBlockView& cur_block,
+	const Frame& ref_frame, 
+	unsigned int iref,
+	int r, 
+	unsigned int block_size,
+	unsigned int qp,
+	const MV_T& last_mv,
+	const ME_PREDICTORS_T& predictors ) 
+{
+	unsigned int min_cost = 0;
+	ByteBlockView best_ref_block;
+	MV_T res_mv;
+	
+	int min_i = std::max(-r, -int(cur_coord.first));
+	int max_i = std::min( r, int(ref_frame.get_height()) - int(block_size) - int(cur_coord.first));
+	int min_j = std::max(-r, -int(cur_coord.second));
+	int max_j = std::min( r, int(ref_frame.get_width()) - int(block_size) - int(cur_coord.second));
+	
+	// Each vector is only scored once, however many patterns it turns up in
+	const int window_width = 2*r + 1;
+	std::vector<bool> searched(window_width * window_width, false);
+	
+	// Score one vector; returns whether it's the new best
+	auto try_mv = [&](int search_i, int search_j) -> bool
+	{
+		if(search_i < min_i || search_i > max_i || search_j < min_j || search_j > max_j)
+		{
+			return false;
+		}
+		unsigned int index = (search_i + r) * window_width + (search_j + r);
+		if(searched[index])
+		{
+			return false;
+		}
+		searched[index] = true;
+		
+		COORD_T search_coord(cur_coord.first + search_i, cur_coord.second + search_j);
+		ByteBlockView ref_block = ref_frame.get_y_block_view_at(search_coord, block_size);
+		MV_T search_mv = PFrame::coords_to_mv(cur_coord, search_coord);
+		
+		// As in the other searches, a SAD past the best cost rules the vector out
+		const bool have_best = best_ref_block.get_width() != 0;
+		unsigned int SAD = cur_block.SAD(ref_block, have_best ? min_cost : SIMD::SAD_NO_BOUND);
+		if(have_best && SAD > min_cost)
+		{
+			return false;
+		}
+		unsigned int mv_bytes = (search_mv == last_mv)? 0 : MV_COST_BYTES;
+		unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes, SAD);
+		if(have_best && !l_is_better_candidate(cost, search_mv, min_cost, res_mv))
+		{
+			return false;
+		}
+		
+		best_ref_block = ref_block;
+		res_mv = search_mv;
+		res_mv.i = iref;
+		min_cost = cost;
+		return true;
+	};
+	
+	// Predictors first: no motion, the vector that's free to code, and those of the neighbouring blocks
+	try_mv(0, 0);
+	try_mv(last_mv.y, last_mv.x);
+	for(const MV_T& mv : predictors.mvs)
+	{
+		try_mv(mv.y, mv.x);
+	}
+	
+	const unsigned int good_enough_cost = std::max(predictors.early_exit_cost, PARAMS::inst().me_good_enough * block_size * block_size);
+	if(min_cost <= good_enough_cost)
+	{
+		return std::make_tuple(min_cost, best_ref_block, res_mv);
+	}
+	
+	// Follow the large diamond until its centre is the best point on it, then settle with the small one. Every
+	// step strictly improves the cost, so this ends.
+	for(bool moved = true; moved; )
+	{
+		moved = false;
+		const int centre_i = res_mv.y, centre_j = res_mv.x;
+		for(const auto& step : LARGE_DIAMOND)
+		{
+			moved = try_mv(centre_i + step[0], centre_j + step[1]) || moved;
+		}
+	}
+	for(bool moved = true; moved; )
+	{
+		moved = false;
+		const int centre_i = res_mv.y, centre_j = res_mv.x;
+		for(const auto& step : SMALL_DIAMOND)
+		{
+			moved = try_mv(centre_i + step[0], centre_j + step[1]) || moved;
+		}
+	}
+	return std::make_tuple(min_cost, best_ref_block, res_mv);
+}
+
+std::tuple<unsigned int, ByteBlockView, MV_T> PFrame::search_for_best_ref (
+	const COORD_T& cur_coord, 
+	const ByteBlockView& cur_block,
+	const Frame& cur_frame,
+	const std::deque<Frame>& ref_frames, 
+	int r, 
+	unsigned int block_size,
+	unsigned int qp,
+	ME_MODE_T me_mode,
+	const MV_T& last_mv,
+	const ME_PREDICTORS_T& predictors ) 
+{
+	int search_i, search_j, i_x, i_y;
+	
+	unsigned int min_cost = 0;
+	ByteBlockView best_ref_block;
+	MV_T res_mv;
+	
+	const unsigned int good_enough_cost = PARAMS::inst().me_good_enough * block_size * block_size;
+	
+	if(me_mode != ME_FAST && ref_frames.size() > 1 && good_enough_cost > 0)
+	{
+		// Don't bother with the older references when the latest one matches well enough in place (a window of r = 0)
+		std::tie(min_cost, best_ref_block, res_mv) = PFrame::full_search_ref(cur_coord, cur_block, ref_frames[0], 0, 0, block_size, qp, last_mv, ME_PREDICTORS_T());
+		if(min_cost <= good_enough_cost)
+		{
+			return std::make_tuple(min_cost, best_ref_block, res_mv);
+		}
+	}
+	
+	if(me_mode != ME_FAST)
+	{
+		// The searches of the references don't depend on each other, so they're spread over the thread pool. Keeping the
+		// first of equally good results in reference order picks the same vector as searching them in turn.
+		std::vector< std::tuple<unsigned int, ByteBlockView, MV_T> > ref_results(ref_frames.size());
+		ThreadPool::inst().parallel_for(0, ref_frames.size(), [&](unsigned int iref)
+		{
+			if(me_mode == ME_PYRAMID)
+			{
+				// The pyramid's vectors are where the predictive search starts from at full resolution
+				ME_PREDICTORS_T ref_predictors = predictors;
+				std::vector<MV_T> pyramid_mvs = PFrame::pyramid_search_ref(cur_coord, cur_frame, ref_frames[iref], r, block_size);
+				ref_predictors.mvs.insert(ref_predictors.mvs.end(), pyramid_mvs.begin(), pyramid_mvs.end());
+				ref_results[iref] = PFrame::predictive_search_ref(cur_coord, cur_block, ref_frames[iref], iref, r, block_size, qp, last_mv, ref_predictors);
+			}
+			else if(me_mode == ME_PREDICTIVE)
+				ref_results[iref] = PFrame::predictive_search_ref(cur_coord, cur_block, ref_frames[iref], iref, r, block_size, qp, last_mv, predictors);
+			else
+				ref_results[iref] = PFrame::full_search_ref(cur_coord, cur_block, ref_frames[iref], iref, r, block_size, qp, last_mv, predictors);
+		});
+		
+		for(auto& ref_result : ref_results)
+		{
+			unsigned int cost;
+			ByteBlockView ref_block;
+			MV_T ref_mv;
+			std::tie(cost, ref_block, ref_mv) = ref_result;
+			if ( best_ref_block.get_width() == 0 || l_is_better_candidate(cost, ref_mv, min_cost, res_mv) )
+			{
+				best_ref_block = ref_block;
+				res_mv = ref_mv;
+				min_cost = cost;
 			}
 		}
+		return std::make_tuple(min_cost, best_ref_block, res_mv);
+	}
+	
+	// The fast search only explores around candidates that beat the best so far over all references, so the
+	// references have to be searched in turn
+	for(unsigned int iref = 0; iref < ref_frames.size(); ++iref)
+	{
+		SearchQ search_vectors(-r, r, -r, r);
 		
+		// Search in a cross around 0,0; and also the previous mv
+		for (i_x = 3; i_x <= r; i_x += 3)
+		{
+			search_vectors.push(std::make_pair( 0, i_x ) );
+			search_vectors.push(std::make_pair( 0, -i_x ) );
+		}
+		for (i_y = 3; i_y <= r; i_y += 3)
+		{
+			search_vectors.push(std::make_pair( i_y, 0 ) );
+			search_vectors.push(std::make_pair( -i_y, 0  ) );
+		}
+		search_vectors.push(std::make_pair( 0, 0 ) );
+		// A sub-pel vector's whole-pel part can sit just past the window, and there's nothing to queue then
+		if(abs(last_mv.y) <= r && abs(last_mv.x) <= r)
+		{
+			search_vectors.push(std::make_pair( (int)last_mv.y, (int)last_mv.x ) );
+		}
+
 		while(!search_vectors.empty())
 		{
 			std::tie(search_i, search_j) = search_vectors.pop();
@@ -453,17 +1047,20 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref (
 				continue;
 			}
 			
-			ByteMatrix ref_block = ref_frames[iref].get_y_block_at(search_coord, block_size);
+			ByteBlockView ref_block = ref_frames[iref].get_y_block_view_at(search_coord, block_size);
 			MV_T search_mv = PFrame::coords_to_mv(cur_coord, search_coord);
-			unsigned int mv_bytes = (search_mv == last_mv)? 0 : sizeof(MV_T);
-			unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes);
 			
-			if 	( 	( best_ref_block.get_width() == 0 || best_ref_block.get_height() == 0) ||
-					( cost <   min_cost ) ||
-					( cost == min_cost && (PFrame::dx_plus_dy(search_mv) <   PFrame::dx_plus_dy(res_mv)) ) ||
-					( cost == min_cost && (PFrame::dx_plus_dy(search_mv) == PFrame::dx_plus_dy(res_mv)) && (abs(search_mv.x) < abs(res_mv.x))	) ||
-					( cost == min_cost && (PFrame::dx_plus_dy(search_mv) == PFrame::dx_plus_dy(res_mv)) && (abs(search_mv.x) == abs(res_mv.x)) && (abs(search_mv.y) < abs(res_mv.y))	)
-				)
+			// The cost is never less than the SAD, so once that's past the best cost the vector can't win
+			const bool have_best = best_ref_block.get_width() != 0;
+			unsigned int SAD = cur_block.SAD(ref_block, have_best ? min_cost : SIMD::SAD_NO_BOUND);
+			if(have_best && SAD > min_cost)
+			{
+				continue;
+			}
+			unsigned int mv_bytes = (search_mv == last_mv)? 0 : MV_COST_BYTES;
+			unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes, SAD);
+			
+			if ( !have_best || l_is_better_candidate(cost, search_mv, min_cost, res_mv) )
 			{
 				best_ref_block = ref_block;
 				
@@ -477,6 +1074,10 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref (
 				search_vectors.push(std::make_pair( search_i, std::min( r, search_j+1) ) );
 				
 				min_cost = cost;
+				if(good_enough_cost > 0 && min_cost <= good_enough_cost)
+				{
+					return std::make_tuple(min_cost, best_ref_block, res_mv);
+				}
 			}
 			
 		}
@@ -502,7 +1103,7 @@ int PFrame::GetCachePos(int cur_pos, int r , int limit, int window_width, int bl
 	return cur_pos- (block_size/2) + 1;
 
 }
-int PFrame::ME(ByteMatrix a, ByteMatrix b, int block_size, int offset_x, int offset_y) {
+int PFrame::ME(const ByteMatrix& a, const ByteMatrix& b, int block_size, int offset_x, int offset_y) {
 	int latch1 = 0;
 	int latch2 = 0;
 	int latch3 = 0;
@@ -525,7 +1126,7 @@ int PFrame::ME(ByteMatrix a, ByteMatrix b, int block_size, int offset_x, int off
 	return PE;
 }
 
-std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ search_vectors, int cache_width, int cache_height, int block_size, int a, int b) {
+std::pair<int, int> StartME(const ByteMatrix& Host_cache, const ByteBlockView& cur_block, SearchQ& search_vectors, int cache_width, int cache_height, int block_size, int a, int b) {
 	int PE[16] = { 0 };
 	int BestCost = 99999999;
 	std::pair<int, int> BestMV;
@@ -540,23 +1141,23 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 	//LOAD CUR BLOCK
 	for (int i = 0; i < block_size; i++){
 		for (int j = 0; j < block_size; j = j + 8) {
-			ME_Cur_Block.m_matrix[i][j+0] = cur_block.m_matrix[i][j+0];
-			ME_Cur_Block.m_matrix[i][j + 1] = cur_block.m_matrix[i][j + 1];
-			ME_Cur_Block.m_matrix[i][j + 2] = cur_block.m_matrix[i][j + 2];
-			ME_Cur_Block.m_matrix[i][j + 3] = cur_block.m_matrix[i][j + 3];
-			ME_Cur_Block.m_matrix[i][j + 4] = cur_block.m_matrix[i][j + 4];
-			ME_Cur_Block.m_matrix[i][j + 5] = cur_block.m_matrix[i][j + 5];
-			ME_Cur_Block.m_matrix[i][j + 6] = cur_block.m_matrix[i][j + 6];
-			ME_Cur_Block.m_matrix[i][j + 7] = cur_block.m_matrix[i][j + 7];
+			ME_Cur_Block[i][j+0] = cur_block[i][j+0];
+			ME_Cur_Block[i][j + 1] = cur_block[i][j + 1];
+			ME_Cur_Block[i][j + 2] = cur_block[i][j + 2];
+			ME_Cur_Block[i][j + 3] = cur_block[i][j + 3];
+			ME_Cur_Block[i][j + 4] = cur_block[i][j + 4];
+			ME_Cur_Block[i][j + 5] = cur_block[i][j + 5];
+			ME_Cur_Block[i][j + 6] = cur_block[i][j + 6];
+			ME_Cur_Block[i][j + 7] = cur_block[i][j + 7];
 #ifdef DUMP_STIM
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 0]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 1]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 2]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 3]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 4]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 5]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 6]) << " ";
-			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[i][j + 7]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 0]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 1]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 2]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 3]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 4]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 5]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 6]) << " ";
+			p_MEcur_block_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[i][j + 7]) << " ";
 #endif 
 
 		}
@@ -572,26 +1173,26 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 	//LOAD CACHE
 	for (int i = 0; i < cache_height; i++) {
 		for (int j = 0; j < cache_width; j = j + 8) {
-			ME_cache.m_matrix[i][j] = Host_cache.m_matrix[i][j];
-			ME_cache.m_matrix[i][j + 1] = Host_cache.m_matrix[i][j + 1];
-			ME_cache.m_matrix[i][j + 2] = Host_cache.m_matrix[i][j + 2];
-			ME_cache.m_matrix[i][j + 3] = Host_cache.m_matrix[i][j + 3];
-			ME_cache.m_matrix[i][j + 4] = Host_cache.m_matrix[i][j + 4];
-			ME_cache.m_matrix[i][j + 5] = Host_cache.m_matrix[i][j + 5];
-			ME_cache.m_matrix[i][j + 6] = Host_cache.m_matrix[i][j + 6];
+			ME_cache[i][j] = Host_cache[i][j];
+			ME_cache[i][j + 1] = Host_cache[i][j + 1];
+			ME_cache[i][j + 2] = Host_cache[i][j + 2];
+			ME_cache[i][j + 3] = Host_cache[i][j + 3];
+			ME_cache[i][j + 4] = Host_cache[i][j + 4];
+			ME_cache[i][j + 5] = Host_cache[i][j + 5];
+			ME_cache[i][j + 6] = Host_cache[i][j + 6];
 			if (j + 7< cache_width)//Corner case cache width is -1
-				ME_cache.m_matrix[i][j + 7] = Host_cache.m_matrix[i][j + 7];
+				ME_cache[i][j + 7] = Host_cache[i][j + 7];
 
 			#ifdef DUMP_STIM
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 0]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 1]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 2]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 3]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 4]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 5]) << " ";
-			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 6]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 0]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 1]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 2]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 3]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 4]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 5]) << " ";
+			p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 6]) << " ";
 			if(j+7< cache_width)
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 7]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 7]) << " ";
 			else
 				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(255) << " ";
 
@@ -599,51 +1200,51 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 
 			/*Simplified code above since we are assuming cache width is aligned to 8
 			if (j < cache_width) {
-				ME_cache.m_matrix[i][j] = Host_cache.m_matrix[i][j];
+				ME_cache[i][j] = Host_cache[i][j];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 0]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 0]) << " ";
 #endif
 			}
 			if (j + 1 < cache_width) {
-				ME_cache.m_matrix[i][j + 1] = Host_cache.m_matrix[i][j + 1];
+				ME_cache[i][j + 1] = Host_cache[i][j + 1];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 1]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 1]) << " ";
 #endif
 			}
 			if (j + 2 < cache_width) {
-				ME_cache.m_matrix[i][j + 2] = Host_cache.m_matrix[i][j + 2];
+				ME_cache[i][j + 2] = Host_cache[i][j + 2];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 2]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 2]) << " ";
 #endif
 			}
 			if (j + 3 < cache_width) {
-				ME_cache.m_matrix[i][j + 3] = Host_cache.m_matrix[i][j + 3];
+				ME_cache[i][j + 3] = Host_cache[i][j + 3];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 3]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 3]) << " ";
 #endif
 			}
 			if (j + 4 < cache_width) {
-				ME_cache.m_matrix[i][j + 4] = Host_cache.m_matrix[i][j + 4];
+				ME_cache[i][j + 4] = Host_cache[i][j + 4];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 4]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 4]) << " ";
 #endif
 			}
 			if (j + 5 < cache_width) {
-				ME_cache.m_matrix[i][j + 5] = Host_cache.m_matrix[i][j + 5];
+				ME_cache[i][j + 5] = Host_cache[i][j + 5];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 5]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 5]) << " ";
 #endif
 			}
 			if (j + 6 < cache_width) {
-				ME_cache.m_matrix[i][j + 6] = Host_cache.m_matrix[i][j + 6];
+				ME_cache[i][j + 6] = Host_cache[i][j + 6];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 6]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 6]) << " ";
 #endif
 			}
 			if (j + 7 < cache_width) {
-				ME_cache.m_matrix[i][j + 7] = Host_cache.m_matrix[i][j + 7];
+				ME_cache[i][j + 7] = Host_cache[i][j + 7];
 #ifdef DUMP_STIM
-				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i][j + 7]) << " ";
+				p_MEcache_rtl << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i][j + 7]) << " ";
 #endif
 			}*/
 		}
@@ -655,13 +1256,19 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 	p_PeCost << "MB_Y: " << a / block_size << " MB_X: " << b / block_size << "\n";
 	for (int i = 0; i <= cache_height - block_size; i++) {
 		for (int j = 0; j < cache_width ; j += block_size) {
+#ifndef JUAN_DEBUG
+			// All 16 PEs work on the same row of the cache, so score their candidates with one call
+			int num_pe = std::min(16, cache_width - block_size - j + 1);
+			if (num_pe > 0)
+				SIMD::sad_row(ME_Cur_Block[0], ME_Cur_Block.get_stride(), ME_cache[i] + j, ME_cache.get_stride(), block_size, block_size, num_pe, (unsigned int*)PE);
+#endif
 			for (int z = 0; z < 16; z++)//Make it config
 				if (j + z + block_size <= cache_width) {
 #ifdef JUAN_DEBUG
 					if (z == 0) {
 					for (int height=0; height < 16; height++) {
 						for (int width=0; width < 16; width++) {
-							p_C_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block.m_matrix[height][width]) << " ";
+							p_C_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_Cur_Block[height][width]) << " ";
 						}
 						p_C_cmodel << "\n";
 					}
@@ -669,7 +1276,7 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 
 						for (int height = 0; height < 16; height++) {
 							for (int width = 0; width < 16; width++) {
-								p_P_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i+ height][j+ width]) << " ";
+								p_P_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i+ height][j+ width]) << " ";
 							}
 							p_P_cmodel << "\n";
 						}
@@ -678,7 +1285,7 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 						for (int height = 0; height < 16; height++) {
 							for (int width = 0; width < 16; width++) {
 								if(j + width + 16 < cache_width)
-									p_P_prime_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache.m_matrix[i + height][j + width +16]) << " ";
+									p_P_prime_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(ME_cache[i + height][j + width +16]) << " ";
 								else
 									p_P_prime_cmodel << "0x" << std::setfill('0') << std::setw(2) << std::hex << int(255) << " ";
 
@@ -691,8 +1298,8 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 
 #endif
 					MV = search_vectors.pop();
-					PE[z] = PFrame::ME(ME_Cur_Block, ME_cache, block_size, j + z, i);
 #ifdef JUAN_DEBUG
+					PE[z] = PFrame::ME(ME_Cur_Block, ME_cache, block_size, j + z, i);
 					p_PeCost << "PE#" << z << " Cost=" << int(PE[z]) << " ";
 #endif
 					BestMV = (PE[z] < BestCost) ? MV : BestMV;
@@ -719,9 +1326,9 @@ std::pair<int, int> StartME(ByteMatrix Host_cache, ByteMatrix cur_block, SearchQ
 }
 
 
-std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
+std::tuple<unsigned int, ByteBlockView, MV_T> PFrame::search_for_best_ref_hw(
 	const COORD_T& cur_coord,
-	const ByteMatrix& cur_block,
+	const ByteBlockView& cur_block,
 	const std::deque<Frame>& ref_frames,
 	int r,
 	unsigned int block_size,
@@ -729,12 +1336,12 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
 	bool fast_me,
 	const MV_T& last_mv)
 {
-	static int search_i, search_j, i_x, i_y;
+	int search_i, search_j;
 
 	unsigned int min_cost = 0;
 	int cache_startX = 0;
 	int cache_startY = 0;
-	ByteMatrix best_ref_block;
+	ByteBlockView best_ref_block;
 	ByteMatrix Host_cache;
 	unsigned int cache_width;
 	unsigned int cache_height;
@@ -744,12 +1351,12 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
 
 	for (unsigned int iref = 0; iref < ref_frames.size(); ++iref)
 	{
-		SearchQ search_vectors;
 		//calculate offset
 		cache_width = (r * 2) -1;
 		cache_height = (r * 2) - 1;
 		cache_startX = GetCachePos(cur_coord.second, r, ref_frames[iref].get_width(), cache_width, block_size);
 		cache_startY = GetCachePos(cur_coord.first, r, ref_frames[iref].get_height(), cache_width, block_size);
+		SearchQ search_vectors(cache_startY, cache_startY + cache_height - block_size, cache_startX, cache_startX + cache_width - block_size);
 		for (search_i = 0; search_i <= cache_height -block_size; ++search_i)
 		{
 			for (search_j = 0; search_j <= cache_width -block_size; ++search_j)//May need to change
@@ -770,8 +1377,8 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
 
 		for (int i = 0; i < cache_height; i++) {
 			for (int j = 0; j < cache_width; j++) {
-				a = ME_cache.m_matrix[i][j];
-				b = Host_cache.m_matrix[i][j];
+				a = ME_cache[i][j];
+				b = Host_cache[i][j];
 				p_cache_rtl << a << " ";
 				p_cache_cmodel << b << " ";
 			}
@@ -785,11 +1392,11 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
 		//START ME
 		mv_result = StartME(Host_cache, cur_block, search_vectors, cache_width, cache_height,block_size, cur_coord.first, cur_coord.second);
 		COORD_T search_coord(mv_result.first, mv_result.second);
-		ByteMatrix ref_block = ref_frames[iref].get_y_block_at(search_coord, block_size);
+		ByteBlockView ref_block = ref_frames[iref].get_y_block_view_at(search_coord, block_size);
 		MV_T search_mv;
 		search_mv.y = mv_result.first  - cur_coord.first;
 		search_mv.x = mv_result.second - cur_coord.second;
-		unsigned int mv_bytes = (search_mv == last_mv) ? 0 : sizeof(MV_T);
+		unsigned int mv_bytes = (search_mv == last_mv) ? 0 : MV_COST_BYTES;
 		unsigned int cost = ResidualBlock::estimate_rd_cost(cur_block, ref_block, qp, mv_bytes);
 		best_ref_block = ref_block;
 		res_mv = search_mv;
@@ -801,75 +1408,290 @@ std::tuple<unsigned int, ByteMatrix, MV_T> PFrame::search_for_best_ref_hw(
 }
 
 
-PFrame::PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsigned int i, int r, unsigned int qp)
+// Vectors coded so far in a P-frame, on a grid of the smallest block size, for predicting each vector from its neighbours
+// the same way when searching, writing and reading. When searching, rows of blocks fill in their own part of it while the
+// row below waits its turn to read them, so the coded flags are kept a byte each.
+// A block's prediction is the median of the vectors left of it, above it, and above and right of it (above and left
+// when that one isn't coded yet); neighbours off the frame count as zero.
+class MVPredictionGrid
+{
+public:
+	MVPredictionGrid(unsigned int block_size, unsigned int frame_width, unsigned int frame_height)
+	: m_cell_size((block_size % 2 == 0) ? block_size / 2 : block_size), m_cols(frame_width / m_cell_size),
+	m_mvs(m_cols * (frame_height / m_cell_size)), m_coded(m_mvs.size(), 0)
+	{};
+	
+	MV_T predict(const COORD_T& coord, unsigned int block_size) const
+	{
+		const int row = coord.first / m_cell_size, col = coord.second / m_cell_size, cells = block_size / m_cell_size;
+		MV_T left = at(row, col - 1), above = at(row - 1, col);
+		MV_T above_right = is_coded(row - 1, col + cells) ? at(row - 1, col + cells) : at(row - 1, col - 1);
+		
+		// Medians of the positions in quarter-pels, split back into whole and quarter-pels
+		int x = median3(quarter_pels(left.x, left.fx), quarter_pels(above.x, above.fx), quarter_pels(above_right.x, above_right.fx));
+		int y = median3(quarter_pels(left.y, left.fy), quarter_pels(above.y, above.fy), quarter_pels(above_right.y, above_right.fy));
+		MV_T predicted(l_floor_div(x, SUBPEL_UNITS), l_floor_div(y, SUBPEL_UNITS), 0);
+		predicted.fx = x - predicted.x * SUBPEL_UNITS;
+		predicted.fy = y - predicted.y * SUBPEL_UNITS;
+		return predicted;
+	}
+	
+	void set(const COORD_T& coord, unsigned int block_size, const MV_T& mv)
+	{
+		const unsigned int row = coord.first / m_cell_size, col = coord.second / m_cell_size, cells = block_size / m_cell_size;
+		for(unsigned int i = row; i < row + cells; ++i)
+		{
+			for(unsigned int j = col; j < col + cells; ++j)
+			{
+				m_mvs[i * m_cols + j] = mv;
+				m_coded[i * m_cols + j] = 1;
+			}
+		}
+	}
+	
+private:
+	static int quarter_pels(int whole, int frac) { return whole * SUBPEL_UNITS + frac; }
+	static int median3(int a, int b, int c) { return std::max(std::min(a, b), std::min(std::max(a, b), c)); }
+	
+	bool is_coded(int row, int col) const
+	{
+		return row >= 0 && col >= 0 && col < int(m_cols) && m_coded[row * m_cols + col] != 0;
+	}
+	MV_T at(int row, int col) const { return is_coded(row, col) ? m_mvs[row * m_cols + col] : MV_T(); }
+	
+	unsigned int m_cell_size;
+	unsigned int m_cols;
+	std::vector<MV_T> m_mvs;
+	std::vector<char> m_coded;
+};
+
+// How far along each row of blocks is, for rows that have to wait on the one above
+class BlockRowProgress
+{
+public:
+	BlockRowProgress(unsigned int num_rows) : m_blocks_done(num_rows, 0) {};
+	
+	void block_done(unsigned int row)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_blocks_done[row];
+		}
+		m_block_done.notify_all();
+	}
+	
+	void wait_for_block(unsigned int row, unsigned int col)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_block_done.wait(lock, [this, row, col] { return m_blocks_done[row] > col; });
+	}
+	
+private:
+	std::vector<unsigned int> m_blocks_done;
+	std::mutex m_mutex;
+	std::condition_variable m_block_done;
+};
+
+PFrame::PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsigned int i, int r, unsigned int qp, const MV_FIELD_T* prev_mv_field)
 : m_block_size(i), m_frame_width(cur_frame.get_width()), m_frame_height(cur_frame.get_height())
 {
 	assert(ref_frames[0].get_width() == m_frame_width);
 	assert(ref_frames[0].get_height() == m_frame_height);
 	
-	bool fast_me, vbs_enable, hw_enable;
-	CFG_LOAD_OPT_DEFAULT("FastFME", fast_me, false);
-	CFG_LOAD_OPT_DEFAULT("VBSEnable", vbs_enable, false);
-	CFG_LOAD_OPT_DEFAULT("HwModeEnable", hw_enable, false);
+	const std::vector<COORD_T> block_coords = cur_frame.get_y_block_coords(m_block_size);
+	const unsigned int blocks_per_row = m_frame_width / m_block_size;
+	const unsigned int num_rows = block_coords.size() / blocks_per_row;
+	
+	m_mv_field.mvs.resize(block_coords.size());
+	m_mv_field.costs.resize(block_coords.size());
+	if(prev_mv_field != nullptr && prev_mv_field->mvs.size() != block_coords.size())
+	{
+		prev_mv_field = nullptr;
+	}
+	
+	// last_mv starts over at the beginning of each row of blocks, so the rows don't depend on each other and can be
+	// searched and coded in parallel; putting them back together in raster order gives exactly the serial result.
+	// (The neighbours' vectors do come from the row above, so when they're used each row trails the one above by two blocks.)
+	// The hardware model dumps its stimulus (and JUAN_DEBUG its block info) as it goes, so those stay serial.
+	std::vector<PF_REF_VEC_T> row_refs(num_rows);
+	BlockRowProgress progress(num_rows);
+	MVPredictionGrid grid(m_block_size, m_frame_width, m_frame_height);
+	auto encode_row = [&](unsigned int irow)
+	{
+		encode_block_row(cur_frame, ref_frames, &block_coords[irow * blocks_per_row], blocks_per_row, irow, r, qp, row_refs[irow], m_mv_field, prev_mv_field, grid, progress);
+	};
+#ifndef JUAN_DEBUG
+	if(!PARAMS::inst().hw_enable)
+	{
+		ThreadPool::inst().parallel_for(0, num_rows, encode_row);
+	}
+	else
+#endif
+	{
+		for(unsigned int irow = 0; irow < num_rows; ++irow)
+		{
+			encode_row(irow);
+		}
+	}
+	
+	for(auto& refs : row_refs)
+	{
+		m_mv_and_residuals.insert(m_mv_and_residuals.end(), std::make_move_iterator(refs.begin()), std::make_move_iterator(refs.end()));
+	}
+}
 
+ME_PREDICTORS_T PFrame::get_predictors(unsigned int irow, unsigned int icol, const MV_FIELD_T& mv_field, const MV_FIELD_T* prev_mv_field) const
+{
+	const unsigned int blocks_per_row = m_frame_width / m_block_size;
+	const unsigned int iblock = irow * blocks_per_row + icol;
+	
+	ME_PREDICTORS_T predictors;
+	std::vector<unsigned int> neighbour_costs;
+	auto add = [&](unsigned int i, const MV_FIELD_T& field)
+	{
+		predictors.mvs.push_back(field.mvs[i]);
+		neighbour_costs.push_back(field.costs[i]);
+	};
+	
+	// Left, top, top-right
+	if(icol > 0)
+		add(iblock - 1, mv_field);
+	if(irow > 0)
+		add(iblock - blocks_per_row, mv_field);
+	if(irow > 0 && icol + 1 < blocks_per_row)
+		add(iblock - blocks_per_row + 1, mv_field);
+	
+	// Their median, component by component
+	if(predictors.mvs.size() == 3)
+	{
+		int xs[3] = { predictors.mvs[0].x, predictors.mvs[1].x, predictors.mvs[2].x };
+		int ys[3] = { predictors.mvs[0].y, predictors.mvs[1].y, predictors.mvs[2].y };
+		std::sort(xs, xs + 3);
+		std::sort(ys, ys + 3);
+		predictors.mvs.push_back(MV_T(xs[1], ys[1], 0));
+	}
+	
+	// Same block in the previous P-frame
+	if(prev_mv_field != nullptr)
+		add(iblock, *prev_mv_field);
+	
+	// A predictor that's already as good as the neighbours ended up is taken as it is
+	if(!neighbour_costs.empty())
+		predictors.early_exit_cost = *std::min_element(neighbour_costs.begin(), neighbour_costs.end());
+	return predictors;
+}
+
+void PFrame::encode_block_row(const Frame& cur_frame, const std::deque<Frame>& ref_frames, const COORD_T* block_coords, unsigned int num_blocks, 
+	unsigned int irow, int r, unsigned int qp, PF_REF_VEC_T& row_refs, MV_FIELD_T& mv_field, const MV_FIELD_T* prev_mv_field, MVPredictionGrid& grid, 
+	BlockRowProgress& progress) const
+{
+	const bool fast_me = PARAMS::inst().fast_me;
+	const bool vbs_enable = PARAMS::inst().vbs_enable;
+	const bool hw_enable = PARAMS::inst().hw_enable;
+	const bool predictive_me = PARAMS::inst().predictive_me;
+	const ME_MODE_T me_mode = (PARAMS::inst().me_pyramid_levels > 0) ? ME_PYRAMID : predictive_me ? ME_PREDICTIVE : fast_me ? ME_FAST : ME_FULL;
+	const unsigned int subpel_precision = PARAMS::inst().subpel_precision;
+	// The exhaustive search takes the neighbours' vectors as a bound to start from as well
+	const bool neighbour_predictors = !hw_enable && (predictive_me || me_mode == ME_FULL);
+	const bool mv_prediction = PARAMS::inst().mv_prediction;
+	
+	// Whole-pel search, then sub-pel refinement of what it found
+	auto search = [&](const COORD_T& coord, const ByteBlockView& block, unsigned int block_size, unsigned int block_qp, const MV_T& prev_mv, const ME_PREDICTORS_T& block_predictors)
+	{
+		std::tuple<unsigned int, ByteBlockView, MV_T> result = PFrame::search_for_best_ref(coord, block, cur_frame, ref_frames, r, block_size, block_qp, me_mode, prev_mv, block_predictors);
+		return (subpel_precision > 1) ? PFrame::subpel_refine(coord, block, ref_frames, block_size, block_qp, prev_mv, result) : result;
+	};
 	
 	MV_T last_mv;
 	
-	for(auto& cur_block_t : cur_frame.get_y_block_vec(m_block_size))
+	// The vector that's free to code (as far as the RD costs go): the previous block's, or with MVPrediction the one predicted
+	// from the neighbours. Sub-blocks go into the grid as they're searched, and get overwritten if the full block wins.
+	auto free_mv = [&](const COORD_T& coord, unsigned int block_size)
+	{
+		return mv_prediction ? grid.predict(coord, block_size) : last_mv;
+	};
+	
+	for(unsigned int iblock = 0; iblock < num_blocks; ++iblock)
 	{
-		COORD_T cur_coord = cur_block_t.first;
-		const ByteMatrix& cur_block = cur_block_t.second;
-		if(cur_coord.second == 0)
+		// The top-right neighbour is the last one needed from the row above
+		if((neighbour_predictors || mv_prediction) && irow > 0)
 		{
-			last_mv = MV_T(0,0,0);
+			progress.wait_for_block(irow - 1, std::min(iblock + 1, num_blocks - 1));
+		}
+		ME_PREDICTORS_T predictors, sub_predictors;
+		if(neighbour_predictors)
+		{
+			predictors = get_predictors(irow, iblock, mv_field, prev_mv_field);
 		}
 		
+		COORD_T cur_coord = block_coords[iblock];
+		ByteBlockView cur_block = cur_frame.get_y_block_view_at(cur_coord, m_block_size);
 		unsigned int min_full_cost = 0, min_split_cost = std::numeric_limits<unsigned int>::max();
-		ByteMatrix best_full_ref_block;
+		ByteBlockView best_full_ref_block;
 		MV_T full_res_mv;
 		if(hw_enable)
-			std::tie(min_full_cost, best_full_ref_block, full_res_mv) = PFrame::search_for_best_ref_hw(cur_coord, cur_block, ref_frames, r, m_block_size, qp, fast_me, last_mv);
+			std::tie(min_full_cost, best_full_ref_block, full_res_mv) = PFrame::search_for_best_ref_hw(cur_coord, cur_block, ref_frames, r, m_block_size, qp, fast_me, free_mv(cur_coord, m_block_size));
 		else
-			std::tie(min_full_cost, best_full_ref_block, full_res_mv) = PFrame::search_for_best_ref ( cur_coord, cur_block, ref_frames, r, m_block_size, qp, fast_me, last_mv );
+			std::tie(min_full_cost, best_full_ref_block, full_res_mv) = search(cur_coord, cur_block, m_block_size, qp, free_mv(cur_coord, m_block_size), predictors);
+		
+		// What the full-size block found is the neighbours' predictor for the next blocks
+		mv_field.mvs[irow * num_blocks + iblock] = full_res_mv;
+		mv_field.costs[irow * num_blocks + iblock] = min_full_cost;
+		
+		// The sub-blocks start from the same predictors and the full block's vector, with a quarter of the early exit cost
+		if(me_mode != ME_FAST)
+		{
+			sub_predictors = predictors;
+			sub_predictors.mvs.push_back(full_res_mv);
+			sub_predictors.early_exit_cost /= 4;
+		}
 #ifdef JUAN_DEBUG
 		p_mb_info << "MB_Y: " << cur_coord.first/m_block_size << " MB_X: " << cur_coord.second/m_block_size << " Cost: " << min_full_cost << " MV_Y: " << full_res_mv.y << " MV_X: " << full_res_mv.x << "\n";
 #endif
 		if(vbs_enable && m_block_size > 2 && m_block_size % 2 == 0)
 		{
-			ByteMatrix top_left_block = cur_frame.get_y_block_at(cur_coord, m_block_size / 2);
+			ByteBlockView top_left_block = cur_frame.get_y_block_view_at(cur_coord, m_block_size / 2);
 			
 			unsigned int min_top_left_cost;
-			ByteMatrix best_top_left_ref;
+			ByteBlockView best_top_left_ref;
 			MV_T top_left_res_mv;
-			std::tie(min_top_left_cost, best_top_left_ref, top_left_res_mv) = PFrame::search_for_best_ref ( cur_coord, top_left_block, ref_frames, r, m_block_size/2, (qp>0)? qp-1: 0, fast_me, last_mv );
+			std::tie(min_top_left_cost, best_top_left_ref, top_left_res_mv) = search(cur_coord, top_left_block, m_block_size/2, (qp>0)? qp-1: 0, free_mv(cur_coord, m_block_size/2), sub_predictors);
 			last_mv = top_left_res_mv;
+			if(mv_prediction)
+				grid.set(cur_coord, m_block_size/2, top_left_res_mv);
 			
 			cur_coord = calculate_next_coord(cur_coord, m_block_size, m_block_size/2, m_frame_width);
 			
-			ByteMatrix top_right_block = cur_frame.get_y_block_at(cur_coord, m_block_size / 2);
+			ByteBlockView top_right_block = cur_frame.get_y_block_view_at(cur_coord, m_block_size / 2);
 			unsigned int min_top_right_cost;
-			ByteMatrix best_top_right_ref;
+			ByteBlockView best_top_right_ref;
 			MV_T top_right_res_mv;
-			std::tie(min_top_right_cost, best_top_right_ref, top_right_res_mv) = PFrame::search_for_best_ref ( cur_coord, top_right_block, ref_frames, r, m_block_size/2, (qp>0)? qp-1: 0, fast_me, last_mv );
+			std::tie(min_top_right_cost, best_top_right_ref, top_right_res_mv) = search(cur_coord, top_right_block, m_block_size/2, (qp>0)? qp-1: 0, free_mv(cur_coord, m_block_size/2), sub_predictors);
 			last_mv = top_right_res_mv;
+			if(mv_prediction)
+				grid.set(cur_coord, m_block_size/2, top_right_res_mv);
 			
 			cur_coord = calculate_next_coord(cur_coord, m_block_size, m_block_size/2, m_frame_width);
 			
-			ByteMatrix bot_left_block = cur_frame.get_y_block_at(cur_coord, m_block_size / 2);
+			ByteBlockView bot_left_block = cur_frame.get_y_block_view_at(cur_coord, m_block_size / 2);
 			unsigned int min_bot_left_cost;
-			ByteMatrix best_bot_left_ref;
+			ByteBlockView best_bot_left_ref;
 			MV_T bot_left_res_mv;
-			std::tie(min_bot_left_cost, best_bot_left_ref, bot_left_res_mv) = PFrame::search_for_best_ref ( cur_coord, bot_left_block, ref_frames, r, m_block_size/2, (qp>0)? qp-1: 0, fast_me, last_mv );
+			std::tie(min_bot_left_cost, best_bot_left_ref, bot_left_res_mv) = search(cur_coord, bot_left_block, m_block_size/2, (qp>0)? qp-1: 0, free_mv(cur_coord, m_block_size/2), sub_predictors);
 			last_mv = bot_left_res_mv;
+			if(mv_prediction)
+				grid.set(cur_coord, m_block_size/2, bot_left_res_mv);
 			
 			cur_coord = calculate_next_coord(cur_coord, m_block_size, m_block_size/2, m_frame_width);
 			
-			ByteMatrix bot_right_block = cur_frame.get_y_block_at(cur_coord, m_block_size / 2);
+			ByteBlockView bot_right_block = cur_frame.get_y_block_view_at(cur_coord, m_block_size / 2);
 			unsigned int min_bot_right_cost;
-			ByteMatrix best_bot_right_ref;
+			ByteBlockView best_bot_right_ref;
 			MV_T bot_right_res_mv;
-			std::tie(min_bot_right_cost, best_bot_right_ref, bot_right_res_mv) = PFrame::search_for_best_ref ( cur_coord, bot_right_block, ref_frames, r, m_block_size/2, (qp>0)? qp-1: 0, fast_me, last_mv );
+			std::tie(min_bot_right_cost, best_bot_right_ref, bot_right_res_mv) = search(cur_coord, bot_right_block, m_block_size/2, (qp>0)? qp-1: 0, free_mv(cur_coord, m_block_size/2), sub_predictors);
 			last_mv = bot_right_res_mv;
+			if(mv_prediction)
+				grid.set(cur_coord, m_block_size/2, bot_right_res_mv);
 			
 			min_split_cost = min_top_left_cost + min_top_right_cost + min_bot_left_cost + min_bot_right_cost;
 			if(min_split_cost < min_full_cost)
@@ -883,10 +1705,10 @@ PFrame::PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsi
 				ResidualBlock bot_right_res_block(bot_right_block, best_bot_right_ref, (qp>0)? qp-1: 0, min_bot_right_cost);
 				assert(bot_right_res_block.is_initialized());
 				
-				m_mv_and_residuals.push_back(PF_REF_T(top_left_res_mv, top_left_res_block));
-				m_mv_and_residuals.push_back(PF_REF_T(top_right_res_mv, top_right_res_block));
-				m_mv_and_residuals.push_back(PF_REF_T(bot_left_res_mv, bot_left_res_block));
-				m_mv_and_residuals.push_back(PF_REF_T(bot_right_res_mv, bot_right_res_block));
+				row_refs.push_back(PF_REF_T(top_left_res_mv, top_left_res_block));
+				row_refs.push_back(PF_REF_T(top_right_res_mv, top_right_res_block));
+				row_refs.push_back(PF_REF_T(bot_left_res_mv, bot_left_res_block));
+				row_refs.push_back(PF_REF_T(bot_right_res_mv, bot_right_res_block));
 			}
 		}
 		
@@ -895,28 +1717,54 @@ PFrame::PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsi
 			ResidualBlock full_res_block(cur_block, best_full_ref_block, qp, min_full_cost);
 			assert(full_res_block.is_initialized());
 			
-			m_mv_and_residuals.push_back(PF_REF_T(full_res_mv, full_res_block));
+			row_refs.push_back(PF_REF_T(full_res_mv, full_res_block));
 			last_mv = full_res_mv;
+			if(mv_prediction)
+				grid.set(block_coords[iblock], m_block_size, full_res_mv);
 		}
+		progress.block_done(irow);
 	}
 }
 	
+// Vectors are coded as x, y and reference, then the quarter-pels of x and y when they can have any
+static unsigned int l_ints_per_mv()
+{
+	return (PARAMS::inst().subpel_precision > 1) ? 5 : 3;
+}
+
 PFrame::PFrame(std::istream& mv_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp)
 : m_block_size(i), m_frame_width(frame_width), m_frame_height(frame_height)
 {
+	const unsigned int ints_per_mv = l_ints_per_mv();
 	INT_VEC_T differential_mvs = RLE::read_and_irle_int_vec(mv_in);
-	assert(differential_mvs.size() % 3 == 0);
+	assert(differential_mvs.size() % ints_per_mv == 0);
 	
-	m_mv_and_residuals.resize(differential_mvs.size() / 3);
+	m_mv_and_residuals.resize(differential_mvs.size() / ints_per_mv);
 	MV_T last_mv(0, 0, 0);
+	const bool mv_prediction = PARAMS::inst().mv_prediction;
+	MVPredictionGrid grid(m_block_size, m_frame_width, m_frame_height);
+	COORD_T block_coord(0, 0);
 	
-	for(unsigned int i=0, imv=0; i < m_mv_and_residuals.size(); ++i, imv += 3)
+	for(unsigned int i=0, imv=0; i < m_mv_and_residuals.size(); ++i, imv += ints_per_mv)
 	{
 		ResidualBlock next_res(res_in, m_block_size, qp);
 		MV_T cur_mv;
-		cur_mv.x = last_mv.x - differential_mvs[imv];
-		cur_mv.y = last_mv.y - differential_mvs[imv+1];
+		MV_T predicted_mv = mv_prediction ? grid.predict(block_coord, next_res.get_block_size()) : last_mv;
+		cur_mv.x = predicted_mv.x - differential_mvs[imv];
+		cur_mv.y = predicted_mv.y - differential_mvs[imv+1];
 		cur_mv.i = last_mv.i - differential_mvs[imv+2];
+		if(ints_per_mv == 5)
+		{
+			cur_mv.fx = predicted_mv.fx - differential_mvs[imv+3];
+			cur_mv.fy = predicted_mv.fy - differential_mvs[imv+4];
+			assert(cur_mv.fx >= 0 && cur_mv.fx < SUBPEL_UNITS && cur_mv.fy >= 0 && cur_mv.fy < SUBPEL_UNITS);
+		}
+		
+		if(mv_prediction)
+		{
+			grid.set(block_coord, next_res.get_block_size(), cur_mv);
+			block_coord = calculate_next_coord(block_coord, m_block_size, next_res.get_block_size(), m_frame_width);
+		}
 		
 		m_mv_and_residuals[i] = PF_REF_T(cur_mv, next_res);
 		last_mv = cur_mv;
@@ -925,18 +1773,37 @@ PFrame::PFrame(std::istream& mv_in, std::istream& res_in, unsigned int i, unsign
 	
 unsigned int PFrame::write(std::ostream& mv_out, std::ostream& res_out)
 {
-	INT_VEC_T differential_mvs(m_mv_and_residuals.size() * 3);
+	const unsigned int ints_per_mv = l_ints_per_mv();
+	INT_VEC_T differential_mvs(m_mv_and_residuals.size() * ints_per_mv);
 	MV_T last_mv(0, 0, 0);
 	unsigned int imv = 0;
 	
+	// Positions are coded against the last vector, or the neighbours' median with MVPrediction; the reference always against the last
+	const bool mv_prediction = PARAMS::inst().mv_prediction;
+	MVPredictionGrid grid(m_block_size, m_frame_width, m_frame_height);
+	COORD_T block_coord(0, 0);
+	
 	unsigned int bytes_written = 0;
 	for(auto& mv_and_res_block: m_mv_and_residuals)
 	{
 		MV_T cur_mv =  mv_and_res_block.first;
-		differential_mvs[imv] = last_mv.x - cur_mv.x;
-		differential_mvs[imv+1] = last_mv.y - cur_mv.y;
+		MV_T predicted_mv = last_mv;
+		if(mv_prediction)
+		{
+			const unsigned int block_size = mv_and_res_block.second.get_block_size();
+			predicted_mv = grid.predict(block_coord, block_size);
+			grid.set(block_coord, block_size, cur_mv);
+			block_coord = calculate_next_coord(block_coord, m_block_size, block_size, m_frame_width);
+		}
+		differential_mvs[imv] = predicted_mv.x - cur_mv.x;
+		differential_mvs[imv+1] = predicted_mv.y - cur_mv.y;
 		differential_mvs[imv+2] = last_mv.i - cur_mv.i;
-		imv += 3;
+		if(ints_per_mv == 5)
+		{
+			differential_mvs[imv+3] = predicted_mv.fx - cur_mv.fx;
+			differential_mvs[imv+4] = predicted_mv.fy - cur_mv.fy;
+		}
+		imv += ints_per_mv;
 		last_mv = cur_mv;
 		
 		bytes_written += mv_and_res_block.second.write(res_out);
@@ -955,7 +1822,12 @@ void PFrame::print(std::ostream& mv_out, std::ostream& res_out)
 	unsigned int iblock = 0;
 	for(auto& mv_and_res_block: m_mv_and_residuals)
 	{
-		mv_out << "(dx=" << mv_and_res_block.first.x << ",dy=" << mv_and_res_block.first.y << ",if=" <<  mv_and_res_block.first.i << ")";
+		mv_out << "(dx=" << mv_and_res_block.first.x << ",dy=" << mv_and_res_block.first.y << ",if=" <<  mv_and_res_block.first.i;
+		if(mv_and_res_block.first.fx != 0 || mv_and_res_block.first.fy != 0)
+		{
+			mv_out << ",qx=" << mv_and_res_block.first.fx << ",qy=" << mv_and_res_block.first.fy;
+		}
+		mv_out << ")";
 		iblock++;
 		if (iblock == blocks_wide)
 		{
@@ -993,7 +1865,7 @@ Frame PFrame::mv_frame(const std::deque<Frame>& ref_frames)
 		unsigned int iref = (unsigned int)ref_mv.i;
 		assert(iref < ref_frames.size());
 	
-		ByteMatrix ref_block = ref_frames[iref].get_y_block_at(ref_coord, m_mv_and_residuals[ifr].second.get_block_size());
+		ByteMatrix ref_block(ref_frames[iref].get_y_block_view_at(ref_coord, m_mv_and_residuals[ifr].second.get_block_size(), ref_mv.fy, ref_mv.fx));
 		
 		ref_blocks[ifr] = BLOCK_T(block_coord, ref_block);
 		
@@ -1021,10 +1893,9 @@ INT_VEC_T PFrame::get_block_colours() const
 //**************************************************************************
 
 std::tuple<unsigned int, ByteMatrix, INTRA_MODE_T> choose_ref_block (
-	const ByteMatrix& cur_block,
+	const ByteBlockView& cur_block,
 	const COORD_T& cur_coord,
-	const ByteMatrix& recon_frame_above,
-	const ByteMatrix& recon_row_left,
+	const ByteMatrix& recon_frame,
 	const unsigned int full_block_size,
 	const unsigned int qp,
 	const INTRA_MODE_T& last_mode)
@@ -1033,24 +1904,23 @@ std::tuple<unsigned int, ByteMatrix, INTRA_MODE_T> choose_ref_block (
 	assert(cur_block_size == full_block_size || cur_block_size == full_block_size/2);
 	
 	unsigned int above_cost, left_cost;
-	COORD_T above_coord, left_coord;
-	
-	above_coord.first = cur_coord.first - cur_coord.first % full_block_size - cur_block_size;
-	above_coord.second = cur_coord.second;
 	
-	left_coord.first = cur_coord.first - recon_frame_above.get_height();
-	left_coord.second = cur_coord.second - cur_coord.second % full_block_size - cur_block_size;
+	// Sub-blocks are predicted from the same neighbours as the full block they're part of: the reconstructed
+	// row just above it and the reconstructed column just left of it
+	COORD_T full_coord(cur_coord.first - cur_coord.first % full_block_size, cur_coord.second - cur_coord.second % full_block_size);
 	
 	ByteMatrix above_block(0x80, cur_block_size, cur_block_size);
-	if(recon_frame_above.block_coord_is_legal(above_coord, cur_block_size))
+	if(full_coord.first > 0)
 	{
-		above_block = recon_frame_above.get_block_at(above_coord, cur_block_size).generate_intra_mode_refblock(INTRA_MODE_ABOVE);
+		COORD_T above_coord(full_coord.first - cur_block_size, cur_coord.second);
+		above_block = recon_frame.get_block_at(above_coord, cur_block_size).generate_intra_mode_refblock(INTRA_MODE_ABOVE);
 	}
 	
 	ByteMatrix left_block(0x80, cur_block_size, cur_block_size);
-	if(recon_row_left.block_coord_is_legal(left_coord, cur_block_size))
+	if(full_coord.second > 0)
 	{
-		left_block = recon_row_left.get_block_at(left_coord, cur_block_size).generate_intra_mode_refblock(INTRA_MODE_LEFT);
+		COORD_T left_coord(cur_coord.first, full_coord.second - cur_block_size);
+		left_block = recon_frame.get_block_at(left_coord, cur_block_size).generate_intra_mode_refblock(INTRA_MODE_LEFT);
 	}
 	
 	above_cost = ResidualBlock::estimate_rd_cost(cur_block, above_block, qp, (last_mode == INTRA_MODE_ABOVE)? 0 : sizeof(INTRA_MODE_T));
@@ -1063,131 +1933,209 @@ std::tuple<unsigned int, ByteMatrix, INTRA_MODE_T> choose_ref_block (
 	return std::make_tuple(left_cost, left_block, INTRA_MODE_LEFT);
 }
 
+// Progress of an I-frame being coded as a wavefront: how many blocks of each row are reconstructed,
+// and the mode the last of them was coded with
+class IFrameProgress
+{
+public:
+	IFrameProgress(unsigned int num_rows, unsigned int blocks_per_row) :
+	m_blocks_per_row(blocks_per_row), m_blocks_done(num_rows, 0), m_last_modes(num_rows, INTRA_MODE_LEFT) {};
+	
+	void block_done(unsigned int row, INTRA_MODE_T mode)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_blocks_done[row];
+			m_last_modes[row] = mode;
+		}
+		m_block_done.notify_all();
+	}
+	
+	void wait_for_block(unsigned int row, unsigned int col)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_block_done.wait(lock, [this, row, col] { return m_blocks_done[row] > col; });
+	}
+	
+	// Mode the row ended on; waits for the whole row
+	INTRA_MODE_T wait_for_row(unsigned int row)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_block_done.wait(lock, [this, row] { return m_blocks_done[row] == m_blocks_per_row; });
+		return m_last_modes[row];
+	}
+	
+	bool row_is_done(unsigned int row, INTRA_MODE_T& last_mode)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		last_mode = m_last_modes[row];
+		return m_blocks_done[row] == m_blocks_per_row;
+	}
+	
+private:
+	unsigned int m_blocks_per_row;
+	std::vector<unsigned int> m_blocks_done;
+	std::vector<INTRA_MODE_T> m_last_modes;
+	std::mutex m_mutex;
+	std::condition_variable m_block_done;
+};
+
 IFrame::IFrame(const Frame& cur_frame, unsigned int i, unsigned int qp) :
 m_block_size(i), m_frame_width(cur_frame.get_width()), m_frame_height(cur_frame.get_height())
 {
 	assert(m_frame_width % m_block_size == 0);
 	assert(m_frame_height % m_block_size == 0);
 	
-	bool vbs_enable;
-	CFG_LOAD_OPT_DEFAULT("VBSEnable", vbs_enable, false);
+	const unsigned int blocks_per_row = m_frame_width / m_block_size;
+	const unsigned int num_rows = m_frame_height / m_block_size;
 	
-	ByteMatrix recon_frame, recon_row, recon_sub_block;
+	// Block (r, c) is predicted from the bottom row of (r-1, c) and the right column of (r, c-1), so rows are coded
+	// in parallel with each one trailing the row above by a block. Reconstructed pixels go straight into recon_frame.
+	ByteMatrix recon_frame(0x80, m_frame_width, m_frame_height);
+	IFrameProgress progress(num_rows, blocks_per_row);
+	std::vector<IF_ROW_T> rows(num_rows);
 	
-	COORD_T block_coord({0, 0}), ref_coord;
-	INTRA_MODE_T last_mode = INTRA_MODE_LEFT;
-	while(block_coord.first < m_frame_height)
+	// The mode a row starts from is the one the previous row ended on. When the previous row isn't done yet, the first
+	// block is coded both ways; if that gives the same modes either way, the rest of the row can't depend on it. With
+	// residual cost estimates being logged per block the estimated costs have to match as well, so wait instead.
+	const bool can_speculate = !PARAMS::inst().debug_res_est;
+	
+	auto encode_row = [&](unsigned int irow)
 	{
-		ByteMatrix recon_row;
-		std::deque<ByteMatrix> recon_sub_blocks;
-		while(recon_row.get_width() < m_frame_width)
+		IF_ROW_T& row = rows[irow];
+		INTRA_MODE_T last_mode = INTRA_MODE_LEFT;
+		for(unsigned int icol = 0; icol < blocks_per_row; ++icol)
 		{
-			assert(block_coord.first < m_frame_height);
-			
-			unsigned int full_cost;
-			ByteMatrix ref_block;
-			INTRA_MODE_T mode;
-			ByteMatrix cur_block = cur_frame.get_y_block_at(block_coord, m_block_size);
-			std::tie(full_cost, ref_block, mode) = choose_ref_block(cur_block, block_coord, recon_frame, recon_row, m_block_size, qp, last_mode);
+			COORD_T block_coord(irow * m_block_size, icol * m_block_size);
+			if(irow > 0)
+			{
+				progress.wait_for_block(irow - 1, icol);
+			}
 			
-			unsigned int split_cost = std::numeric_limits<unsigned int>::max();
-			if(vbs_enable && m_block_size > 2 && m_block_size % 2 == 0)
+			std::size_t first_new = row.recon_blocks.size();
+			if(icol == 0 && irow > 0 && !progress.row_is_done(irow - 1, last_mode))
 			{
-				unsigned int sub_size = m_block_size/2;
-				
-				unsigned int tl_cost, tr_cost, bl_cost, br_cost;
-				ByteMatrix tl_cur_block, tr_cur_block, bl_cur_block, br_cur_block;
-				ByteMatrix tl_ref_block, tr_ref_block, bl_ref_block, br_ref_block;
-				INTRA_MODE_T tl_mode, tr_mode, bl_mode, br_mode;
-				COORD_T tl_coord, tr_coord, bl_coord, br_coord;
-				
-				tl_coord = block_coord;
-				tl_cur_block = cur_frame.get_y_block_at(tl_coord, sub_size);
-				std::tie(tl_cost, tl_ref_block, tl_mode) = choose_ref_block(tl_cur_block, tl_coord, recon_frame, recon_row, m_block_size, (qp>0)? qp-1: 0, last_mode);
-				
-				tr_coord = calculate_next_coord(tl_coord, m_block_size, sub_size, m_frame_width);
-				tr_cur_block = cur_frame.get_y_block_at(tr_coord, sub_size);
-				std::tie(tr_cost, tr_ref_block, tr_mode) = choose_ref_block(tr_cur_block, tr_coord, recon_frame, recon_row, m_block_size, (qp>0)? qp-1: 0, tl_mode);
-				
-				bl_coord = calculate_next_coord(tr_coord, m_block_size, sub_size, m_frame_width);
-				bl_cur_block = cur_frame.get_y_block_at(bl_coord, sub_size);
-				std::tie(bl_cost, bl_ref_block, bl_mode) = choose_ref_block(bl_cur_block, bl_coord, recon_frame, recon_row, m_block_size, (qp>0)? qp-1: 0, tr_mode);
-				
-				br_coord = calculate_next_coord(bl_coord, m_block_size, sub_size, m_frame_width);
-				br_cur_block = cur_frame.get_y_block_at(br_coord, sub_size);
-				std::tie(br_cost, br_ref_block, br_mode) = choose_ref_block(br_cur_block, br_coord, recon_frame, recon_row, m_block_size, (qp>0)? qp-1: 0, bl_mode);
-				
-				split_cost = tl_cost + tr_cost + bl_cost + br_cost;
-				if(split_cost < full_cost)
+				IF_ROW_T as_above, as_left;
+				if(can_speculate)
 				{
-					ByteMatrix recon_block, bottom_row;
-					
-					{
-						ResidualBlock tl_res(tl_cur_block, tl_ref_block, (qp>0)? qp-1: 0, tl_cost);
-						assert(tl_res.is_initialized());
-						ByteMatrix tl_recon_block = tl_res.reconstruct_from(tl_ref_block);
-						m_ref_blocks.push_back(BLOCK_T(tl_coord, tl_ref_block));
-						m_recon_blocks.push_back(BLOCK_T(tl_coord, tl_recon_block));
-						m_modes_and_residuals.push_back(IF_REF_T(tl_mode, tl_res));
-						recon_block = tl_recon_block;
-					}
-					
-					{
-						ResidualBlock tr_res(tr_cur_block, tr_ref_block, (qp>0)? qp-1: 0, tr_cost);
-						assert(tr_res.is_initialized());
-						ByteMatrix tr_recon_block = tr_res.reconstruct_from(tr_ref_block);
-						m_ref_blocks.push_back(BLOCK_T(tr_coord, tr_ref_block));
-						m_recon_blocks.push_back(BLOCK_T(tr_coord, tr_recon_block));
-						m_modes_and_residuals.push_back(IF_REF_T(tr_mode, tr_res));
-						recon_block.stitch_right(tr_recon_block);
-					}
-					
-					{
-						ResidualBlock bl_res(bl_cur_block, bl_ref_block, (qp>0)? qp-1: 0, bl_cost);
-						assert(bl_res.is_initialized());
-						ByteMatrix bl_recon_block = bl_res.reconstruct_from(bl_ref_block);
-						m_ref_blocks.push_back(BLOCK_T(bl_coord, bl_ref_block));
-						m_recon_blocks.push_back(BLOCK_T(bl_coord, bl_recon_block));
-						m_modes_and_residuals.push_back(IF_REF_T(bl_mode, bl_res));
-						bottom_row = bl_recon_block;
-					}
-					
-					{
-						ResidualBlock br_res(br_cur_block, br_ref_block, (qp>0)? qp-1: 0, br_cost);
-						assert(br_res.is_initialized());
-						ByteMatrix br_recon_block = br_res.reconstruct_from(br_ref_block);
-						m_ref_blocks.push_back(BLOCK_T(br_coord, br_ref_block));
-						m_recon_blocks.push_back(BLOCK_T(br_coord, br_recon_block));
-						m_modes_and_residuals.push_back(IF_REF_T(br_mode, br_res));
-						bottom_row.stitch_right(br_recon_block);
-					}
-					
-					recon_block.stitch_below(bottom_row);
-					recon_row.stitch_right(recon_block);
-					last_mode = br_mode;
+					encode_block(cur_frame, recon_frame, block_coord, qp, INTRA_MODE_ABOVE, as_above);
+					encode_block(cur_frame, recon_frame, block_coord, qp, INTRA_MODE_LEFT, as_left);
+				}
+				if(can_speculate && same_modes(as_above, as_left))
+				{
+					last_mode = as_above.modes_and_residuals.back().first;
+					row = std::move(as_above);
+				}
+				else
+				{
+					last_mode = encode_block(cur_frame, recon_frame, block_coord, qp, progress.wait_for_row(irow - 1), row);
 				}
 			}
-			
-			if(!vbs_enable || full_cost <= split_cost)
+			else
 			{
-				ResidualBlock res(cur_block, ref_block, qp, full_cost);
-				assert(res.is_initialized());
-				ByteMatrix recon_block = res.reconstruct_from(ref_block);
-				m_ref_blocks.push_back(BLOCK_T(block_coord, ref_block));
-				m_recon_blocks.push_back(BLOCK_T(block_coord, recon_block));
-				m_modes_and_residuals.push_back(IF_REF_T(mode, res));
-				
-				recon_row.stitch_right(recon_block);
-				last_mode = mode;
+				last_mode = encode_block(cur_frame, recon_frame, block_coord, qp, last_mode, row);
 			}
 			
-			block_coord = calculate_next_coord(block_coord, m_block_size, m_block_size, m_frame_width);
+			// Publish the block (or its sub-blocks) for the row below
+			for(std::size_t iblock = first_new; iblock < row.recon_blocks.size(); ++iblock)
+			{
+				recon_frame.set_block_at(row.recon_blocks[iblock].first, row.recon_blocks[iblock].second);
+			}
+			progress.block_done(irow, last_mode);
+		}
+	};
+#ifndef JUAN_DEBUG
+	ThreadPool::inst().parallel_for(0, num_rows, encode_row);
+#else
+	for(unsigned int irow = 0; irow < num_rows; ++irow)
+	{
+		encode_row(irow);
+	}
+#endif
+	
+	for(auto& row : rows)
+	{
+		m_ref_blocks.insert(m_ref_blocks.end(), std::make_move_iterator(row.ref_blocks.begin()), std::make_move_iterator(row.ref_blocks.end()));
+		m_recon_blocks.insert(m_recon_blocks.end(), std::make_move_iterator(row.recon_blocks.begin()), std::make_move_iterator(row.recon_blocks.end()));
+		m_modes_and_residuals.insert(m_modes_and_residuals.end(), std::make_move_iterator(row.modes_and_residuals.begin()), std::make_move_iterator(row.modes_and_residuals.end()));
+	}
+}
+
+bool IFrame::same_modes(const IF_ROW_T& a, const IF_ROW_T& b)
+{
+	if(a.modes_and_residuals.size() != b.modes_and_residuals.size())
+	{
+		return false;
+	}
+	for(unsigned int i = 0; i < a.modes_and_residuals.size(); ++i)
+	{
+		if(a.modes_and_residuals[i].first != b.modes_and_residuals[i].first)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+INTRA_MODE_T IFrame::encode_block(const Frame& cur_frame, const ByteMatrix& recon_frame, const COORD_T& block_coord, unsigned int qp, INTRA_MODE_T last_mode, IF_ROW_T& row) const
+{
+	const bool vbs_enable = PARAMS::inst().vbs_enable;
+	
+	unsigned int full_cost;
+	ByteMatrix ref_block;
+	INTRA_MODE_T mode;
+	ByteBlockView cur_block = cur_frame.get_y_block_view_at(block_coord, m_block_size);
+	std::tie(full_cost, ref_block, mode) = choose_ref_block(cur_block, block_coord, recon_frame, m_block_size, qp, last_mode);
+	
+	unsigned int split_cost = std::numeric_limits<unsigned int>::max();
+	if(vbs_enable && m_block_size > 2 && m_block_size % 2 == 0)
+	{
+		unsigned int sub_size = m_block_size/2;
+		unsigned int sub_qp = (qp>0)? qp-1: 0;
+		
+		COORD_T sub_coords[4];
+		ByteBlockView sub_cur_blocks[4];
+		ByteMatrix sub_ref_blocks[4];
+		unsigned int sub_costs[4];
+		INTRA_MODE_T sub_modes[4];
+		
+		// Top left, top right, bottom left, bottom right; each chained onto the mode of the one before
+		split_cost = 0;
+		INTRA_MODE_T sub_last_mode = last_mode;
+		for(unsigned int isub = 0; isub < 4; ++isub)
+		{
+			sub_coords[isub] = (isub == 0)? block_coord : calculate_next_coord(sub_coords[isub-1], m_block_size, sub_size, m_frame_width);
+			sub_cur_blocks[isub] = cur_frame.get_y_block_view_at(sub_coords[isub], sub_size);
+			std::tie(sub_costs[isub], sub_ref_blocks[isub], sub_modes[isub]) = choose_ref_block(sub_cur_blocks[isub], sub_coords[isub], recon_frame, m_block_size, sub_qp, sub_last_mode);
+			sub_last_mode = sub_modes[isub];
+			split_cost += sub_costs[isub];
+		}
+		
+		if(split_cost < full_cost)
+		{
+			for(unsigned int isub = 0; isub < 4; ++isub)
+			{
+				ResidualBlock sub_res(sub_cur_blocks[isub], sub_ref_blocks[isub], sub_qp, sub_costs[isub]);
+				assert(sub_res.is_initialized());
+				ByteMatrix sub_recon_block = sub_res.reconstruct_from(sub_ref_blocks[isub]);
+				row.ref_blocks.push_back(BLOCK_T(sub_coords[isub], sub_ref_blocks[isub]));
+				row.recon_blocks.push_back(BLOCK_T(sub_coords[isub], sub_recon_block));
+				row.modes_and_residuals.push_back(IF_REF_T(sub_modes[isub], sub_res));
+			}
+			return sub_modes[3];
 		}
-		recon_frame.stitch_below(recon_row);
 	}
+	
+	ResidualBlock res(cur_block, ref_block, qp, full_cost);
+	assert(res.is_initialized());
+	ByteMatrix recon_block = res.reconstruct_from(ref_block);
+	row.ref_blocks.push_back(BLOCK_T(block_coord, ref_block));
+	row.recon_blocks.push_back(BLOCK_T(block_coord, recon_block));
+	row.modes_and_residuals.push_back(IF_REF_T(mode, res));
+	return mode;
 }
 	
-IFrame::IFrame(std::istream& mode_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp)
+IFrame::IFrame(std::istream& mode_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp, bool parse_only)
 : m_block_size(i), m_frame_width(frame_width), m_frame_height(frame_height)
 {
 	assert(m_frame_width % m_block_size == 0);
@@ -1199,85 +2147,59 @@ IFrame::IFrame(std::istream& mode_in, std::istream& res_in, unsigned int i, unsi
 	m_modes_and_residuals.resize(differential_modes.size());
 	
 	INTRA_MODE_T last_mode = INTRA_MODE_LEFT;
-	unsigned int iblock = 0, res_block_size;
-	ByteMatrix recon_frame;
+	COORD_T block_coord({0, 0});
+	for(unsigned int iblock = 0; iblock < differential_modes.size(); ++iblock)
+	{
+		assert(block_coord.first < m_frame_height);
+			
+		INTRA_MODE_T cur_mode = last_mode - differential_modes[iblock];
+		last_mode = cur_mode;
+		
+		ResidualBlock res(res_in, m_block_size, qp);
+		assert(res.is_initialized());
+		
+		m_ref_blocks[iblock].first = block_coord;
+		m_modes_and_residuals[iblock] = IF_REF_T(cur_mode, res);
+		
+		block_coord = calculate_next_coord(block_coord, m_block_size, res.get_block_size(), m_frame_width);
+	}
+	assert(block_coord.first == m_frame_height);
 	
-	COORD_T block_coord({0, 0}), ref_coord;
-	while(block_coord.first < m_frame_height)
+	if(!parse_only)
 	{
-		ByteMatrix recon_row;
-		std::deque<ByteMatrix> recon_sub_blocks;
-		while(recon_row.get_width() < m_frame_width)
+		reconstruct();
+	}
+}
+
+void IFrame::reconstruct()
+{
+	// Same neighbours as the encoder predicted from: the reconstructed row just above, or column just left of,
+	// the full-size block each (sub-)block is part of
+	ByteMatrix recon_frame(0x80, m_frame_width, m_frame_height);
+	for(unsigned int iblock = 0; iblock < m_modes_and_residuals.size(); ++iblock)
+	{
+		const COORD_T block_coord = m_ref_blocks[iblock].first;
+		const INTRA_MODE_T mode = m_modes_and_residuals[iblock].first;
+		const ResidualBlock& res = m_modes_and_residuals[iblock].second;
+		const unsigned int res_block_size = res.get_block_size();
+		COORD_T full_coord(block_coord.first - block_coord.first % m_block_size, block_coord.second - block_coord.second % m_block_size);
+		
+		ByteMatrix ref_block(0x80, res_block_size, res_block_size);
+		if(mode == INTRA_MODE_LEFT && full_coord.second > 0)
 		{
-			assert(iblock < differential_modes.size());
-			assert(block_coord.first < m_frame_height);
-				
-			INTRA_MODE_T cur_mode = last_mode - differential_modes[iblock];
-			last_mode = cur_mode;
-			
-			ResidualBlock res(res_in, m_block_size, qp);
-			assert(res.is_initialized());
-			res_block_size = res.get_block_size();
-			
-			ByteMatrix* ref_source = nullptr;
-			ByteMatrix ref_block(0x80, res_block_size, res_block_size);
-			if(cur_mode == INTRA_MODE_LEFT)
-			{			
-				ref_coord.first = block_coord.first - recon_frame.get_height();
-				ref_coord.second = block_coord.second - res_block_size - block_coord.second % m_block_size;
-				ref_source = &recon_row;
-			}
-			else if(cur_mode == INTRA_MODE_ABOVE)
-			{
-				ref_coord.first = block_coord.first - res_block_size - block_coord.first % m_block_size;
-				ref_coord.second = block_coord.second;
-				ref_source = &recon_frame;
-			}
-			
-			if(ref_source->block_coord_is_legal(ref_coord, res_block_size))
-			{
-				ref_block = ref_source->get_block_at(ref_coord, res_block_size);
-			}
-			else
-			{
-				assert(block_coord.first == 0 || block_coord.second == 0 || block_coord.first == m_block_size/2 || block_coord.second == m_block_size/2);
-			}
-			
-			ref_block = ref_block.generate_intra_mode_refblock(cur_mode);
-			ByteMatrix recon_block = res.reconstruct_from(ref_block);
-			if(res_block_size == m_block_size)
-			{
-				recon_row.stitch_right(recon_block);
-			}
-			else
-			{
-				assert(res_block_size == m_block_size/2);
-				recon_sub_blocks.push_back(recon_block);
-				if(recon_sub_blocks.size() == 4)
-				{
-					ByteMatrix top_row = recon_sub_blocks.front();
-					recon_sub_blocks.pop_front();
-					top_row.stitch_right(recon_sub_blocks.front());
-					recon_sub_blocks.pop_front();
-					
-					ByteMatrix bottom_row = recon_sub_blocks.front();
-					recon_sub_blocks.pop_front();
-					bottom_row.stitch_right(recon_sub_blocks.front());
-					recon_sub_blocks.pop_front();
-					
-					top_row.stitch_below(bottom_row);
-					recon_row.stitch_right(top_row);
-				}
-			}
-					
-			m_ref_blocks[iblock] = BLOCK_T(block_coord, ref_block);
-			m_recon_blocks[iblock] = BLOCK_T(block_coord, recon_block);
-			m_modes_and_residuals[iblock] = IF_REF_T(cur_mode, res);
-			
-			block_coord = calculate_next_coord(block_coord, m_block_size, res_block_size, m_frame_width);
-			++iblock;
+			ref_block = recon_frame.get_block_at(COORD_T(block_coord.first, full_coord.second - res_block_size), res_block_size);
 		}
-		recon_frame.stitch_below(recon_row);
+		else if(mode == INTRA_MODE_ABOVE && full_coord.first > 0)
+		{
+			ref_block = recon_frame.get_block_at(COORD_T(full_coord.first - res_block_size, block_coord.second), res_block_size);
+		}
+		
+		ref_block = ref_block.generate_intra_mode_refblock(mode);
+		ByteMatrix recon_block = res.reconstruct_from(ref_block);
+		recon_frame.set_block_at(block_coord, recon_block);
+		
+		m_ref_blocks[iblock].second = ref_block;
+		m_recon_blocks[iblock] = BLOCK_T(block_coord, recon_block);
 	}
 }
 	
@@ -1,6 +1,10 @@
 #include <iostream>
 #include <deque>
 #include  <iomanip>
+#include <memory>
+#include <map>
+#include <limits>
+#include <cstdint>
 
 #include "matrix.h"
 #include "residual.h"
@@ -42,6 +46,9 @@ public:
 	/* constructor from raw bytes */
 	Frame(BYTEVEC_T bytes, unsigned int width, unsigned int height, bool y_only=false);
 	
+	/* Constructor from a raw frame in memory (Y, then U, then V plane), copied straight into the planes */
+	Frame(const BYTE_T* bytes, unsigned int width, unsigned int height);
+	
 	/* Constructor from an array of y-value only blocks */
 	Frame(BLOCKVEC_T y_blocks, unsigned int block_size, unsigned int width, unsigned int height);
 	
@@ -77,6 +84,7 @@ public:
 	unsigned int get_height() 	const { return m_height; }
 	
 	ByteMatrix get_y_block_at(COORD_T coord, unsigned int i) const;
+	ByteBlockView get_y_block_view_at(COORD_T coord, unsigned int i) const { return y_values.get_block_view_at(coord, i); }
 	std::vector<COORD_T> get_y_block_coords(unsigned int i) const;
 	BLOCKVEC_T get_y_block_vec(unsigned int i) const;
 	bool block_coord_is_legal(COORD_T coord, unsigned int i) const;
@@ -85,6 +93,29 @@ public:
 	double PSNR(const Frame& rhs) 	const { return y_values.PSNR(rhs.y_values); }
 	double SSIM(const Frame& rhs) 	const { return y_values.SSIM(rhs.y_values); }
 	double SAD(const Frame& rhs) 	const { return y_values.SAD(rhs.y_values); }
+	
+	/* Downsampled copies of the Y plane for motion search, each half the size of the one before. They're shared
+	   between copies of the frame, so a reconstruction pushed onto the reference frames only builds them once. */
+	void build_pyramid(unsigned int num_levels);
+	unsigned int get_num_pyramid_levels() const { return m_pyramid ? m_pyramid->size() : 0; }
+	/* Level 0 is the Y plane itself */
+	const ByteMatrix& get_pyramid_level(unsigned int level) const { return (level == 0) ? y_values : (*m_pyramid)[level - 1]; }
+	
+	/* Sums of all the ixi blocks of the Y plane, one per top left corner, for successive elimination in motion search
+	   (which goes by the quadrants of the blocks searched). Only blocks of up to 16x16 get one, as their sums fit in
+	   16 bits. Shared between copies like the pyramid. */
+	void build_y_block_sums(unsigned int i);
+	bool has_y_block_sums(unsigned int i) const { return m_y_block_sums.count(i) != 0; }
+	static bool y_block_sums_fit(unsigned int i) { return i * i * 255 <= std::numeric_limits<std::uint16_t>::max(); }
+	/* Adds how far sum is from the sums of num_blocks ixi blocks side by side, the first at coord, to distances */
+	void add_y_block_sum_distances(COORD_T coord, unsigned int i, unsigned int num_blocks, unsigned int sum, unsigned int* distances) const;
+	
+	/* The Y plane interpolated at every quarter-pel offset that precision (2 = half-pel, 4 = quarter-pel) can reach,
+	   so sub-pel vectors can be looked up like whole-pel ones. Shared between copies like the pyramid. */
+	void build_subpel_planes(unsigned int precision);
+	bool has_subpel_planes() const { return m_subpel_planes != nullptr; }
+	/* Block whose top left corner is frac_y/4 below and frac_x/4 right of coord (fractions in quarter-pels, 0 to 3) */
+	ByteBlockView get_y_block_view_at(COORD_T coord, unsigned int i, unsigned int frac_y, unsigned int frac_x) const;
 
 private:
 	void init_from_y_blocks(const BLOCKVEC_T& blocks, unsigned int block_size, unsigned int width, unsigned int height, const INT_VEC_T& block_colours);
@@ -94,6 +125,9 @@ private:
 	ByteMatrix y_values;
 	ByteMatrix u_values;
 	ByteMatrix v_values;
+	std::shared_ptr< const std::vector<ByteMatrix> > m_pyramid;
+	std::map< unsigned int, std::shared_ptr< const std::vector<std::uint16_t> > > m_y_block_sums;
+	std::shared_ptr< const std::vector<ByteMatrix> > m_subpel_planes;
 };
 
 struct MV_T
@@ -101,20 +135,61 @@ struct MV_T
 	int x;
 	int y;
 	int i;
-	MV_T(int ix, int iy, int ii) : x(ix), y(iy), i(ii) {}; 
-	MV_T() : x(0), y(0), i(0) {}; 
+	// Quarter-pels added to x and y (0 to 3); only coded with SubPelPrecision above 1
+	int fx;
+	int fy;
+	MV_T(int ix, int iy, int ii) : x(ix), y(iy), i(ii), fx(0), fy(0) {}; 
+	MV_T() : x(0), y(0), i(0), fx(0), fy(0) {}; 
 	
-	bool operator==(const MV_T& rhs) { return (x == rhs.x) && (y == rhs.y) && (i == rhs.i); }
+	bool operator==(const MV_T& rhs) { return (x == rhs.x) && (y == rhs.y) && (i == rhs.i) && (fx == rhs.fx) && (fy == rhs.fy); }
 };
 
+/* What a vector is reckoned to cost to code in the RD estimates, when it isn't the same as the one before */
+const unsigned int MV_COST_BYTES = 3*sizeof(int);
+
+/* Quarter-pels per pixel; sub-pel vectors are refined in steps of SUBPEL_UNITS / precision of these */
+const int SUBPEL_UNITS = 4;
+
 typedef std::pair< MV_T, ResidualBlock > PF_REF_T;
 typedef std::vector< PF_REF_T > PF_REF_VEC_T;
 
+/* Motion search algorithms: exhaustive, the cross-pattern FastFME search, the predictive zonal search, and the
+   predictive search seeded from a coarse-to-fine search of the frames' pyramids */
+enum ME_MODE_T
+{
+	ME_FULL,
+	ME_FAST,
+	ME_PREDICTIVE,
+	ME_PYRAMID
+};
+
+/* Vector found for each full-size block of a P-frame, in raster order, and what it cost. The predictive search
+   starts from those of the neighbouring blocks and of the same block in the previous P-frame. */
+struct MV_FIELD_T
+{
+	std::vector<MV_T> mvs;
+	std::vector<unsigned int> costs;
+};
+
+/* Where the predictive search starts for one block: vectors to try first (the reference index is ignored; they're
+   tried in every reference), and a cost to stop at if one of them is already that good (0 = don't) */
+struct ME_PREDICTORS_T
+{
+	std::vector<MV_T> mvs;
+	unsigned int early_exit_cost;
+	
+	ME_PREDICTORS_T() : early_exit_cost(0) {};
+};
+
+class BlockRowProgress;
+class MVPredictionGrid;
+
 class PFrame
 {
 public:
-	/* Encoder-side constructor; we have a current frame to encode and a reference frame to base it on */
-	PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsigned int i, int r, unsigned int qp);
+	/* Encoder-side constructor; we have a current frame to encode and a reference frame to base it on. The previous
+	   P-frame's vectors (if there was one since the last I-frame) seed the predictive search. */
+	PFrame(const Frame& cur_frame, const std::deque<Frame>& ref_frames, unsigned int i, int r, unsigned int qp, const MV_FIELD_T* prev_mv_field = nullptr);
 	
 	/* Decoder-side constructor; we have a streams that the encoder-side PFrame wrote to how big the frame is */
 	PFrame(std::istream& mv_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp);
@@ -123,6 +198,7 @@ public:
 	void print(std::ostream& mv_out, std::ostream& res_out);
 	
 	const PF_REF_VEC_T& get_refs() 	const { return m_mv_and_residuals; }
+	const MV_FIELD_T& get_mv_field() const { return m_mv_field; }
 	unsigned int get_block_size() 	const { return m_block_size; }
 	INT_VEC_T get_block_colours()		const;
 	
@@ -151,25 +227,79 @@ public:
 	}
 //Juan
 	static int GetCachePos(int cur_pos, int r, int limit, int window_width, int block_size);
-	static int ME(ByteMatrix a, ByteMatrix b, int block_size, int offset_x, int offset_y);
+	static int ME(const ByteMatrix& a, const ByteMatrix& b, int block_size, int offset_x, int offset_y);
 //	static std::pair<int, int> PFrame::StartME(ByteMatrix cache, ByteMatrix cur_block, SearchQ search_vectors, int cache_width, int cache_height, int block_size);
 //
 
 private:
 
-	static std::tuple<unsigned int, ByteMatrix, MV_T> search_for_best_ref (
+	// Search and code row irow of blocks (num_blocks coords starting at block_coords), appending to row_refs and filling
+	// in the row's part of mv_field and grid. Predictors and predicted vectors come from the row above, so it waits on progress.
+	void encode_block_row(const Frame& cur_frame, const std::deque<Frame>& ref_frames, const COORD_T* block_coords, unsigned int num_blocks, 
+		unsigned int irow, int r, unsigned int qp, PF_REF_VEC_T& row_refs, MV_FIELD_T& mv_field, const MV_FIELD_T* prev_mv_field, MVPredictionGrid& grid,
+		BlockRowProgress& progress) const;
+	
+	// Predictors for full-size block (irow, icol), from the blocks of mv_field above and to the left of it and the same block in prev_mv_field
+	ME_PREDICTORS_T get_predictors(unsigned int irow, unsigned int icol, const MV_FIELD_T& mv_field, const MV_FIELD_T* prev_mv_field) const;
+
+	// Best few vectors for a block found by searching the coarsest shared pyramid level of the current and reference
+	// frames in full, then refining each level by level down to full resolution; empty if the block is too small to downsample
+	static std::vector<MV_T> pyramid_search_ref (
+		const COORD_T& cur_coord,
+		const Frame& cur_frame,
+		const Frame& ref_frame,
+		int r,
+		unsigned int block_size );
+
+	// Half- and then (if the precision allows) quarter-pel refinement around the best whole-pel vector of a search
+	static std::tuple<unsigned int, ByteBlockView, MV_T> subpel_refine (
+		const COORD_T& cur_coord,
+		const ByteBlockView& cur_block,
+		const std::deque<Frame>& ref_frames,
+		unsigned int block_size,
+		unsigned int qp,
+		const MV_T& last_mv,
+		const std::tuple<unsigned int, ByteBlockView, MV_T>& whole_pel_result );
+
+	// Exhaustive search of one reference frame; the predictors only tighten how soon candidates are given up on
+	static std::tuple<unsigned int, ByteBlockView, MV_T> full_search_ref (
+		const COORD_T& cur_coord, 
+		const ByteBlockView& cur_block,
+		const Frame& ref_frame, 
+		unsigned int iref,
+		int r, 
+		unsigned int block_size,
+		unsigned int qp,
+		const MV_T& last_mv,
+		const ME_PREDICTORS_T& predictors );
+
+	// Predictive zonal search of one reference frame: the best of the predictors, refined with a large and then a small diamond
+	static std::tuple<unsigned int, ByteBlockView, MV_T> predictive_search_ref (
 		const COORD_T& cur_coord, 
-		const ByteMatrix& cur_block,
+		const ByteBlockView& cur_block,
+		const Frame& ref_frame, 
+		unsigned int iref,
+		int r, 
+		unsigned int block_size,
+		unsigned int qp,
+		const MV_T& last_mv,
+		const ME_PREDICTORS_T& predictors );
+
+	static std::tuple<unsigned int, ByteBlockView, MV_T> search_for_best_ref (
+		const COORD_T& cur_coord, 
+		const ByteBlockView& cur_block,
+		const Frame& cur_frame,
 		const std::deque<Frame>& ref_frames, 
 		int r, 
 		unsigned int block_size,
 		unsigned int qp,
-		bool fast_me,
-		const MV_T& last_mv );
+		ME_MODE_T me_mode,
+		const MV_T& last_mv,
+		const ME_PREDICTORS_T& predictors );
 //Juan
-	static std::tuple<unsigned int, ByteMatrix, MV_T> search_for_best_ref_hw(
+	static std::tuple<unsigned int, ByteBlockView, MV_T> search_for_best_ref_hw(
 		const COORD_T& cur_coord,
-		const ByteMatrix& cur_block,
+		const ByteBlockView& cur_block,
 		const std::deque<Frame>& ref_frames,
 		int r,
 		unsigned int block_size,
@@ -181,18 +311,29 @@ private:
 	unsigned int m_frame_width;
 	unsigned int m_frame_height;
 	PF_REF_VEC_T m_mv_and_residuals;
+	MV_FIELD_T m_mv_field;
 };
 //
 typedef int INTRA_MODE_T;
 typedef std::pair< INTRA_MODE_T, ResidualBlock > IF_REF_T;
 typedef std::vector< IF_REF_T > IF_REF_VEC_T;
 
+/* What one row of IFrame blocks was coded as, in bitstream order */
+struct IF_ROW_T
+{
+	BLOCKVEC_T ref_blocks;
+	BLOCKVEC_T recon_blocks;
+	IF_REF_VEC_T modes_and_residuals;
+};
+
 class IFrame
 {
 public:
 	IFrame(const Frame& cur_frame, unsigned int i, unsigned int qp);
 	
-	IFrame(std::istream& mode_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp);
+	/* Decoder-side constructor; with parse_only, the blocks aren't reconstructed until reconstruct() is called */
+	IFrame(std::istream& mode_in, std::istream& res_in, unsigned int i, unsigned int frame_width, unsigned int frame_height, unsigned int qp, bool parse_only = false);
+	void reconstruct();
 	
 	unsigned int write(std::ostream& mode_out, std::ostream& res_out);
 	void print(std::ostream& mode_out, std::ostream& res_out);
@@ -209,6 +350,10 @@ public:
 	Frame mode_frame()						const { return Frame(m_ref_blocks, m_block_size, m_frame_width, m_frame_height, get_block_colours()); };
 	
 private:
+	/* Code the full-size block at block_coord (split or not) against the reconstruction so far, appending it to row; returns the last mode used */
+	INTRA_MODE_T encode_block(const Frame& cur_frame, const ByteMatrix& recon_frame, const COORD_T& block_coord, unsigned int qp, INTRA_MODE_T last_mode, IF_ROW_T& row) const;
+	static bool same_modes(const IF_ROW_T& a, const IF_ROW_T& b);
+
 	unsigned int m_block_size;
 	unsigned int m_frame_width;
 	unsigned int m_frame_height;
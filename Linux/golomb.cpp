@@ -1,14 +1,55 @@
 #include "golomb.h"
+#include "input.h"
 #include <map>
+#include <mutex>
 #include <cassert>
 #include <algorithm>
 #include <iomanip>
 
+// Number of leading zero bits in each byte value, used to find the end of a code's zero prefix a byte at a time
+// and the bit length of the values being encoded
+struct LeadingZeroTable
+{
+	BYTE_T zeros[256];
+	LeadingZeroTable()
+	{
+		zeros[0] = 8;
+		for(unsigned int b = 1; b < 256; ++b)
+		{
+			BYTE_T n = 0;
+			while(((b << n) & 0x80) == 0)
+				++n;
+			zeros[b] = n;
+		}
+	}
+};
+
+static const LeadingZeroTable l_leading_zeros;
+
+static unsigned int l_bit_length(unsigned int v)
+{
+	for(int shift = 8*(sizeof(unsigned int) - 1); shift > 0; shift -= 8)
+	{
+		if((v >> shift) != 0)
+			return shift + 8 - l_leading_zeros.zeros[(v >> shift) & 0xFF];
+	}
+	return 8 - l_leading_zeros.zeros[v & 0xFF];
+}
+
+// How much is pulled from a stream at once when reading
+const unsigned int GOLOMB_READ_CHUNK = 64*1024;
+
+// Exponential-Golomb coded bits, most significant bit first within each byte. A value v > 0 of L bits is coded
+// as L-1 zeros followed by the L bits of v.
+// When reading, m_read is a window onto the stream. Streams already in memory (mapped files, packet payloads) are
+// read in place, the window being everything they have left. Anything else is copied into m_bytes a chunk at a
+// time, with consumed bytes dropped on each refill, so it never grows past a chunk plus the tail of the code being read.
 class GolombBytes
 {
 public:
-	GolombBytes() : 							m_bytes(), m_istream(nullptr), m_byte_offset(0), m_bit_offset_mask(0x80) {};
-	GolombBytes(std::istream* in) : 	m_bytes(), m_istream(in), m_byte_offset(0), m_bit_offset_mask(0x80) {};
+	GolombBytes() : 							m_bytes(), m_istream(nullptr), m_in_place(nullptr), m_read(nullptr), m_read_size(0), m_byte_offset(0), m_bit_offset(0), m_acc(0), m_acc_bits(0) {};
+	GolombBytes(std::istream* in) : 	m_bytes(), m_istream(in), m_in_place(dynamic_cast<MappedStreamBuf*>(in->rdbuf())), m_read(nullptr), m_read_size(0), 
+										m_byte_offset(0), m_bit_offset(0), m_acc(0), m_acc_bits(0) {};
 	
 	// Actually perform the Exponential-Golomb encoding and push it into the byte vector
 	void push_int(const int& i);
@@ -20,26 +61,55 @@ public:
 	// periodically round the offset up
 	void round_offset_to_next_byte()
 	{
-		if(m_bit_offset_mask < 0x80)
+		if(m_bit_offset > 0)
 		{
 			m_byte_offset++;
-			m_bit_offset_mask = 0x80;
+			m_bit_offset = 0;
 		}
 	}
 	
 	unsigned int write(std::ostream& out);
 	
+	// Raw (byte-aligned) bytes interleaved with the coded ints
+	char read_byte();
+	bool at_end();
+	
 private:
+	// Append the low num_bits of bits; whole bytes are moved out of the accumulator as soon as they're complete
+	void put_bits(std::uint64_t bits, unsigned int num_bits);
+	
+	// Make sure num_bytes bytes from the current offset are available, refilling the window from the stream if not
+	void fetch(unsigned int num_bytes);
+	// Drop the consumed bytes and read up to another chunk; returns false if nothing more could be read
+	bool refill();
+	
+	void push_unsigned(unsigned int v);
+	unsigned int read_unsigned();
+	
 	BYTEVEC_T m_bytes;
 	std::istream* m_istream;
+	// Set when the stream's bytes can be read where they are
+	MappedStreamBuf* m_in_place;
+	
+	// Bytes being read from: either straight from m_in_place or the copy in m_bytes
+	const BYTE_T* m_read;
+	std::size_t m_read_size;
+	
+	// Reading position
 	unsigned int m_byte_offset;
-	BYTE_T m_bit_offset_mask;
+	unsigned int m_bit_offset;
+	
+	// Bits written but not yet making up a whole byte (the low m_acc_bits of m_acc)
+	std::uint64_t m_acc;
+	unsigned int m_acc_bits;
 };
 
-// Singleton for managing the GolombBytes on the decoder side
+// Singleton for managing the GolombBytes on the decoder side. GOPs can be decoded on several threads at once, each
+// from its own streams, so the map is shared between them; each GolombBytes is only ever used by one thread.
 class GolombTracker
 {
 private:
+	std::mutex m_mutex;
 	std::map< std::istream*, GolombBytes* > m_tracked_bytes;
 	GolombTracker() {};
 	~GolombTracker()
@@ -58,8 +128,20 @@ public:
 		return instance;
 	}
 	
+	void release_stream(std::istream& istream)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_tracked_bytes.find( &istream );
+		if (it != m_tracked_bytes.end())
+		{
+			delete it->second;
+			m_tracked_bytes.erase(it);
+		}
+	}
+	
 	GolombBytes* get_bytes_for_stream(std::istream& istream)
 	{
+		std::lock_guard<std::mutex> lock(m_mutex);
 		GolombBytes* ret = nullptr;
 		auto it = m_tracked_bytes.find( &istream );
 		if (it != m_tracked_bytes.end())
@@ -112,156 +194,148 @@ INT_VEC_T GOLOMB::read_int_vec_from_stream(std::istream& in)
 	return read_vec;
 }
 
-BIT_T GOLOMB::get_bit(BYTEVEC_T& bytevec, const unsigned int byte_offset, const BYTE_T bit_mask, std::istream* bytestream)
+char GOLOMB::read_byte_from_stream(std::istream& in)
 {
-	if(byte_offset == bytevec.size() && bytestream != nullptr)
-	{
-		assert(bit_mask == 0x80);
-		char next;
-		bytestream->get( next );
-		assert(!bytestream->eof());
-		
-		bytevec.push_back((BYTE_T)next);
-	}
-	assert(byte_offset < bytevec.size());
-	
-	const BYTE_T& byte = bytevec[byte_offset];
-	BIT_T masked = byte & bit_mask;
-	if (masked != 0)
-		return 1;
-	return 0;
+	return GolombTracker::get_instance().get_bytes_for_stream(in)->read_byte();
 }
 
-void GOLOMB::set_bit(BYTEVEC_T& bytevec, const unsigned int byte_offset, const BYTE_T bit_mask,  BIT_T bit)
+bool GOLOMB::stream_at_end(std::istream& in)
 {
-	if(byte_offset == bytevec.size())
-	{
-		assert(bit_mask == 0x80);
-		bytevec.push_back(0x00);
-	}
-	assert(byte_offset < bytevec.size());
-	
-	if(bit == 1)
-	{
-		bytevec[byte_offset] |= bit_mask;
-	}
-	else
-	{
-		bytevec[byte_offset] &= ~bit_mask;
-	}
+	return GolombTracker::get_instance().get_bytes_for_stream(in)->at_end();
 }
 
-void GOLOMB::incr_bit(unsigned int& byte_offset, BYTE_T& bit_mask)
+void GOLOMB::release_stream(std::istream& in)
 {
-	bit_mask = bit_mask >> 1;
-	if(bit_mask == 0)
-	{
-		byte_offset++;
-		bit_mask = 0x80;
-	}
+	GolombTracker::get_instance().release_stream(in);
 }
 
-void GOLOMB::decr_bit(unsigned int& byte_offset, BYTE_T& bit_mask)
+unsigned int GolombBytes::write(std::ostream& out)
 {
-	bit_mask = bit_mask << 1;
-	if(bit_mask == 0)
+	// Pad the last byte with zeros
+	if(m_acc_bits > 0)
 	{
-		byte_offset--;
-		bit_mask = 0x01;
+		put_bits(0, 8 - m_acc_bits);
 	}
+	unsigned int num_bytes = m_bytes.size();
+	out.write(reinterpret_cast<const char*>(&m_bytes[0]), num_bytes*sizeof(BYTE_T));
+	return num_bytes*sizeof(BYTE_T);
 }
 
-void GOLOMB::encode_unsigned_int_to_bytes(const unsigned int i, BYTEVEC_T& bytes, unsigned int& byte_offset, BYTE_T& bit_mask)
+void GolombBytes::put_bits(std::uint64_t bits, unsigned int num_bits)
 {
-	// Transform 0 or less using extension to negative numbers; by the time it's here we should only be encoding positive numbers
-	assert(i > 0);
-	BYTEVEC_T int_bytes;
-	const BYTE_T* raw_int_bytes = reinterpret_cast<const BYTE_T*>(&i);
-	int_bytes.insert(int_bytes.begin(), raw_int_bytes, raw_int_bytes + sizeof(unsigned int));	
-	
-	//Tested and developed on a machine that's little-endian; if run on a big-endian processor this result in bigger bitstreams than desired
-	std::reverse(int_bytes.begin(), int_bytes.end());
-	
-	unsigned int int_byte_offset = 0;
-	BYTE_T int_bit_mask = 0x80;
-	
-	// Find the first bit in the int that's set
-	while(get_bit(int_bytes, int_byte_offset, int_bit_mask) == 0)
+	assert(num_bits <= 32 && m_acc_bits < 8);
+	m_acc = (m_acc << num_bits) | bits;
+	m_acc_bits += num_bits;
+	while(m_acc_bits >= 8)
 	{
-		incr_bit(int_byte_offset, int_bit_mask);
+		m_acc_bits -= 8;
+		m_bytes.push_back( BYTE_T(m_acc >> m_acc_bits) );
 	}
-	
-	// Now, for each bit remaining (less 1), push a 0 to the out stream...
-	unsigned int temp_offset = int_byte_offset;
-	BYTE_T temp_bit_mask = int_bit_mask;
-	incr_bit(temp_offset, temp_bit_mask);
-	
-	//unsigned int leading_zeroes = 0;
-	while(temp_offset < int_bytes.size())
+}
+
+bool GolombBytes::refill()
+{
+	assert(m_istream != nullptr);
+	if(m_in_place != nullptr)
 	{
-		set_bit(bytes, byte_offset, bit_mask, 0);
-		//leading_zeroes++;
-		incr_bit(temp_offset, temp_bit_mask);
-		incr_bit(byte_offset, bit_mask);
+		// The first window already takes everything there is, so there's never anything left to join it to
+		std::size_t num_unread = m_in_place->num_unread();
+		if(num_unread == 0 || m_read != nullptr)
+		{
+			return false;
+		}
+		m_read = m_in_place->unread();
+		m_read_size = num_unread;
+		m_in_place->consume(num_unread);
+		return true;
 	}
 	
-	
-	//... and then push the actual values
-	//unsigned int data_bits = 0;
-	while(int_byte_offset < int_bytes.size())
+	m_bytes.erase(m_bytes.begin(), m_bytes.begin() + m_byte_offset);
+	m_byte_offset = 0;
+	
+	unsigned int kept = m_bytes.size();
+	m_bytes.resize(kept + GOLOMB_READ_CHUNK);
+	m_istream->read(reinterpret_cast<char*>(&m_bytes[kept]), GOLOMB_READ_CHUNK);
+	unsigned int num_read = (unsigned int)m_istream->gcount();
+	m_bytes.resize(kept + num_read);
+	m_read = m_bytes.data();
+	m_read_size = m_bytes.size();
+	return num_read > 0;
+}
+
+void GolombBytes::fetch(unsigned int num_bytes)
+{
+	while(m_byte_offset + num_bytes > m_read_size)
 	{
-		BIT_T bit = get_bit(int_bytes, int_byte_offset, int_bit_mask);
-		//data_bits++;
-		set_bit(bytes, byte_offset, bit_mask, bit);
-		
-		incr_bit(int_byte_offset, int_bit_mask);
-		incr_bit(byte_offset, bit_mask);
+		bool more = refill();
+		assert(more);
+		if(!more)
+		{
+			std::cout << "ERROR: Unexpected end of stream!" << std::endl;
+			break;
+		}
 	}
-	//std::cout << "[" << leading_zeroes << "-0's, " << data_bits << "-b's]";
 }
 
-unsigned int GOLOMB::decode_unsigned_int_from_bytes(BYTEVEC_T& bytes, unsigned int& byte_offset, BYTE_T& bit_mask, std::istream* bytestream)
+char GolombBytes::read_byte()
 {
-	BYTEVEC_T int_bytes(sizeof(unsigned int), 0x00);
-	
-	unsigned int int_byte_offset = int_bytes.size() - 1;
-	BYTE_T int_bit_mask = 0x01;
-	
-	//Index from the right in the int bit vector for each leading 0 in the bytes
-	//unsigned int leading_zeroes = 0;
-	while(get_bit(bytes, byte_offset, bit_mask, bytestream) == 0)
+	assert(m_bit_offset == 0);
+	fetch(1);
+	return (char)m_read[m_byte_offset++];
+}
+
+bool GolombBytes::at_end()
+{
+	return m_byte_offset >= m_read_size && !refill();
+}
+
+void GolombBytes::push_unsigned(unsigned int v)
+{
+	// Transform 0 or less using extension to negative numbers; by the time it's here we should only be encoding positive numbers
+	assert(v > 0);
+	unsigned int num_bits = l_bit_length(v);
+	put_bits(0, num_bits - 1);
+	put_bits(v, num_bits);
+}
+
+unsigned int GolombBytes::read_unsigned()
+{
+	// Count the zero prefix a byte at a time
+	unsigned int leading_zeroes = 0;
+	while(true)
 	{
-		//leading_zeroes++;
-		incr_bit(byte_offset, bit_mask);
-		decr_bit(int_byte_offset, int_bit_mask);
+		fetch(1);
+		BYTE_T remaining = BYTE_T(m_read[m_byte_offset] << m_bit_offset);
+		if(remaining != 0)
+		{
+			unsigned int zeros = l_leading_zeros.zeros[remaining];
+			leading_zeroes += zeros;
+			m_bit_offset += zeros;
+			break;
+		}
+		leading_zeroes += 8 - m_bit_offset;
+		m_byte_offset++;
+		m_bit_offset = 0;
 	}
 	
-	//Now go back through the int and set the bits to match
-	//unsigned int data_bits = 0;
-	while(int_byte_offset < int_bytes.size())
+	// The value itself is the next leading_zeroes+1 bits; load the bytes covering them into one word and mask them out
+	unsigned int num_bits = leading_zeroes + 1;
+	assert(num_bits <= 8*sizeof(unsigned int));
+	unsigned int num_bytes = (m_bit_offset + num_bits + 7) / 8;
+	fetch(num_bytes);
+	
+	std::uint64_t word = 0;
+	for(unsigned int i = 0; i < num_bytes; ++i)
 	{
-		BIT_T bit = get_bit(bytes, byte_offset, bit_mask, bytestream);
-		//data_bits++;
-		set_bit(int_bytes, int_byte_offset, int_bit_mask, bit);
-		
-		incr_bit(int_byte_offset, int_bit_mask);
-		incr_bit(byte_offset, bit_mask);
+		word = (word << 8) | m_read[m_byte_offset + i];
 	}
-	//std::cout << "[" << leading_zeroes << "-0's, " << data_bits << "-b's]";
+	unsigned int decoded = (unsigned int)( (word >> (8*num_bytes - m_bit_offset - num_bits)) & ((std::uint64_t(1) << num_bits) - 1) );
 	
-	//Tested and developed on a machine that's little-endian; if run on a big-endian processor this result in bigger bitstreams than desired
-	std::reverse(int_bytes.begin(), int_bytes.end());
-	
-	unsigned int decoded = *reinterpret_cast<unsigned int*>(&int_bytes[0]);
+	m_bit_offset += num_bits;
+	m_byte_offset += m_bit_offset / 8;
+	m_bit_offset %= 8;
 	return decoded;
 }
-	
-unsigned int GolombBytes::write(std::ostream& out)
-{
-	unsigned int num_bytes = m_bytes.size();
-	out.write(reinterpret_cast<const char*>(&m_bytes[0]), num_bytes*sizeof(BYTE_T));
-	return num_bytes*sizeof(BYTE_T);
-}
 
 void GolombBytes::push_int(const int& i)
 {
@@ -276,38 +350,12 @@ void GolombBytes::push_int(const int& i)
 	}
 	assert(num_to_encode > 0);
 	
-	//TODO: Implement Exponential-Golomb encoding
-	GOLOMB::encode_unsigned_int_to_bytes(num_to_encode, m_bytes, m_byte_offset, m_bit_offset_mask);
-	
-	/*const BYTE_T* bytes = reinterpret_cast<const BYTE_T*>(&num_to_encode);
-	m_bytes.insert(m_bytes.begin() + m_byte_offset, bytes, bytes + sizeof(int));*/
-	
-	// read_int will increment the offsets accordingly and ensure the data can be safely extracted
-	/*int read = read_int();
-	if (i != read)
-	{
-		std::cout << i << " != " << read << std::endl;
-	}
-	assert(i == read);*/
+	push_unsigned(num_to_encode);
 }
 
 int GolombBytes::read_int()
 {	
-	//TODO: Implement Exponential-Golomb decoding
-	/*assert(m_bit_offset_mask == 0x80);
-	assert(m_byte_offset + sizeof(int) <= m_bytes.size() || (m_istream != nullptr && m_byte_offset == m_bytes.size()));
-
-	if(m_byte_offset == m_bytes.size() && m_istream != nullptr)
-	{
-		// We need to load more bytes from the stream! For now, we know we need to load sizeof(int) more
-		m_bytes.resize(m_bytes.size() + sizeof(int));
-		m_istream->read(reinterpret_cast<char*>(&m_bytes[m_byte_offset]), sizeof(int));
-		assert(m_istream);
-	}
-	
-	unsigned int decoded = *reinterpret_cast<unsigned int*>(&m_bytes[m_byte_offset]);
-	m_byte_offset += sizeof(int);*/
-	unsigned int decoded = GOLOMB::decode_unsigned_int_from_bytes(m_bytes, m_byte_offset, m_bit_offset_mask, m_istream);
+	unsigned int decoded = read_unsigned();
 	
 	int ret = 0;
 	if(decoded % 2 == 0)
@@ -320,4 +368,4 @@ int GolombBytes::read_int()
 	}
 	
 	return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,80 @@
+#include "gop_index.h"
+#include <fstream>
+#include <algorithm>
+
+// Text, one GOP per line, so that it can be checked by eye
+static const char* const GOP_INDEX_MAGIC = "GOPINDEX";
+static const unsigned int GOP_INDEX_VERSION = 1;
+
+std::string GOP_INDEX::filename_for(const std::string& mvs_filename)
+{
+	return mvs_filename + ".idx";
+}
+
+bool GOP_INDEX::write(const std::string& filename, const GOP_INDEX_T& index, unsigned int num_frames, std::uint64_t mvs_size, std::uint64_t res_size)
+{
+	std::ofstream out(filename);
+	if(!out.is_open())
+	{
+		std::cout << "WARNING: Could not write GOP index " << filename << std::endl;
+		return false;
+	}
+	
+	out << GOP_INDEX_MAGIC << " " << GOP_INDEX_VERSION << " " << num_frames << " " << mvs_size << " " << res_size << " " << index.size() << std::endl;
+	for(const GOP_ENTRY_T& entry : index)
+	{
+		out << entry.frame << " " << entry.mvs_offset << " " << entry.res_offset << std::endl;
+	}
+	return out.good();
+}
+
+bool GOP_INDEX::read(const std::string& filename, GOP_INDEX_T& index, unsigned int& num_frames, std::uint64_t& mvs_size, std::uint64_t& res_size)
+{
+	index.clear();
+	std::ifstream in(filename);
+	if(!in.is_open())
+	{
+		return false;
+	}
+	
+	std::string magic;
+	unsigned int version = 0, num_gops = 0;
+	in >> magic >> version >> num_frames >> mvs_size >> res_size >> num_gops;
+	if(!in || magic != GOP_INDEX_MAGIC || version != GOP_INDEX_VERSION)
+	{
+		std::cout << "WARNING: " << filename << " is not a GOP index" << std::endl;
+		return false;
+	}
+	
+	for(unsigned int i = 0; i < num_gops; ++i)
+	{
+		GOP_ENTRY_T entry;
+		in >> entry.frame >> entry.mvs_offset >> entry.res_offset;
+		// GOPs are listed in order, starting with the first frame, and all start within the streams
+		bool in_order = index.empty() ? (entry.frame == 0 && entry.mvs_offset == 0 && entry.res_offset == 0) :
+			(entry.frame > index.back().frame && entry.frame < num_frames &&
+			 entry.mvs_offset > index.back().mvs_offset && entry.res_offset > index.back().res_offset);
+		in_order = in_order && entry.mvs_offset < mvs_size && entry.res_offset < res_size;
+		if(!in || !in_order)
+		{
+			std::cout << "WARNING: GOP index " << filename << " is damaged at entry " << i << std::endl;
+			index.clear();
+			return false;
+		}
+		index.push_back(entry);
+	}
+	
+	if(index.empty())
+	{
+		std::cout << "WARNING: GOP index " << filename << " is empty" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+const GOP_ENTRY_T& GOP_INDEX::find(const GOP_INDEX_T& index, unsigned int frame)
+{
+	assert(!index.empty() && index.front().frame == 0);
+	auto it = std::upper_bound(index.begin(), index.end(), frame, [](unsigned int f, const GOP_ENTRY_T& entry) { return f < entry.frame; });
+	return *(it - 1);
+}
@@ -0,0 +1,33 @@
+#include "util.h"
+#include <string>
+#include <iostream>
+
+#ifndef _GOP_INDEX_H
+#define _GOP_INDEX_H
+
+// Where a GOP starts: the number of its I-frame and the offsets of that frame's data in the two streams
+struct GOP_ENTRY_T
+{
+	unsigned int frame;
+	std::uint64_t mvs_offset;
+	std::uint64_t res_offset;
+};
+typedef std::vector<GOP_ENTRY_T> GOP_INDEX_T;
+
+// Optional sidecar next to the mvs stream ("<mvs file>.idx") listing every GOP, so the decoder can start at the
+// I-frame nearest to a requested frame instead of decoding everything before it. The streams themselves don't
+// change; without the sidecar they are simply decoded from the start.
+namespace GOP_INDEX
+{
+	std::string filename_for(const std::string& mvs_filename);
+	
+	// num_frames is the total number of frames in the streams, and mvs_size and res_size their lengths in bytes.
+	// The lengths tell an index apart from one left behind by an earlier encode into the same files.
+	bool write(const std::string& filename, const GOP_INDEX_T& index, unsigned int num_frames, std::uint64_t mvs_size, std::uint64_t res_size);
+	bool read(const std::string& filename, GOP_INDEX_T& index, unsigned int& num_frames, std::uint64_t& mvs_size, std::uint64_t& res_size);
+	
+	// Last GOP starting at or before frame; the index always starts with frame 0
+	const GOP_ENTRY_T& find(const GOP_INDEX_T& index, unsigned int frame);
+}
+
+#endif // _GOP_INDEX_H
@@ -0,0 +1,200 @@
+#include "input.h"
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define INPUT_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+#ifdef INPUT_MMAP
+	// Only regular files are opened here. Opening a FIFO's read end just to find out it can't be mapped would close it
+	// again under a writer that's already going (which then dies of SIGPIPE) before the streaming fallback reopens it.
+	struct stat st;
+	if(stat(filename, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+	
+	int fd = ::open(filename, O_RDONLY);
+	if(fd < 0)
+	{
+		return false;
+	}
+
+	// The path may have been replaced in between
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		::close(fd);
+		return false;
+	}
+
+	m_size = (std::size_t)st.st_size;
+	if(m_size > 0)
+	{
+		void* addr = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(addr == MAP_FAILED)
+		{
+			::close(fd);
+			m_size = 0;
+			return false;
+		}
+		// Everything is consumed front to back
+		madvise(addr, m_size, MADV_SEQUENTIAL);
+		m_data = static_cast<const BYTE_T*>(addr);
+	}
+	// The mapping stays valid after the descriptor is closed
+	::close(fd);
+	m_mapped = true;
+	return true;
+#else
+	(void)filename;
+	return false;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef INPUT_MMAP
+	if(m_data != nullptr)
+	{
+		munmap(const_cast<BYTE_T*>(m_data), m_size);
+	}
+#endif
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+}
+
+void MappedFile::will_need(std::size_t offset, std::size_t size) const
+{
+#ifdef INPUT_MMAP
+	if(m_data != nullptr && offset < m_size)
+	{
+		// madvise wants a page-aligned start
+		std::size_t page = (std::size_t)sysconf(_SC_PAGESIZE);
+		std::size_t begin = offset - offset % page;
+		std::size_t end = std::min(offset + size, m_size);
+		madvise(const_cast<BYTE_T*>(m_data) + begin, end - begin, MADV_WILLNEED);
+	}
+#else
+	(void)offset;
+	(void)size;
+#endif
+}
+
+void MappedFile::done_with(std::size_t offset, std::size_t size) const
+{
+#ifdef INPUT_MMAP
+	if(m_data != nullptr && offset < m_size)
+	{
+		// Only whole pages inside the range can go; the mapping is read-only so they're simply re-read if touched
+		std::size_t page = (std::size_t)sysconf(_SC_PAGESIZE);
+		std::size_t begin = (offset + page - 1) / page * page;
+		std::size_t end = std::min(offset + size, m_size) / page * page;
+		if(begin < end)
+		{
+			madvise(const_cast<BYTE_T*>(m_data) + begin, end - begin, MADV_DONTNEED);
+		}
+	}
+#else
+	(void)offset;
+	(void)size;
+#endif
+}
+
+InputStream::InputStream(const char* filename) : m_mapped_stream(&m_mapped_buf), m_stream(nullptr)
+{
+	if(std::strcmp(filename, "-") == 0)
+	{
+		m_stream = &std::cin;
+	}
+	else if(m_mapped.open(filename))
+	{
+		m_mapped_buf.reset(m_mapped.get_data(), m_mapped.get_size());
+		m_stream = &m_mapped_stream;
+	}
+	else
+	{
+		m_file.open(filename, std::ifstream::binary);
+		if(m_file.is_open())
+		{
+			m_stream = &m_file;
+		}
+		else
+		{
+			std::cout << "Could not open file " << filename << std::endl;
+		}
+	}
+}
+
+FrameSource::FrameSource(const char* filename, unsigned int frame_bytes) :
+m_frame_bytes(frame_bytes), m_offset(0), m_stream(nullptr), m_trailing_bytes(0)
+{
+	assert(m_frame_bytes > 0);
+	if(std::strcmp(filename, "-") == 0)
+	{
+		m_stream = &std::cin;
+	}
+	else if(!m_mapped.open(filename))
+	{
+		m_file.open(filename, std::ifstream::binary);
+		if(m_file.is_open())
+		{
+			m_stream = &m_file;
+		}
+		else
+		{
+			std::cout << "Could not open file " << filename << std::endl;
+		}
+	}
+
+	if(m_stream != nullptr)
+	{
+		m_buffer.resize(m_frame_bytes);
+	}
+}
+
+const BYTE_T* FrameSource::next_frame()
+{
+	if(m_mapped.is_open())
+	{
+		if(m_offset + m_frame_bytes > m_mapped.get_size())
+		{
+			m_trailing_bytes = m_mapped.get_size() - m_offset;
+			return nullptr;
+		}
+		// The frame handed out by the previous call isn't in use anymore
+		if(m_offset >= m_frame_bytes)
+		{
+			m_mapped.done_with(m_offset - m_frame_bytes, m_frame_bytes);
+		}
+		m_mapped.will_need(m_offset + m_frame_bytes, m_frame_bytes);
+		
+		const BYTE_T* frame = m_mapped.get_data() + m_offset;
+		m_offset += m_frame_bytes;
+		return frame;
+	}
+
+	if(m_stream == nullptr)
+	{
+		return nullptr;
+	}
+
+	m_stream->read(reinterpret_cast<char*>(&m_buffer[0]), m_frame_bytes);
+	std::size_t num_read = (std::size_t)m_stream->gcount();
+	if(num_read < m_frame_bytes)
+	{
+		m_trailing_bytes = num_read;
+		return nullptr;
+	}
+	return &m_buffer[0];
+}
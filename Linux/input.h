@@ -0,0 +1,124 @@
+#include "util.h"
+#include <fstream>
+#include <istream>
+#include <streambuf>
+
+#ifndef _INPUT_H
+#define _INPUT_H
+
+// Read-only memory mapping of a whole file. Opening fails for anything that can't be mapped (pipes, character
+// devices, or platforms without mmap), in which case callers should fall back to streaming.
+class MappedFile
+{
+public:
+	MappedFile() : m_data(nullptr), m_size(0), m_mapped(false) {};
+	~MappedFile() { close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char* filename);
+	void close();
+
+	// Hint that a range is about to be read, or won't be read again and can be dropped from memory
+	void will_need(std::size_t offset, std::size_t size) const;
+	void done_with(std::size_t offset, std::size_t size) const;
+
+	bool is_open() const 			{ return m_mapped; }
+	const BYTE_T* get_data() const	{ return m_data; }
+	std::size_t get_size() const	{ return m_size; }
+
+private:
+	const BYTE_T* m_data;
+	std::size_t m_size;
+	bool m_mapped;
+};
+
+// Lets a mapped file be consumed through std::istream without copying it into a stream buffer first
+class MappedStreamBuf : public std::streambuf
+{
+public:
+	void reset(const BYTE_T* data, std::size_t size)
+	{
+		char* begin = const_cast<char*>(reinterpret_cast<const char*>(data));
+		setg(begin, begin, begin + size);
+	}
+	
+	// The bytes not read yet, for readers that use them where they are rather than copying them out; consume moves
+	// the read position past the ones such a reader has taken
+	const BYTE_T* unread() const { return reinterpret_cast<const BYTE_T*>(gptr()); }
+	std::size_t num_unread() const { return (std::size_t)(egptr() - gptr()); }
+	void consume(std::size_t num_bytes) { setg(eback(), gptr() + num_bytes, egptr()); }
+	
+protected:
+	// Seeking only moves the read position within the mapping
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		off_type base = (dir == std::ios_base::beg) ? 0 : (dir == std::ios_base::cur) ? gptr() - eback() : egptr() - eback();
+		return seekpos(pos_type(base + off), which);
+	}
+	
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		off_type off = off_type(pos);
+		if(!(which & std::ios_base::in) || off < 0 || off > egptr() - eback())
+		{
+			return pos_type(off_type(-1));
+		}
+		setg(eback(), eback() + off, egptr());
+		return pos;
+	}
+};
+
+// An input file (mapped when possible) or stdin ("-") opened as an istream
+class InputStream
+{
+public:
+	InputStream(const char* filename);
+	InputStream(const InputStream&) = delete;
+	InputStream& operator=(const InputStream&) = delete;
+
+	bool is_open() const { return m_stream != nullptr && !m_stream->fail(); }
+	bool is_mapped() const { return m_mapped.is_open(); }
+	std::istream& get() { return *m_stream; }
+
+private:
+	MappedFile m_mapped;
+	MappedStreamBuf m_mapped_buf;
+	std::istream m_mapped_stream;
+	std::ifstream m_file;
+	std::istream* m_stream;
+};
+
+// Raw frames of a fixed size read one after another from a file or stdin ("-"). Mapped files hand out
+// pointers straight into the mapping, with the next frame prefetched and the pages of the previous one released
+// so that memory use doesn't grow with the file; streams are read a frame at a time into a single reused buffer.
+class FrameSource
+{
+public:
+	FrameSource(const char* filename, unsigned int frame_bytes);
+	FrameSource(const FrameSource&) = delete;
+	FrameSource& operator=(const FrameSource&) = delete;
+
+	bool is_open() const { return m_stream != nullptr || m_mapped.is_open(); }
+	bool is_mapped() const { return m_mapped.is_open(); }
+
+	// Bytes of the next frame, valid until the next call; nullptr once there are no whole frames left
+	const BYTE_T* next_frame();
+
+	// Total size of the input when it's known up front (mapped files), 0 otherwise
+	std::size_t get_size() const { return m_mapped.get_size(); }
+
+	// Bytes left over after the last whole frame (only meaningful once next_frame has returned nullptr)
+	std::size_t get_trailing_bytes() const { return m_trailing_bytes; }
+
+private:
+	unsigned int m_frame_bytes;
+	MappedFile m_mapped;
+	std::size_t m_offset;
+	std::ifstream m_file;
+	std::istream* m_stream;
+	BYTEVEC_T m_buffer;
+	std::size_t m_trailing_bytes;
+};
+
+#endif //_INPUT_H
@@ -2,10 +2,12 @@
 #include <cassert>
 #include <iomanip>
 #include <limits>
+#include <cstring>
 #include "matrix.h"
+#include "simd.h"
 
-ByteMatrix::ByteMatrix(std::vector<BYTE_T> vec, unsigned int width, unsigned int height)
-: m_width(width), m_height(height)
+ByteMatrix::ByteMatrix(const BYTEVEC_T& vec, unsigned int width, unsigned int height)
+: m_width(width), m_height(height), m_stride(aligned_stride(width))
 {
 	if (vec.size() != m_width * m_height)
 	{
@@ -13,38 +15,82 @@ ByteMatrix::ByteMatrix(std::vector<BYTE_T> vec, unsigned int width, unsigned int
 	}
 	assert(vec.size() == m_width * m_height);
 	
-	for (auto it = vec.begin(); it != vec.end(); it += m_width)
+	m_data.resize(m_stride * m_height);
+	for (unsigned int irow = 0; irow < m_height; ++irow)
 	{
-		m_matrix.push_back(BYTEVEC_T(it, it+m_width));
+		std::memcpy((*this)[irow], &vec[irow * m_width], m_width);
 	}
-	assert(m_matrix.size() == m_height);
 }
 
-std::vector<BYTE_T> ByteMatrix::as_vec()
+ByteMatrix::ByteMatrix(BYTE_T byte, unsigned int width, unsigned int height)
+: m_data(aligned_stride(width) * height, byte), m_width(width), m_height(height), m_stride(aligned_stride(width))
 {
-	std::vector<BYTE_T> ret;
-	for (auto& r: m_matrix)
+}
+
+ByteMatrix::ByteMatrix(const ByteBlockView& view)
+: m_data(aligned_stride(view.get_width()) * view.get_height()), m_width(view.get_width()), m_height(view.get_height()), m_stride(aligned_stride(view.get_width()))
+{
+	for (unsigned int irow = 0; irow < m_height; ++irow)
+	{
+		std::memcpy((*this)[irow], view[irow], m_width);
+	}
+}
+
+void ByteMatrix::restride(unsigned int stride)
+{
+	assert(stride >= m_width && stride % BYTE_ALIGNMENT == 0);
+	ALIGNED_BYTEVEC_T data(stride * m_height);
+	for (unsigned int irow = 0; irow < m_height; ++irow)
 	{
-		ret.insert(ret.end(), r.begin(), r.end());
+		std::memcpy(&data[irow * stride], (*this)[irow], m_width);
+	}
+	m_data.swap(data);
+	m_stride = stride;
+}
+
+BYTEVEC_T ByteMatrix::as_vec() const
+{
+	BYTEVEC_T ret(m_width * m_height);
+	for (unsigned int irow = 0; irow < m_height; ++irow)
+	{
+		std::memcpy(&ret[irow * m_width], (*this)[irow], m_width);
 	}
 	return ret;
 }
 
+void ByteMatrix::write(std::ostream& out) const
+{
+	if (m_stride == m_width)
+	{
+		out.write(reinterpret_cast<const char*>(m_data.data()), m_width * m_height);
+		return;
+	}
+	for (unsigned int irow = 0; irow < m_height; ++irow)
+	{
+		out.write(reinterpret_cast<const char*>((*this)[irow]), m_width);
+	}
+}
+
 void ByteMatrix::pad_width(unsigned int n, BYTE_T pad_val)
 {
-	for (auto& r: m_matrix)
+	if (m_width + n > m_stride)
+	{
+		restride(aligned_stride(m_width + n));
+	}
+	for (unsigned int irow = 0; irow < m_height; ++irow)
 	{
-		r.insert(r.end(), n, pad_val);
+		std::memset((*this)[irow] + m_width, pad_val, n);
 	}
 	m_width += n;
 }
 
 void ByteMatrix::pad_height(unsigned int n, BYTE_T pad_val)
 {
-	for(unsigned int i = 0; i < n; ++i)
+	if (m_stride == 0)
 	{
-		m_matrix.push_back(BYTEVEC_T(m_width, pad_val));
+		m_stride = aligned_stride(m_width);
 	}
+	m_data.resize(m_stride * (m_height + n), pad_val);
 	m_height += n;
 }
 
@@ -67,18 +113,26 @@ std::vector<COORD_T> ByteMatrix::get_block_coords(unsigned int i) const
 }
 
 ByteMatrix ByteMatrix::get_block_at(COORD_T coord, unsigned int i) const
+{
+	return ByteMatrix(get_block_view_at(coord, i));
+}
+
+ByteBlockView ByteMatrix::get_block_view_at(COORD_T coord, unsigned int i) const
 {
 	assert(block_coord_is_legal(coord, i, true));
 	
-	std::vector<BYTE_T> vec;
-	for(unsigned int row = coord.first; row < coord.first + i; row++)
+	return ByteBlockView((*this)[coord.first] + coord.second, m_stride, i, i);
+}
+
+void ByteMatrix::set_block_at(COORD_T coord, const ByteMatrix& block)
+{
+	assert(block.get_width() == block.get_height());
+	assert(block_coord_is_legal(coord, block.get_width(), true));
+	
+	for(unsigned int i = 0; i < block.get_height(); ++i)
 	{
-		for(unsigned int col = coord.second; col < coord.second + i; col++)
-		{
-			vec.push_back(m_matrix[row][col]);
-		}
+		std::memcpy((*this)[coord.first + i] + coord.second, block[i], block.get_width());
 	}
-	return ByteMatrix(vec, i, i);
 }
 
 bool ByteMatrix::block_coord_is_legal(COORD_T coord, unsigned int i, bool expected_legal) const
@@ -92,13 +146,14 @@ bool ByteMatrix::block_coord_is_legal(COORD_T coord, unsigned int i, bool expect
 	return legal;
 }
 
-void ByteMatrix::print(std::ostream& out)
+void ByteMatrix::print(std::ostream& out) const
 {
-	for(auto& r : m_matrix)
+	for(unsigned int irow = 0; irow < m_height; ++irow)
 	{
-		for(auto& elem : r)
+		const BYTE_T* r = (*this)[irow];
+		for(unsigned int icol = 0; icol < m_width; ++icol)
 		{
-			out << std::setw(3) << static_cast<unsigned>(elem) << " ";
+			out << std::setw(3) << static_cast<unsigned>(r[icol]) << " ";
 		}
 		out << std::endl;
 	}
@@ -108,16 +163,18 @@ void ByteMatrix::stitch_right(const ByteMatrix& rm)
 {
 	if (m_height == 0 && m_width == 0)
 	{
-		m_matrix = rm.m_matrix;
-		m_width = rm.get_width();
-		m_height = rm.get_height();
+		*this = rm;
 	}
 	else
 	{
 		assert(rm.m_height == m_height);
+		if (m_width + rm.m_width > m_stride)
+		{
+			restride(aligned_stride(m_width + rm.m_width));
+		}
 		for(unsigned int irow = 0; irow < m_height; irow++)
 		{
-			m_matrix[irow].insert(m_matrix[irow].end(), rm.m_matrix[irow].begin(), rm.m_matrix[irow].end());
+			std::memcpy((*this)[irow] + m_width, rm[irow], rm.m_width);
 		}
 		m_width += rm.get_width();
 	}
@@ -127,14 +184,23 @@ void ByteMatrix::stitch_below(const ByteMatrix& dm)
 {
 	if (m_height == 0 && m_width == 0)
 	{
-		m_matrix = dm.m_matrix;
-		m_width = dm.get_width();
-		m_height = dm.get_height();
+		*this = dm;
 	}
 	else
 	{
 		assert(dm.m_width == m_width);
-		m_matrix.insert(m_matrix.end(), dm.m_matrix.begin(), dm.m_matrix.end());
+		if (dm.m_stride == m_stride)
+		{
+			m_data.insert(m_data.end(), dm.m_data.begin(), dm.m_data.end());
+		}
+		else
+		{
+			m_data.resize(m_stride * (m_height + dm.m_height));
+			for(unsigned int irow = 0; irow < dm.m_height; irow++)
+			{
+				std::memcpy((*this)[m_height + irow], dm[irow], m_width);
+			}
+		}
 		m_height += dm.get_height();
 	}
 }
@@ -143,13 +209,30 @@ void ByteMatrix::round_to_nearest_multiple(const BYTE_T& val)
 {
 	for(unsigned int i = 0; i < m_height; ++i)
 	{
+		BYTE_T* r = (*this)[i];
 		for(unsigned int j = 0; j < m_width; ++j)
 		{
-			short result = short(m_matrix[i][j]) + short(val)/2;
+			short result = short(r[j]) + short(val)/2;
 			result -= result % short(val);
-			m_matrix[i][j] = BYTE_T(result);
+			r[j] = BYTE_T(result);
+		}
+	}
+}
+
+ByteMatrix ByteMatrix::downsample() const
+{
+	ByteMatrix half(0x00, m_width/2, m_height/2);
+	for(unsigned int i = 0; i < half.m_height; ++i)
+	{
+		const BYTE_T* r0 = (*this)[2*i];
+		const BYTE_T* r1 = (*this)[2*i + 1];
+		BYTE_T* dst = half[i];
+		for(unsigned int j = 0; j < half.m_width; ++j)
+		{
+			dst[j] = BYTE_T(((unsigned int)r0[2*j] + r0[2*j + 1] + r1[2*j] + r1[2*j + 1] + 2) >> 2);
 		}
 	}
+	return half;
 }
 	
 ByteMatrix& ByteMatrix::operator+=(const ByteMatrix& rhs)
@@ -158,9 +241,11 @@ ByteMatrix& ByteMatrix::operator+=(const ByteMatrix& rhs)
 	assert(rhs.m_width == m_width);
 	for(unsigned int irow = 0; irow < m_height; irow++)
 	{
+		BYTE_T* dst = (*this)[irow];
+		const BYTE_T* src = rhs[irow];
 		for(unsigned int icol = 0; icol < m_width; icol++)
 		{
-			m_matrix[irow][icol] += rhs.m_matrix[irow][icol];
+			dst[icol] += src[icol];
 		}
 	}
 	return (*this);
@@ -172,28 +257,44 @@ ByteMatrix& ByteMatrix::operator-=(const ByteMatrix& rhs)
 	assert(rhs.m_width == m_width);
 	for(unsigned int irow = 0; irow < m_height; irow++)
 	{
+		BYTE_T* dst = (*this)[irow];
+		const BYTE_T* src = rhs[irow];
 		for(unsigned int icol = 0; icol < m_width; icol++)
 		{
-			m_matrix[irow][icol] -= rhs.m_matrix[irow][icol];
+			dst[icol] -= src[icol];
 		}
 	}
 	return (*this);
 }
 
-unsigned int ByteMatrix::sum() const
+unsigned int ByteBlockView::sum() const
 {
 	unsigned int total;
 	total = 0;
-	for(auto& row : m_matrix)
+	for(unsigned int i = 0; i < m_height; ++i)
 	{
-		for(auto& elem : row)
+		const BYTE_T* r = (*this)[i];
+		for(unsigned int j = 0; j < m_width; ++j)
 		{
-			total += static_cast<unsigned int>(elem);
+			total += static_cast<unsigned int>(r[j]);
 		}
 	}
 	return total;
 }
 
+unsigned int ByteBlockView::SAD(const ByteBlockView& rhs, unsigned int bound) const
+{
+	assert(m_height == rhs.m_height);
+	assert(m_width == rhs.m_width);
+	
+	return SIMD::sad(m_data, m_stride, rhs.m_data, rhs.m_stride, m_width, m_height, bound);
+}
+
+unsigned int ByteMatrix::sum() const
+{
+	return ByteBlockView(*this).sum();
+}
+
 BYTE_T ByteMatrix::average() const
 {
 	return static_cast<BYTE_T>( sum() / (m_width*m_height) );
@@ -207,13 +308,15 @@ unsigned int ByteMatrix::SAD_within_x(const BYTE_T& b, const BYTE_T& x) const
 	int min = int(b)-int(x);
 	
 	unsigned int c = 0;
-	for(auto& r : m_matrix)
+	for(unsigned int i = 0; i < m_height; ++i)
 	{
-		for(auto& e : r)
+		const BYTE_T* r = (*this)[i];
+		for(unsigned int j = 0; j < m_width; ++j)
 		{
-			if(int(e) <= max && int(e) >= min)
+			int e = int(r[j]);
+			if(e <= max && e >= min)
 			{
-				c += abs(int(e) - int(b));
+				c += abs(e - int(b));
 			}
 			else
 			{
@@ -235,9 +338,11 @@ double ByteMatrix::covariance(const ByteMatrix& rhs) const
 	double ret = 0;
 	for(unsigned int i = 0; i < m_height; ++i)
 	{
+		const BYTE_T* a = (*this)[i];
+		const BYTE_T* b = rhs[i];
 		for(unsigned int j = 0; j < m_width; ++j)
 		{
-			ret += (double(m_matrix[i][j]) - my_average)*(double(rhs.m_matrix[i][j]) - rhs_average);
+			ret += (double(a[j]) - my_average)*(double(b[j]) - rhs_average);
 		}
 	}
 	return ret / double(m_height*m_width);
@@ -270,14 +375,19 @@ double ByteMatrix::MSE(const ByteMatrix& rhs) const
 	assert(m_height == rhs.m_height);
 	assert(m_width == rhs.m_width);
 	
+	// Squared differences of bytes fit comfortably in an integer accumulator per row
 	double ret = 0;
 	for(unsigned int i = 0; i < m_height; ++i)
 	{
+		const BYTE_T* a = (*this)[i];
+		const BYTE_T* b = rhs[i];
+		unsigned int row_total = 0;
 		for(unsigned int j = 0; j < m_width; ++j)
 		{
-			double diff = double(m_matrix[i][j]) - double(rhs.m_matrix[i][j]);
-			ret += diff*diff;
+			int diff = int(a[j]) - int(b[j]);
+			row_total += diff*diff;
 		}
+		ret += double(row_total);
 	}
 	return ret / double(m_height*m_width);
 }
@@ -294,18 +404,7 @@ double ByteMatrix::PSNR(const ByteMatrix& rhs) const
 
 unsigned int ByteMatrix::SAD(const ByteMatrix& rhs) const
 {
-	assert(m_height == rhs.m_height);
-	assert(m_width == rhs.m_width);
-	
-	unsigned int ret = 0;
-	for(unsigned int i = 0; i < m_height; ++i)
-	{
-		for(unsigned int j = 0; j < m_width; ++j)
-		{
-			ret += abs( int(m_matrix[i][j]) - int(rhs.m_matrix[i][j]) );
-		}
-	}
-	return ret;
+	return ByteBlockView(*this).SAD(rhs);
 }
 
 ByteMatrix ByteMatrix::generate_intra_mode_refblock(BYTE_T intra_mode)
@@ -317,11 +416,11 @@ ByteMatrix ByteMatrix::generate_intra_mode_refblock(BYTE_T intra_mode)
 	{
 		if(intra_mode == INTRA_MODE_ABOVE)
 		{
-			ret.m_matrix[i] = m_matrix[m_height-1];
+			std::memcpy(ret[i], (*this)[m_height-1], m_width);
 		}
 		else
 		{
-			ret.m_matrix[i] = BYTEVEC_T(m_width, m_matrix[i].back());
+			std::memset(ret[i], (*this)[i][m_width-1], m_width);
 		}
 	}
 	return ret;
@@ -330,11 +429,10 @@ ByteMatrix ByteMatrix::generate_intra_mode_refblock(BYTE_T intra_mode)
 ByteMatrix ByteMatrix::generate_border_block(BYTE_T core_byte, BYTE_T border_byte, unsigned int width, unsigned int height)
 {
 	ByteMatrix m(core_byte, width, height);
-	for(auto& r : m.m_matrix)
+	for(unsigned int i = 0; i < height; ++i)
 	{
-		auto it = r.end() -1;
-		(*it) = border_byte;
+		m[i][width-1] = border_byte;
 	}
-	m.m_matrix.back() = BYTEVEC_T(width, border_byte);
+	std::memset(m[height-1], border_byte, width);
 	return m;
-}
\ No newline at end of file
+}
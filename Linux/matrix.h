@@ -1,4 +1,5 @@
 #include "util.h"
+#include "simd.h"
 #include <iostream>
 
 #ifndef _MATRIX_H
@@ -7,12 +8,44 @@
 const int INTRA_MODE_ABOVE = 0;
 const int INTRA_MODE_LEFT = 1;
 
+class ByteMatrix;
+
+/* Non-owning window onto a block of pixels (pointer + stride + size). Only valid for as long as
+ * the ByteMatrix it was taken from is alive and unmodified; used to score and code candidate blocks
+ * without copying them out of their frame */
+class ByteBlockView
+{
+public:
+	ByteBlockView() : m_data(nullptr), m_stride(0), m_width(0), m_height(0) {};
+	ByteBlockView(const BYTE_T* data, unsigned int stride, unsigned int width, unsigned int height)
+	: m_data(data), m_stride(stride), m_width(width), m_height(height) {};
+	ByteBlockView(const ByteMatrix& matrix);
+	
+	unsigned int get_size()		const { return get_width()*get_height(); }
+	unsigned int get_width() 	const { return m_width; }
+	unsigned int get_height() 	const { return m_height; }
+	unsigned int get_stride() 	const { return m_stride; }
+	
+	const BYTE_T* operator[](const unsigned int i) const { return m_data + i*m_stride; }
+	
+	unsigned int sum() const;
+	// See SIMD::sad for what a bound does
+	unsigned int SAD(const ByteBlockView& rhs, unsigned int bound = SIMD::SAD_NO_BOUND) const;
+	
+private:
+	const BYTE_T* m_data;
+	unsigned int m_stride;
+	unsigned int m_width;
+	unsigned int m_height;
+};
+
 class ByteMatrix
 {
 public:
-	ByteMatrix() : m_width(0), m_height(0) {};
-	ByteMatrix(BYTEVEC_T vec, unsigned int width, unsigned int height);
-	ByteMatrix(BYTE_T byte, unsigned int width, unsigned int height) : ByteMatrix(BYTEVEC_T(width*height, byte), width, height) {};
+	ByteMatrix() : m_width(0), m_height(0), m_stride(0) {};
+	ByteMatrix(const BYTEVEC_T& vec, unsigned int width, unsigned int height);
+	ByteMatrix(BYTE_T byte, unsigned int width, unsigned int height);
+	explicit ByteMatrix(const ByteBlockView& view);
 	
 	void pad_width(unsigned int n, BYTE_T pad_val);
 	void pad_height(unsigned int n, BYTE_T pad_val);
@@ -20,18 +53,25 @@ public:
 	unsigned int get_size()		const { return get_width()*get_height(); }
 	unsigned int get_width() 	const { return m_width; }
 	unsigned int get_height() 	const { return m_height; }
+	unsigned int get_stride() 	const { return m_stride; }
 	
-	BYTEVEC_T as_vec();
+	BYTEVEC_T as_vec() const;
+	void write(std::ostream& out) const;
 	
 	std::vector< COORD_T > get_block_coords(unsigned int i) const;
 	ByteMatrix get_block_at(COORD_T coord, unsigned int i) const;
+	ByteBlockView get_block_view_at(COORD_T coord, unsigned int i) const;
+	void set_block_at(COORD_T coord, const ByteMatrix& block);
 	bool block_coord_is_legal(COORD_T coord, unsigned int i, bool expected_legal=false) const;
 	
 	void stitch_right(const ByteMatrix& rm);
 	void stitch_below(const ByteMatrix& dm);
 	void round_to_nearest_multiple(const BYTE_T& val);
 	
-	void print(std::ostream& out);
+	// Half the width and height, each pixel the rounded average of a 2x2 square (an odd last row/column is dropped)
+	ByteMatrix downsample() const;
+	
+	void print(std::ostream& out) const;
 	
 	unsigned int sum() const;
 	BYTE_T average() const;
@@ -45,7 +85,9 @@ public:
 	double MSE(const ByteMatrix& rhs) const;
 	double PSNR(const ByteMatrix& rhs) const;
 
-	const BYTEVEC_T& operator[](const unsigned int i) const { return m_matrix[i]; }
+	// Rows are laid out back to back in one buffer, m_stride bytes apart
+	const BYTE_T* operator[](const unsigned int i) const { return &m_data[i*m_stride]; }
+	BYTE_T* operator[](const unsigned int i) { return &m_data[i*m_stride]; }
 	ByteMatrix& operator+=(const ByteMatrix& rhs);
 	friend ByteMatrix operator+(ByteMatrix lhs, const ByteMatrix& rhs) { lhs += rhs; return lhs; }
 	ByteMatrix& operator-=(const ByteMatrix& rhs);
@@ -53,14 +95,26 @@ public:
 	
 	ByteMatrix generate_intra_mode_refblock(BYTE_T intra_mode);
 	static ByteMatrix generate_border_block(BYTE_T core_byte, BYTE_T border_byte, unsigned int width, unsigned int height);
-	//Juan
-	std::vector< BYTEVEC_T > m_matrix;
+
 private:
+	// Round a row width up so that every row starts on an aligned boundary
+	static unsigned int aligned_stride(unsigned int width) { return (width + BYTE_ALIGNMENT - 1) & ~(unsigned int)(BYTE_ALIGNMENT - 1); }
+	
+	// Re-lay the existing rows out with a new stride, keeping their contents
+	void restride(unsigned int stride);
+	
+	ALIGNED_BYTEVEC_T m_data;
 	unsigned int m_width;
 	unsigned int m_height;
+	unsigned int m_stride;
 
 };
 
+inline ByteBlockView::ByteBlockView(const ByteMatrix& matrix)
+: m_data(matrix.get_height() > 0 ? matrix[0] : nullptr), m_stride(matrix.get_stride()), m_width(matrix.get_width()), m_height(matrix.get_height())
+{
+}
+
 typedef std::pair<COORD_T, ByteMatrix> BLOCK_T;
 typedef std::vector<BLOCK_T> BLOCKVEC_T;
 
@@ -0,0 +1,257 @@
+#include "packet.h"
+#include "golomb.h"
+#include <cstring>
+#include <algorithm>
+
+static const char PACKET_MAGIC[4] = { 'E', 'C', 'E', 'V' };
+static const char PACKET_VERSION = 1;
+static const unsigned int FILE_HEADER_BYTES = sizeof(PACKET_MAGIC) + 1;
+static const unsigned int PACKET_HEADER_BYTES = 1 + 4 + 4;
+// Residuals take at most about 4 bytes per pixel (a 31-bit Exp-Golomb code for the largest coefficient at qp 0)
+static const unsigned int PACKET_MAX_BYTES_PER_PIXEL = 8;
+
+static void l_put_u32(char* out, std::uint32_t v)
+{
+	for(unsigned int i = 0; i < 4; ++i)
+	{
+		out[i] = char((v >> (8*i)) & 0xFF);
+	}
+}
+
+static std::uint32_t l_get_u32(const char* in)
+{
+	std::uint32_t v = 0;
+	for(unsigned int i = 0; i < 4; ++i)
+	{
+		v |= std::uint32_t(BYTE_T(in[i])) << (8*i);
+	}
+	return v;
+}
+
+void PACKET::write_file_header(std::ostream& out)
+{
+	out.write(PACKET_MAGIC, sizeof(PACKET_MAGIC));
+	out.put(PACKET_VERSION);
+}
+
+unsigned int PACKET::write(std::ostream& out, char frame_type, const std::string& mvs_payload, const std::string& res_payload)
+{
+	char header[PACKET_HEADER_BYTES];
+	header[0] = frame_type;
+	l_put_u32(header + 1, (std::uint32_t)mvs_payload.size());
+	l_put_u32(header + 5, (std::uint32_t)res_payload.size());
+	out.write(header, PACKET_HEADER_BYTES);
+	out.write(mvs_payload.data(), mvs_payload.size());
+	out.write(res_payload.data(), res_payload.size());
+	return PACKET_HEADER_BYTES + mvs_payload.size() + res_payload.size();
+}
+
+std::uint64_t PACKET::max_payload_bytes(unsigned int frame_width, unsigned int frame_height)
+{
+	// The slack covers the mode/mv bytes of frames only a block or two in size
+	return std::uint64_t(PACKET_MAX_BYTES_PER_PIXEL) * frame_width * frame_height + 4096;
+}
+
+PacketReader::PacketReader(const char* filename, std::uint64_t max_payload_bytes) :
+m_open(false), m_stream(nullptr), m_offset(0), m_max_payload_bytes(max_payload_bytes), m_mvs(&m_mvs_buf), m_res(&m_res_buf)
+{
+	if(std::strcmp(filename, "-") == 0)
+	{
+		m_stream = &std::cin;
+	}
+	else if(!m_mapped.open(filename))
+	{
+		m_file.open(filename, std::ifstream::binary);
+		if(m_file.is_open())
+		{
+			m_stream = &m_file;
+		}
+		else
+		{
+			std::cout << "Could not open file " << filename << std::endl;
+			return;
+		}
+	}
+	
+	char header[FILE_HEADER_BYTES];
+	if(m_mapped.is_open())
+	{
+		if(m_mapped.get_size() < FILE_HEADER_BYTES)
+		{
+			std::cout << "ERROR: " << filename << " is too short to hold any packets" << std::endl;
+			return;
+		}
+		std::memcpy(header, m_mapped.get_data(), FILE_HEADER_BYTES);
+	}
+	else
+	{
+		m_stream->read(header, FILE_HEADER_BYTES);
+		if(m_stream->gcount() != FILE_HEADER_BYTES)
+		{
+			std::cout << "ERROR: " << filename << " is too short to hold any packets" << std::endl;
+			return;
+		}
+	}
+	
+	if(std::memcmp(header, PACKET_MAGIC, sizeof(PACKET_MAGIC)) != 0 || header[sizeof(PACKET_MAGIC)] != PACKET_VERSION)
+	{
+		std::cout << "ERROR: " << filename << " is not a packet file this decoder can read" << std::endl;
+		return;
+	}
+	m_offset = FILE_HEADER_BYTES;
+	m_open = true;
+}
+
+PacketReader::~PacketReader()
+{
+	release_payloads();
+}
+
+void PacketReader::release_payloads()
+{
+	// The entropy decoder keeps its own reader per stream, which has to start over with every packet
+	GOLOMB::release_stream(m_mvs);
+	GOLOMB::release_stream(m_res);
+	m_mvs.clear();
+	m_res.clear();
+}
+
+bool PacketReader::read_header(char& frame_type, std::uint32_t& mvs_bytes, std::uint32_t& res_bytes, std::uint64_t& payload_bytes)
+{
+	if(!m_open)
+	{
+		return false;
+	}
+	
+	char header[PACKET_HEADER_BYTES];
+	if(m_mapped.is_open())
+	{
+		if(m_offset == m_mapped.get_size())
+		{
+			return false;
+		}
+		if(m_offset + PACKET_HEADER_BYTES > m_mapped.get_size())
+		{
+			std::cout << "ERROR: Truncated packet header at byte " << m_offset << std::endl;
+			return false;
+		}
+		std::memcpy(header, m_mapped.get_data() + m_offset, PACKET_HEADER_BYTES);
+	}
+	else
+	{
+		m_stream->read(header, PACKET_HEADER_BYTES);
+		std::size_t num_read = (std::size_t)m_stream->gcount();
+		if(num_read != PACKET_HEADER_BYTES)
+		{
+			if(num_read != 0)
+			{
+				std::cout << "ERROR: Truncated packet header at byte " << m_offset << std::endl;
+			}
+			return false;
+		}
+	}
+	
+	frame_type = header[0];
+	mvs_bytes = l_get_u32(header + 1);
+	res_bytes = l_get_u32(header + 5);
+	payload_bytes = std::uint64_t(mvs_bytes) + res_bytes;
+	m_offset += PACKET_HEADER_BYTES;
+	
+	if(payload_bytes > m_max_payload_bytes)
+	{
+		std::cout << "ERROR: Packet at byte " << m_offset - PACKET_HEADER_BYTES << " claims " << payload_bytes
+			<< " bytes, more than a frame can take" << std::endl;
+		return false;
+	}
+	if(m_mapped.is_open() && m_offset + payload_bytes > m_mapped.get_size())
+	{
+		std::cout << "ERROR: Truncated packet at byte " << m_offset - PACKET_HEADER_BYTES << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool PacketReader::next(char& frame_type)
+{
+	release_payloads();
+	
+	std::uint32_t mvs_bytes, res_bytes;
+	std::uint64_t payload_bytes;
+	if(!read_header(frame_type, mvs_bytes, res_bytes, payload_bytes))
+	{
+		return false;
+	}
+	
+	const BYTE_T* payload;
+	if(m_mapped.is_open())
+	{
+		payload = m_mapped.get_data() + m_offset;
+	}
+	else
+	{
+		m_payload.resize(std::max<std::size_t>(std::size_t(payload_bytes), 1));
+		m_stream->read(reinterpret_cast<char*>(&m_payload[0]), std::streamsize(payload_bytes));
+		if((std::uint64_t)m_stream->gcount() != payload_bytes)
+		{
+			std::cout << "ERROR: Truncated packet at byte " << m_offset - PACKET_HEADER_BYTES << std::endl;
+			return false;
+		}
+		payload = &m_payload[0];
+	}
+	m_offset += payload_bytes;
+	
+	m_mvs_buf.reset(payload, mvs_bytes);
+	m_res_buf.reset(payload + mvs_bytes, res_bytes);
+	return true;
+}
+
+bool PacketReader::skip(char& frame_type)
+{
+	release_payloads();
+	
+	std::uint32_t mvs_bytes, res_bytes;
+	std::uint64_t payload_bytes;
+	if(!read_header(frame_type, mvs_bytes, res_bytes, payload_bytes))
+	{
+		return false;
+	}
+	
+	if(!m_mapped.is_open())
+	{
+		m_stream->ignore(std::streamsize(payload_bytes));
+		if((std::uint64_t)m_stream->gcount() != payload_bytes)
+		{
+			std::cout << "ERROR: Truncated packet at byte " << m_offset - PACKET_HEADER_BYTES << std::endl;
+			return false;
+		}
+	}
+	m_offset += payload_bytes;
+	return true;
+}
+
+bool PacketReader::seek(std::uint64_t offset)
+{
+	release_payloads();
+	if(!can_seek() || offset < FILE_HEADER_BYTES)
+	{
+		return false;
+	}
+	
+	if(!m_mapped.is_open())
+	{
+		m_file.clear();
+		m_file.seekg(offset);
+		if(m_file.fail())
+		{
+			m_file.clear();
+			m_file.seekg(m_offset);
+			return false;
+		}
+	}
+	else if(offset > m_mapped.get_size())
+	{
+		return false;
+	}
+	m_offset = offset;
+	return true;
+}
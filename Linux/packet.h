@@ -0,0 +1,73 @@
+#include "util.h"
+#include "input.h"
+#include <iostream>
+#include <string>
+
+#ifndef _PACKET_H
+#define _PACKET_H
+
+// Single-file alternative to the mvs.db/res.db pair: a file header followed by one packet per frame
+//   file:   "ECEV" <version byte>
+//   packet: <frame type byte> <mode/mv bytes, u32 LE> <residual bytes, u32 LE> <mode/mv payload> <residual payload>
+// The payloads are exactly what would have gone to each of the two streams, minus mvs.db's frame type byte.
+// Packets are self-delimiting, so the file can be written and read front to back through a pipe or socket,
+// and a reader can step over frames by their headers alone.
+namespace PACKET
+{
+	void write_file_header(std::ostream& out);
+	
+	// Returns the number of bytes written, header included
+	unsigned int write(std::ostream& out, char frame_type, const std::string& mvs_payload, const std::string& res_payload);
+	
+	// Largest packet a reader accepts for frames of the given (padded) size: a few frames' worth of bytes, well past
+	// what the coder writes even at qp 0, so a corrupt header can't make it buffer or skip an arbitrary amount
+	std::uint64_t max_payload_bytes(unsigned int frame_width, unsigned int frame_height);
+}
+
+// Reads packets from a file (mapped when possible) or stdin ("-"). Payloads of mapped files are handed to the
+// entropy decoder in place; otherwise each packet is read into a buffer first.
+class PacketReader
+{
+public:
+	PacketReader(const char* filename, std::uint64_t max_payload_bytes);
+	PacketReader(const PacketReader&) = delete;
+	PacketReader& operator=(const PacketReader&) = delete;
+	~PacketReader();
+	
+	bool is_open() const { return m_open; }
+	
+	// Move on to the next packet, whose payloads can then be read through mvs() and res() until the following call.
+	// Returns false once there are no packets left.
+	bool next(char& frame_type);
+	
+	// Move past the next packet without reading its payloads
+	bool skip(char& frame_type);
+	
+	std::istream& mvs() { return m_mvs; }
+	std::istream& res() { return m_res; }
+	
+	// Offset of the next packet, and going back to one returned earlier; only files (not stdin) can seek
+	bool can_seek() const { return m_open && (m_mapped.is_open() || m_stream == &m_file); }
+	std::uint64_t tell() const { return m_offset; }
+	bool seek(std::uint64_t offset);
+	
+private:
+	// payload_bytes is mvs_bytes + res_bytes, already checked against the file size and m_max_payload_bytes
+	bool read_header(char& frame_type, std::uint32_t& mvs_bytes, std::uint32_t& res_bytes, std::uint64_t& payload_bytes);
+	void release_payloads();
+	
+	bool m_open;
+	MappedFile m_mapped;
+	std::ifstream m_file;
+	std::istream* m_stream;
+	std::uint64_t m_offset;
+	std::uint64_t m_max_payload_bytes;
+	
+	BYTEVEC_T m_payload;
+	MappedStreamBuf m_mvs_buf;
+	MappedStreamBuf m_res_buf;
+	std::istream m_mvs;
+	std::istream m_res;
+};
+
+#endif // _PACKET_H
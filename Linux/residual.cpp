@@ -9,226 +9,375 @@
 #include <map>
 #include <limits>
 #include <sstream>
+#include <mutex>
 
-const COEF_T PI = atan(1.0) * 4.0;
+const double PI = atan(1.0) * 4.0;
 	
 const bool DISABLE_TRANSFORM = false;
 const bool DISABLE_QUANTIZATION = false;
 const bool ENABLE_COMPLEX_RDO_ESTIMATE = false;
 
-std::pair<COEF_MATRIX_T, COEF_MATRIX_T> l_initialize_dct_coeffs(unsigned int N)
+// Largest block size the integer transform has tables for
+const unsigned int DCT_MAX_N = 64;
+// Precision of the integer basis; with 64-bit sums the transform's own error stays far below the rounding of a pixel
+const int DCT_BASIS_BITS = 20;
+// Coefficients are those of the orthonormal DCT times 2^DCT_COEF_FRAC_BITS, and the quantization steps are scaled to
+// match. Only quantization rounds a coefficient to whole units, so without it a round trip gives the input back.
+const int DCT_COEF_FRAC_BITS = 8;
+
+// Sums of the 1-D passes
+typedef std::int64_t DCT_SUM_T;
+
+// Integer approximation of the orthonormal DCT-II basis, M = round(2^DCT_BASIS_BITS*sqrt(N)*C), stored row-major.
+// Even rows of the N-point basis are copied from the N/2-point one and the remaining half of each row is
+// mirrored, so the even/odd symmetries the butterflies rely on hold exactly rather than up to rounding.
+struct l_DctTable
 {
-	static std::map< unsigned int, std::pair<COEF_MATRIX_T, COEF_MATRIX_T> > precomputed_values;
-	
-	auto p = precomputed_values.find(N);
-	if (p == precomputed_values.end())
+	unsigned int N;
+	int log2N; // -1 when N isn't a power of two
+	std::vector<int> M;
+};
+
+static std::vector<l_DctTable> l_build_dct_tables()
+{
+	std::vector<l_DctTable> tables(DCT_MAX_N + 1);
+	for(unsigned int N = 1; N <= DCT_MAX_N; ++N)
 	{
-		COEF_MATRIX_T C( N, std::vector<COEF_T>(N) );
-		COEF_MATRIX_T Ct( N, std::vector<COEF_T>(N) );
-		unsigned int i,j;
-		
-		for(j=0; j < N; ++j) {
-			C[0][j] = 1.0 / sqrt( (COEF_T)N );
-			Ct[j][0] = C[0][j];
+		l_DctTable& t = tables[N];
+		t.N = N;
+		t.log2N = -1;
+		for(int l = 0; (1u << l) <= N; ++l)
+		{
+			if((1u << l) == N)
+				t.log2N = l;
 		}
+		t.M.assign(N*N, 0);
 		
-		for(i=1; i<N; ++i)	{
-			for(j=0; j<N; j++) {
-				C[i][j] = sqrt( 2.0 / (COEF_T)N) * cos ( PI * (2*j + 1) * i / (2.0 * (COEF_T)N) );
-				Ct[j][i] = C[i][j];
+		for(unsigned int k = 0; k < N; ++k)
+		{
+			for(unsigned int n = 0; n < N; ++n)
+			{
+				int& m = t.M[k*N + n];
+				if(N % 2 == 0 && n >= N/2)
+				{
+					m = (k % 2 == 0) ? t.M[k*N + (N-1-n)] : -t.M[k*N + (N-1-n)];
+				}
+				else if(N % 2 == 0 && k % 2 == 0)
+				{
+					m = tables[N/2].M[(k/2)*(N/2) + n];
+				}
+				else if(k == 0)
+				{
+					m = 1 << DCT_BASIS_BITS;
+				}
+				else
+				{
+					m = (int)lround( double(1 << DCT_BASIS_BITS) * sqrt(2.0) * cos( PI * (2*n + 1) * k / (2.0 * N) ) );
+				}
+			}
+		}
+	}
+	return tables;
+}
+
+static const l_DctTable& l_dct_table(unsigned int N)
+{
+	// Built once, on first use; initialization of function statics is thread-safe
+	static const std::vector<l_DctTable> tables = l_build_dct_tables();
+	assert(N > 0 && N <= DCT_MAX_N);
+	return tables[N];
+}
+
+// Divide by 2^shift (or by div when the block size isn't a power of two), rounding to nearest
+static inline DCT_SUM_T l_descale(DCT_SUM_T v, int shift, DCT_SUM_T div)
+{
+	if(shift >= 0)
+	{
+		return shift == 0 ? v : (v + (DCT_SUM_T(1) << (shift - 1))) >> shift;
+	}
+	// Same floor semantics as the arithmetic shift
+	DCT_SUM_T t = v + div/2;
+	DCT_SUM_T q = t / div;
+	return (t % div != 0 && t < 0) ? q - 1 : q;
+}
+
+// out[k*out_stride] = sum_n M[k][n]*in[n], exactly. Even sizes are split into even and odd halves:
+// the even outputs are the N/2-point transform of in[n]+in[N-1-n], the odd ones only need N/2 taps.
+static void l_forward_1d(const DCT_SUM_T* in, DCT_SUM_T* out, unsigned int out_stride, unsigned int N)
+{
+	const int* M = &l_dct_table(N).M[0];
+	if(N % 2 != 0)
+	{
+		for(unsigned int k = 0; k < N; ++k)
+		{
+			DCT_SUM_T acc = 0;
+			for(unsigned int n = 0; n < N; ++n)
+			{
+				acc += M[k*N + n] * in[n];
 			}
+			out[k*out_stride] = acc;
 		}
-		precomputed_values[N] = std::make_pair(C, Ct);
-		p = precomputed_values.find(N);
+		return;
 	}
 	
-	assert(p != precomputed_values.end());
-	return p->second;
+	const unsigned int H = N/2;
+	DCT_SUM_T even[DCT_MAX_N/2], odd[DCT_MAX_N/2];
+	for(unsigned int n = 0; n < H; ++n)
+	{
+		even[n] = in[n] + in[N-1-n];
+		odd[n] = in[n] - in[N-1-n];
+	}
+	l_forward_1d(even, out, 2*out_stride, H);
+	for(unsigned int k = 1; k < N; k += 2)
+	{
+		DCT_SUM_T acc = 0;
+		for(unsigned int n = 0; n < H; ++n)
+		{
+			acc += M[k*N + n] * odd[n];
+		}
+		out[k*out_stride] = acc;
+	}
 }
 
+// out[n] = sum_k M[k][n]*in[k*in_stride], exactly; the mirror image of l_forward_1d
+static void l_inverse_1d(const DCT_SUM_T* in, unsigned int in_stride, DCT_SUM_T* out, unsigned int N)
+{
+	const int* M = &l_dct_table(N).M[0];
+	if(N % 2 != 0)
+	{
+		for(unsigned int n = 0; n < N; ++n)
+		{
+			DCT_SUM_T acc = 0;
+			for(unsigned int k = 0; k < N; ++k)
+			{
+				acc += M[k*N + n] * in[k*in_stride];
+			}
+			out[n] = acc;
+		}
+		return;
+	}
+	
+	const unsigned int H = N/2;
+	DCT_SUM_T even[DCT_MAX_N/2];
+	l_inverse_1d(in, 2*in_stride, even, H);
+	for(unsigned int n = 0; n < H; ++n)
+	{
+		DCT_SUM_T odd = 0;
+		for(unsigned int k = 1; k < N; k += 2)
+		{
+			odd += M[k*N + n] * in[k*in_stride];
+		}
+		out[n] = even[n] + odd;
+		out[N-1-n] = even[n] - odd;
+	}
+}
+
+// Both directions scale by (2^20*sqrt(N))^2 = 2^(40+log2(N)) overall. The row sums are at most 255*64*1.5*2^20 < 2^35;
+// the first pass drops 8 bits of that, keeping 12 fractional bits, and the column sums then stay under 2^54 for any
+// block size up to DCT_MAX_N. Coefficients come out within a few thousandths of the exact ones.
 COEF_MATRIX_T DCT::matrix_to_coefs(const ByteMatrix& matrix)
 {
 	assert(matrix.get_height() == matrix.get_width());
 	unsigned int N = matrix.get_height();
 	assert(N % 2 == 0);
-	COEF_MATRIX_T ret( N, std::vector<COEF_T>(N) );
-	unsigned int i, j, k;
+	COEF_MATRIX_T ret(N*N);
+	unsigned int i, j;
 	
 	if (DISABLE_TRANSFORM)
 	{
 		for(i = 0; i < N; ++i){
 			for(j = 0; j < N; ++j) {
-				ret[i][j] = (COEF_T)matrix[i][j];
+				ret[i*N + j] = (COEF_T)matrix[i][j] << DCT_COEF_FRAC_BITS;
 			}
 		}
 	}
 	else
 	{
-		COEF_MATRIX_T temp( N, std::vector<COEF_T>(N) );
-		COEF_MATRIX_T C, Ct;
-		std::tie(C, Ct) = l_initialize_dct_coeffs(N);
+		assert(N <= DCT_MAX_N);
+		const l_DctTable& t = l_dct_table(N);
+		const int shift1 = 8;
+		const int shift2_base = 2*DCT_BASIS_BITS - shift1 - DCT_COEF_FRAC_BITS;
+		const int shift2 = (t.log2N >= 0) ? t.log2N + shift2_base : -1;
 		
-		// transform the rows
+		DCT_SUM_T row[DCT_MAX_N], coefs[DCT_MAX_N];
+		DCT_SUM_T temp[DCT_MAX_N * DCT_MAX_N];
+		
+		// transform the rows, storing the result transposed so the second pass works on contiguous data
 		for(i = 0; i < N; ++i) {
+			const BYTE_T* m = matrix[i];
 			for(j = 0; j < N; ++j) {
-				temp[i][j] = 0.0;
-				for(k = 0; k < N; ++k)
-				{
-					temp[i][j] += ( (COEF_T)matrix[i][k] ) * Ct[k][j];
-				}
+				row[j] = m[j];
 			}
+			l_forward_1d(row, &temp[i], N, N);
+		}
+		for(i = 0; i < N*N; ++i) {
+			temp[i] = l_descale(temp[i], shift1, DCT_SUM_T(1) << shift1);
 		}
 		
 		// transform the columns
-		COEF_T temp_v;
-		for(i=0; i < N; ++i) {
-			for(j=0; j < N; ++j) {
-				temp_v = 0.0;
-				for(k=0; k < N; ++k) {
-					temp_v += C[i][k] * temp[k][j];
-				}
-				ret[i][j] = temp_v;
+		for(j = 0; j < N; ++j) {
+			l_forward_1d(&temp[j*N], coefs, 1, N);
+			for(i = 0; i < N; ++i) {
+				ret[i*N + j] = (COEF_T)l_descale(coefs[i], shift2, DCT_SUM_T(N) << shift2_base);
 			}
 		}
 	}
 	return ret;
 }
 
+// Quantization steps of an NxN block at one qp, row-major: 2^qp above the anti-diagonal, 2^(qp+1) on it and
+// 2^(qp+2) below it, in units of the orthonormal coefficients (so times 2^DCT_COEF_FRAC_BITS here). The steps are
+// powers of two, so their reciprocals are exact in a float.
+struct l_QuantTable
+{
+	std::once_flag built;
+	std::vector<COEF_T> steps;
+	std::vector<float> recips;
+};
+
+// Steps are capped at 2^QUANT_MAX_STEP_BITS, which is already over twice the largest coefficient, so every
+// coefficient quantizes to 0 from QUANT_MAX_QP on and larger qps share its table
+const unsigned int QUANT_MAX_STEP_BITS = 30;
+const unsigned int QUANT_MAX_QP = QUANT_MAX_STEP_BITS - DCT_COEF_FRAC_BITS;
+
+static const l_QuantTable& l_quant_table(unsigned int N, unsigned int qp)
+{
+	// One slot per block size and qp, each filled in the first time it comes up. Once a slot is built, looking it up
+	// takes no lock, which matters as every block (and every candidate for rdo_estimation=2) goes through here.
+	static l_QuantTable tables[DCT_MAX_N + 1][QUANT_MAX_QP + 1];
+	assert(N > 0 && N <= DCT_MAX_N);
+	qp = std::min(qp, QUANT_MAX_QP);
+	
+	l_QuantTable& t = tables[N][qp];
+	std::call_once(t.built, [&t, N, qp]()
+	{
+		t.steps.resize(N*N);
+		t.recips.resize(N*N);
+		for(unsigned int i = 0; i < N; ++i)
+		{
+			for(unsigned int j = 0; j < N; ++j)
+			{
+				unsigned int band = (i+j < N-1) ? 0 : (i+j == N-1) ? 1 : 2;
+				unsigned int bits = std::min(qp + band + DCT_COEF_FRAC_BITS, QUANT_MAX_STEP_BITS);
+				t.steps[i*N + j] = static_cast<COEF_T>(1 << bits);
+				t.recips[i*N + j] = 1.0f / float(t.steps[i*N + j]);
+			}
+		}
+	});
+	return t;
+}
+
 QCOEF_MATRIX_T DCT::quantize_coefs(const COEF_MATRIX_T& coefs, unsigned int qp)
 {
-	assert(coefs.size() == coefs[0].size());
-	unsigned int N = coefs.size();
+	unsigned int N = coefs_block_size(coefs);
 	assert(N % 2 == 0);
 
-	QCOEF_MATRIX_T ret( N, std::vector<QCOEF_T>(N) );
+	QCOEF_MATRIX_T ret(N*N);
 	
-	unsigned int i, j;
 	if(DISABLE_QUANTIZATION) {
-		for(i = 0; i < N; ++i) {
-			for(j = 0; j < N; ++j) {
-				ret[i][j] = coefs[i][j];
-			}
-		}
+		ret.assign(coefs.begin(), coefs.end());
 	} else {
-		std::vector<COEF_T> quantization_values = { static_cast<COEF_T>(1 << qp), static_cast<COEF_T>(1 << (qp+1)), static_cast<COEF_T>(1 << (qp+2)) };	
-		for(i=0; i<N; ++i) {
-			for(j=0; j<N; ++j) {
-				COEF_T q = quantization_values[0];
-				if(i+j == N-1) {
-					q = quantization_values[1];
-				}
-				else if (i+j > N-1) {
-					q = quantization_values[2];
-				}
-				ret[i][j] = rint(coefs[i][j]/q);
-			}
-		}
+		const l_QuantTable& t = l_quant_table(N, qp);
+		SIMD::quantize(&coefs[0], &t.recips[0], &ret[0], N*N);
 	}
 	return ret;
 }
 
 COEF_MATRIX_T DCT::rescale_coefs(const QCOEF_MATRIX_T& qcoefs, unsigned int qp)
 {
-	assert(qcoefs.size() > 0 && qcoefs.size() == qcoefs[0].size());
-	unsigned int N = qcoefs.size();
+	unsigned int N = coefs_block_size(qcoefs);
 	assert(N % 2 == 0);
 
-	COEF_MATRIX_T ret( N, std::vector<COEF_T>(N) );
-	unsigned int i, j;
+	COEF_MATRIX_T ret(N*N);
 	
 	if(DISABLE_QUANTIZATION) {
-		for(i = 0; i < N; ++i) {
-			for(j = 0; j < N; ++j) {
-				ret[i][j] = (COEF_T)qcoefs[i][j];
-			}
-		}
+		ret.assign(qcoefs.begin(), qcoefs.end());
 	} else {
-		std::vector<COEF_T> quantization_values = { static_cast<COEF_T>(1 << qp), static_cast<COEF_T>(1 << (qp+1)), static_cast<COEF_T>(1 << (qp+2)) };
-		for(i=0; i<N; ++i) {
-			for(j=0; j<N; ++j) {
-				COEF_T q = quantization_values[0];
-				if(i+j == N-1) {
-					q = quantization_values[1];
-				}
-				else if (i+j > N-1) {
-					q = quantization_values[2];
-				}
-				ret[i][j] = q * (COEF_T)qcoefs[i][j];
-			}
-		}
+		const l_QuantTable& t = l_quant_table(N, qp);
+		SIMD::rescale(&qcoefs[0], &t.steps[0], &ret[0], N*N);
 	}
 	return ret;
 }
 
+// Coefficients (at most 255*64*2^8 < 2^22, or twice that once rescaled) make column sums under 2^50. The first
+// pass drops DCT_BASIS_BITS, leaving sqrt(N)*2^8 times the 1-D result, and the row sums then stay under 2^57.
 ByteMatrix DCT::coefs_to_matrix(const COEF_MATRIX_T& coefs)
 {
-	assert(coefs.size() > 0 && coefs.size() == coefs[0].size());
-	unsigned int N = coefs.size();
+	unsigned int N = coefs_block_size(coefs);
 	assert(N % 2 == 0);
 
-	BYTEVEC_T values( N*N );
+	ByteMatrix ret(0, N, N);
 	
-	unsigned int i, j, k;
+	unsigned int i, j;
 	
 	if (DISABLE_TRANSFORM)
 	{
 		for(i = 0; i < N; ++i){
 			for(j = 0; j < N; ++j) {
-				values[i*N + j] = (BYTE_T)coefs[i][j];
+				DCT_SUM_T v = l_descale(coefs[i*N + j], DCT_COEF_FRAC_BITS, DCT_SUM_T(1) << DCT_COEF_FRAC_BITS);
+				ret[i][j] = static_cast<BYTE_T>( std::min<DCT_SUM_T>(std::max<DCT_SUM_T>(v, 0), 255) );
 			}
 		}
 	}
 	else
 	{
-		COEF_MATRIX_T temp( N, std::vector<COEF_T>(N) );
-		COEF_MATRIX_T C, Ct;
-		std::tie(C, Ct) = l_initialize_dct_coeffs(N);
-
-		// transform the rows
-		for(i = 0; i < N; ++i) {
-			for(j = 0; j < N; ++j) {
-				temp[i][j] = 0.0;
-				for(k = 0; k < N; ++k)
-				{
-					temp[i][j] += coefs[i][k] * C[k][j];
-				}
+		assert(N <= DCT_MAX_N);
+		const l_DctTable& t = l_dct_table(N);
+		const int shift1 = DCT_BASIS_BITS;
+		const int shift2_base = DCT_BASIS_BITS + DCT_COEF_FRAC_BITS;
+		const int shift2 = (t.log2N >= 0) ? t.log2N + shift2_base : -1;
+		
+		DCT_SUM_T column[DCT_MAX_N], values[DCT_MAX_N];
+		DCT_SUM_T temp[DCT_MAX_N * DCT_MAX_N];
+		
+		// transform the columns, storing the result transposed so the second pass works on contiguous data
+		for(j = 0; j < N; ++j) {
+			for(i = 0; i < N; ++i) {
+				column[i] = coefs[i*N + j];
 			}
+			l_inverse_1d(column, 1, &temp[j*N], N);
+		}
+		for(i = 0; i < N*N; ++i) {
+			temp[i] = l_descale(temp[i], shift1, DCT_SUM_T(1) << shift1);
 		}
 		
-		// transform the columns
-		COEF_T temp_v;
-		for(i=0; i < N; ++i) {
-			for(j=0; j < N; ++j) {
-				temp_v = 0.0;
-				for(k=0; k < N; ++k) {
-					temp_v += Ct[i][k] * temp[k][j];
-				}
-				temp_v = std::max(temp_v, 0.);
-				temp_v = std::min(temp_v, 255.);
-				values[i*N + j] = static_cast<unsigned char>(rint(temp_v));	
+		// transform the rows
+		for(i = 0; i < N; ++i) {
+			l_inverse_1d(&temp[i], N, values, N);
+			BYTE_T* r = ret[i];
+			for(j = 0; j < N; ++j) {
+				DCT_SUM_T v = l_descale(values[j], shift2, DCT_SUM_T(N) << shift2_base);
+				r[j] = static_cast<BYTE_T>( std::min<DCT_SUM_T>(std::max<DCT_SUM_T>(v, 0), 255) );
 			}
 		}
 	}
 	
-	return ByteMatrix(values, N, N);
+	return ret;
 }
 
 void DCT::print_coefs(const COEF_MATRIX_T& coefs, std::ostream& out)
 {
-	for(auto& c_row : coefs)
+	unsigned int N = coefs_block_size(coefs);
+	for(unsigned int i = 0; i < N; ++i)
 	{
-		for(auto& c : c_row)
+		for(unsigned int j = 0; j < N; ++j)
 		{
-			out << std::setw(10) << c << " ";
+			out << std::setw(10) << coefs[i*N + j] << " ";
 		}
 		out << std::endl;
 	}
 }
 
+unsigned int DCT::coefs_block_size(const COEF_MATRIX_T& coefs)
+{
+	unsigned int N = (unsigned int)lround(sqrt(double(coefs.size())));
+	assert(N > 0 && N*N == coefs.size());
+	return N;
+}
+
 INT_VEC_T RLE::qcoef_matrix_to_int_vec(const QCOEF_MATRIX_T& qcoefs)
 {
-	unsigned int N = qcoefs.size();
-	assert(N > 0 && N== qcoefs[0].size());
+	unsigned int N = DCT::coefs_block_size(qcoefs);
 	INT_VEC_T ret(N* N);
 	
 	unsigned int diagonals = 2*N-1;
@@ -239,7 +388,7 @@ INT_VEC_T RLE::qcoef_matrix_to_int_vec(const QCOEF_MATRIX_T& qcoefs)
 		{
 			if(c < N)
 			{
-				ret[i] = qcoefs[r][c];
+				ret[i] = qcoefs[r*N + c];
 				++i;
 			}
 			
@@ -255,7 +404,7 @@ QCOEF_MATRIX_T RLE::int_vec_to_qcoef_matrix(const INT_VEC_T& int_vec)
 	unsigned int N = sqrt(int_vec.size());
 	assert( int_vec.size() == N*N );
 	
-	QCOEF_MATRIX_T ret(N, std::vector<QCOEF_T>(N));
+	QCOEF_MATRIX_T ret(N*N);
 	
 	unsigned int diagonals = 2*N-1;
 	unsigned int d, r, c, i=0;
@@ -265,7 +414,7 @@ QCOEF_MATRIX_T RLE::int_vec_to_qcoef_matrix(const INT_VEC_T& int_vec)
 		{
 			if(c < N)
 			{
-				ret[r][c] = int_vec[i];
+				ret[r*N + c] = int_vec[i];
 				++i;
 			}
 			
@@ -357,7 +506,7 @@ INT_VEC_T RLE::read_and_irle_int_vec(std::istream& in)
 	return irle_int_vec(read_vec);
 }
 
-ResidualBlock::ResidualBlock(const ByteMatrix& cur_block, const ByteMatrix& ref_block, unsigned int qp, unsigned int est_cost) : 
+ResidualBlock::ResidualBlock(const ByteBlockView& cur_block, const ByteBlockView& ref_block, unsigned int qp, unsigned int est_cost) : 
 m_estimated_cost(est_cost), m_qp(qp), m_init(false)
 {	
 	assert(cur_block.get_width() != 0 && cur_block.get_width() == cur_block.get_height());
@@ -365,12 +514,21 @@ m_estimated_cost(est_cost), m_qp(qp), m_init(false)
 	assert(cur_block.get_width() == ref_block.get_height());
 	m_block_size = ref_block.get_width();
 	
-	ByteMatrix block80(0x80, m_block_size, m_block_size);
-	
-	ByteMatrix spatial_residuals = cur_block - ref_block + block80;
+	// cur - ref + 0x80, wrapping in byte arithmetic exactly as the ByteMatrix operators do
+	ByteMatrix spatial_residuals(0x00, m_block_size, m_block_size);
+	for(unsigned int i = 0; i < m_block_size; ++i)
+	{
+		const BYTE_T* c = cur_block[i];
+		const BYTE_T* r = ref_block[i];
+		BYTE_T* s = spatial_residuals[i];
+		for(unsigned int j = 0; j < m_block_size; ++j)
+		{
+			s[j] = BYTE_T(c[j] - r[j] + 0x80);
+		}
+	}
 	_dct_and_quantize(spatial_residuals);
 	
-	CFG_LOAD_OPT_DEFAULT("debug_res_est", m_debug_estimate, false);
+	m_debug_estimate = PARAMS::inst().debug_res_est;
 	if(m_debug_estimate)
 	{
 		m_SAD = cur_block.SAD(ref_block);
@@ -382,25 +540,36 @@ m_estimated_cost(0), m_qp(qp), m_block_size(block_size), m_init(false)
 {
 	INT_VEC_T as_ints = RLE::read_and_irle_int_vec(in);
 	m_residuals = RLE::int_vec_to_qcoef_matrix(as_ints);
-	if(m_block_size == 2 * m_residuals.size() && m_block_size == 2* m_residuals[0].size())
+	unsigned int N = DCT::coefs_block_size(m_residuals);
+	if(m_block_size == 2 * N)
 	{
-		m_block_size = m_residuals.size();
+		m_block_size = N;
 		if(m_qp > 0)
 			--m_qp;
 	}
-	assert(m_residuals.size() == m_block_size && m_residuals[0].size() == m_block_size);
+	assert(N == m_block_size);
 	m_init = true;
 }
 
-ByteMatrix ResidualBlock::reconstruct_from(const ByteMatrix& ref_block)
+ByteMatrix ResidualBlock::reconstruct_from(const ByteBlockView& ref_block) const
 {
 	assert(is_initialized());
-	ByteMatrix spatial_residuals = as_y_block();
+	ByteMatrix recon = as_y_block();
 	
-	assert(m_block_size == spatial_residuals.get_width());
-	ByteMatrix block80(0x80, m_block_size, m_block_size);
+	assert(m_block_size == recon.get_width());
+	assert(m_block_size == ref_block.get_width() && m_block_size == ref_block.get_height());
 	
-	return ref_block + (spatial_residuals - block80);
+	// ref + (residual - 0x80), again in wrapping byte arithmetic
+	for(unsigned int i = 0; i < m_block_size; ++i)
+	{
+		const BYTE_T* r = ref_block[i];
+		BYTE_T* s = recon[i];
+		for(unsigned int j = 0; j < m_block_size; ++j)
+		{
+			s[j] = BYTE_T(r[j] + BYTE_T(s[j] - 0x80));
+		}
+	}
+	return recon;
 }
 	
 unsigned int ResidualBlock::write(std::ostream& out, bool debug_enabled)
@@ -420,11 +589,11 @@ unsigned int ResidualBlock::write(std::ostream& out, bool debug_enabled)
 
 void ResidualBlock::print(std::ostream& out)
 {
-	for(auto& row : m_residuals)
+	for(unsigned int i = 0; i < m_block_size; ++i)
 	{
-		for(auto& r : row)
+		for(unsigned int j = 0; j < m_block_size; ++j)
 		{
-			out << std::setw(10) << r;
+			out << std::setw(10) << m_residuals[i*m_block_size + j];
 		}
 		out << std::endl;
 	}
@@ -438,30 +607,39 @@ void ResidualBlock::_dct_and_quantize(const ByteMatrix& spatial_residuals)
 	m_init = true;
 }
 
-ByteMatrix ResidualBlock::_rescale_and_idct()
+ByteMatrix ResidualBlock::_rescale_and_idct() const
 {
 	assert(is_initialized());
 	COEF_MATRIX_T rescaled_coefs = DCT::rescale_coefs(m_residuals, m_qp);
 	return DCT::coefs_to_matrix(rescaled_coefs);
 }
 
-ByteMatrix ResidualBlock::as_y_block()
+ByteMatrix ResidualBlock::as_y_block() const
 {
 	return _rescale_and_idct();
 }
 
-unsigned int ResidualBlock::estimate_rd_cost(const ByteMatrix& cur, const ByteMatrix& ref, unsigned int qp, unsigned int additional_bytes)
+unsigned int ResidualBlock::estimate_rd_cost(const ByteBlockView& cur, const ByteBlockView& ref, unsigned int qp, unsigned int additional_bytes)
+{
+	return estimate_rd_cost(cur, ref, qp, additional_bytes, cur.SAD(ref));
+}
+
+// RDO factor of the simple estimate, which only goes by the SAD
+static unsigned int l_simple_rdo_factor(unsigned int SAD, unsigned int qp, unsigned int additional_bytes, unsigned int C1)
 {
-	unsigned int SAD = cur.SAD(ref);
+	unsigned int bytes_written_est = (int)( double(SAD) * pow(2.0, 0 - double(qp)) );
+	bytes_written_est += additional_bytes;
 	
-	// This is a very inner loop check, so use the following instead of string comparisons:
-	// 0 = No RDO factor, aka SAD only
-	// 1 = Simple RDO factor, based on the spatial-domain residuals
-	// 2 = Complex RDO factor, based on the actual bytes written to disk
-	unsigned int RDO_ESTIMATE, C1, C2;
-	CFG_LOAD_OPT_DEFAULT("rdo_estimation", RDO_ESTIMATE, 0);
-	CFG_LOAD_OPT_DEFAULT("rdo_estimation_c1", C1, 900); //882
-	CFG_LOAD_OPT_DEFAULT("rdo_estimation_c2", C2, 900);
+	return (int)( double(C1)*pow(2.0, (double(qp) - 12.)/3.)*(double)bytes_written_est );
+}
+
+unsigned int ResidualBlock::estimate_rd_cost(const ByteBlockView& cur, const ByteBlockView& ref, unsigned int qp, unsigned int additional_bytes, unsigned int SAD)
+{
+	// This is a very inner loop check, so everything comes pre-parsed from PARAMS
+	const PARAMS& params = PARAMS::inst();
+	const unsigned int RDO_ESTIMATE = params.rdo_estimation;
+	const unsigned int C1 = params.rdo_estimation_c1;
+	const unsigned int C2 = params.rdo_estimation_c2;
 			
 	unsigned int RDO_factor = 0;
 	if(RDO_ESTIMATE == 2)
@@ -476,11 +654,31 @@ unsigned int ResidualBlock::estimate_rd_cost(const ByteMatrix& cur, const ByteMa
 	}
 	else if (RDO_ESTIMATE == 1)
 	{
-		unsigned int bytes_written_est = (int)( double(SAD) * pow(2.0, 0 - double(qp)) );
-		bytes_written_est += additional_bytes;
-		
-		RDO_factor = (int)( double(C1)*pow(2.0, (double(qp) - 12.)/3.)*(double)bytes_written_est );
+		RDO_factor = l_simple_rdo_factor(SAD, qp, additional_bytes, C1);
 	}
 	
 	return SAD + RDO_factor;
+}
+
+unsigned int ResidualBlock::max_SAD_within_cost(unsigned int qp, unsigned int cost)
+{
+	// The RDO factor is never negative, and the full estimate can't be bounded without the blocks themselves
+	const PARAMS& params = PARAMS::inst();
+	if(params.rdo_estimation != 1)
+	{
+		return cost;
+	}
+	
+	// The simple estimate only grows with the SAD (and with the bytes on top, which can't be fewer than none), so
+	// binary search for the last SAD that fits
+	unsigned int lo = 0, hi = cost;
+	while(lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo + 1) / 2;
+		if(mid + l_simple_rdo_factor(mid, qp, 0, params.rdo_estimation_c1) <= cost)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
 }
\ No newline at end of file
@@ -5,10 +5,11 @@
 #ifndef _RESIDUAL_H
 #define _RESIDUAL_H
 
-typedef double COEF_T;
+typedef int COEF_T;
 typedef int QCOEF_T;
-typedef std::vector< std::vector< COEF_T > > COEF_MATRIX_T;
-typedef std::vector< std::vector< QCOEF_T > > QCOEF_MATRIX_T;
+// Coefficients of an NxN block, stored row-major in a single array
+typedef std::vector< COEF_T > COEF_MATRIX_T;
+typedef std::vector< QCOEF_T > QCOEF_MATRIX_T;
 
 namespace DCT
 {	
@@ -20,6 +21,9 @@ namespace DCT
 	ByteMatrix coefs_to_matrix(const COEF_MATRIX_T& coefs);
 	
 	void print_coefs(const COEF_MATRIX_T& coefs, std::ostream& out);
+	
+	// N of an NxN block of coefficients
+	unsigned int coefs_block_size(const COEF_MATRIX_T& coefs);
 }
 
 namespace RLE
@@ -43,13 +47,13 @@ public:
 	ResidualBlock() : m_init(false) {};
 	
 	// Encoder-side creation of residuals based on a prediction
-	ResidualBlock(const ByteMatrix& cur_block, const ByteMatrix& ref_block, unsigned int qp, unsigned int est_cost);
+	ResidualBlock(const ByteBlockView& cur_block, const ByteBlockView& ref_block, unsigned int qp, unsigned int est_cost);
 	
 	// Decoder-side creation of residuals from a byte stream
 	ResidualBlock(std::istream& in, unsigned int block_size, unsigned int qp);
 	
 	// Generate a reconstructed block from a reference block
-	ByteMatrix reconstruct_from(const ByteMatrix& ref_block);
+	ByteMatrix reconstruct_from(const ByteBlockView& ref_block) const;
 	
 	// Write to a byte stream
 	unsigned int write(std::ostream& out) { return write(out, true); }
@@ -58,15 +62,19 @@ public:
 	void print(std::ostream& out);
 	
 	// Check if we've initialized the block (copy constructor or one of the data constructors)
-	bool is_initialized() { return m_init; };
+	bool is_initialized() const { return m_init; };
 	
 	// Return a ByteMatrix with values representing the residuals in the spatial domain
-	ByteMatrix as_y_block();
+	ByteMatrix as_y_block() const;
 	
 	// Estimate the RD-Cost of creating a ResidualBlock from two frames
-	static unsigned int estimate_rd_cost(const ByteMatrix& cur, const ByteMatrix& ref, unsigned int qp, unsigned int additional_bytes);
+	static unsigned int estimate_rd_cost(const ByteBlockView& cur, const ByteBlockView& ref, unsigned int qp, unsigned int additional_bytes);
+	// Same, for when the SAD between the two blocks has already been computed (e.g. a whole search row at once)
+	static unsigned int estimate_rd_cost(const ByteBlockView& cur, const ByteBlockView& ref, unsigned int qp, unsigned int additional_bytes, unsigned int SAD);
+	// Largest SAD that could still come out at an estimated RD-Cost of at most cost; anything with a bigger SAD costs more
+	static unsigned int max_SAD_within_cost(unsigned int qp, unsigned int cost);
 	
-	unsigned int get_block_size() { return m_block_size; }
+	unsigned int get_block_size() const { return m_block_size; }
 	
 private:
 	unsigned int write(std::ostream& out, bool debug_enabled);
@@ -77,7 +85,7 @@ private:
 	unsigned int m_SAD;
 
 	void _dct_and_quantize(const ByteMatrix& spatial_residuals);
-	ByteMatrix _rescale_and_idct();
+	ByteMatrix _rescale_and_idct() const;
 	
 	QCOEF_MATRIX_T m_residuals;
 	unsigned int m_qp;
@@ -0,0 +1,732 @@
+#include "simd.h"
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifdef SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SIMD_TARGET(isa)
+#else
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+typedef unsigned int (*SAD_FUNC_T)(const BYTE_T*, unsigned int, const BYTE_T*, unsigned int, unsigned int, unsigned int);
+// Scores a fixed number of adjacent candidates (8 or 16) for a block of fixed width, adding to the running SADs.
+// Returns the smallest of those, each taken as at least its floor when there are floors.
+typedef unsigned int (*SAD_ROW_FUNC_T)(const BYTE_T*, unsigned int, const BYTE_T*, unsigned int, unsigned int, unsigned int*, const unsigned int*);
+typedef void (*QUANTIZE_FUNC_T)(const int*, const float*, int*, unsigned int);
+typedef void (*RESCALE_FUNC_T)(const int*, const int*, int*, unsigned int);
+// Bit k is set when values[k] <= bound, for n values (a multiple of the vector width, up to 32)
+typedef unsigned int (*WITHIN_MASK_FUNC_T)(const unsigned int*, unsigned int, unsigned int);
+typedef void (*SUM_DISTANCES_FUNC_T)(const std::uint16_t*, unsigned int, unsigned int, unsigned int*);
+
+// One kernel per block width we care about (4 and 8 are the VBS halves of 8 and 16), plus a fallback for anything else.
+// The row kernels are null when the level has nothing better than scoring the candidates one by one, and so is the
+// mask of the candidates in a group still worth scoring.
+// The (de)quantization kernels work on whole blocks of coefficients.
+struct SimdKernels
+{
+	SIMD::SIMD_LEVEL_T level;
+	SAD_FUNC_T w4;
+	SAD_FUNC_T w8;
+	SAD_FUNC_T w16;
+	SAD_FUNC_T generic;
+	SAD_ROW_FUNC_T row8_w8;
+	SAD_ROW_FUNC_T row8_w16;
+	SAD_ROW_FUNC_T row16_w8;
+	SAD_ROW_FUNC_T row16_w16;
+	WITHIN_MASK_FUNC_T within_mask;
+	QUANTIZE_FUNC_T quantize;
+	RESCALE_FUNC_T rescale;
+	SUM_DISTANCES_FUNC_T sum_distances;
+};
+
+unsigned int SIMD::sad_scalar(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	unsigned int ret = 0;
+	for(unsigned int i = 0; i < height; ++i, a += a_stride, b += b_stride)
+	{
+		for(unsigned int j = 0; j < width; ++j)
+		{
+			ret += abs( int(a[j]) - int(b[j]) );
+		}
+	}
+	return ret;
+}
+
+void SIMD::quantize_scalar(const int* coefs, const float* recips, int* out, unsigned int n)
+{
+	for(unsigned int k = 0; k < n; ++k)
+	{
+		out[k] = (int)rint(double(coefs[k]) * recips[k]);
+	}
+}
+
+void SIMD::rescale_scalar(const int* qcoefs, const int* steps, int* out, unsigned int n)
+{
+	for(unsigned int k = 0; k < n; ++k)
+	{
+		out[k] = qcoefs[k] * steps[k];
+	}
+}
+
+void SIMD::block_sum_distances_scalar(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out)
+{
+	for(unsigned int k = 0; k < n; ++k)
+	{
+		out[k] += (sum > sums[k]) ? sum - sums[k] : sums[k] - sum;
+	}
+}
+
+#ifdef SIMD_X86
+
+static inline int l_load_int(const BYTE_T* p)
+{
+	int v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static SIMD_TARGET("sse2") inline unsigned int l_hsum_sse2(__m128i acc)
+{
+	return (unsigned int)_mm_cvtsi128_si32(acc) + (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+static SIMD_TARGET("sse2") unsigned int l_sad_w4_sse2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned int i = 0;
+	// Gather four 4-byte rows into a single register per block
+	for(; i + 4 <= height; i += 4, a += 4*a_stride, b += 4*b_stride)
+	{
+		__m128i ra = _mm_unpacklo_epi64(
+			_mm_unpacklo_epi32(_mm_cvtsi32_si128(l_load_int(a)), _mm_cvtsi32_si128(l_load_int(a + a_stride))),
+			_mm_unpacklo_epi32(_mm_cvtsi32_si128(l_load_int(a + 2*a_stride)), _mm_cvtsi32_si128(l_load_int(a + 3*a_stride))));
+		__m128i rb = _mm_unpacklo_epi64(
+			_mm_unpacklo_epi32(_mm_cvtsi32_si128(l_load_int(b)), _mm_cvtsi32_si128(l_load_int(b + b_stride))),
+			_mm_unpacklo_epi32(_mm_cvtsi32_si128(l_load_int(b + 2*b_stride)), _mm_cvtsi32_si128(l_load_int(b + 3*b_stride))));
+		acc = _mm_add_epi32(acc, _mm_sad_epu8(ra, rb));
+	}
+	return l_hsum_sse2(acc) + SIMD::sad_scalar(a, a_stride, b, b_stride, width, height - i);
+}
+
+static SIMD_TARGET("sse2") unsigned int l_sad_w8_sse2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned int i = 0;
+	for(; i + 2 <= height; i += 2, a += 2*a_stride, b += 2*b_stride)
+	{
+		__m128i ra = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)a), _mm_loadl_epi64((const __m128i*)(a + a_stride)));
+		__m128i rb = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)b), _mm_loadl_epi64((const __m128i*)(b + b_stride)));
+		acc = _mm_add_epi32(acc, _mm_sad_epu8(ra, rb));
+	}
+	if(i < height)
+	{
+		acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)a), _mm_loadl_epi64((const __m128i*)b)));
+	}
+	return l_hsum_sse2(acc);
+}
+
+static SIMD_TARGET("sse2") unsigned int l_sad_w16_sse2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m128i acc = _mm_setzero_si128();
+	for(unsigned int i = 0; i < height; ++i, a += a_stride, b += b_stride)
+	{
+		acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b)));
+	}
+	return l_hsum_sse2(acc);
+}
+
+static SIMD_TARGET("sse2") unsigned int l_sad_generic_sse2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned int tail = 0;
+	for(unsigned int i = 0; i < height; ++i, a += a_stride, b += b_stride)
+	{
+		unsigned int j = 0;
+		for(; j + 16 <= width; j += 16)
+		{
+			acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + j)), _mm_loadu_si128((const __m128i*)(b + j))));
+		}
+		if(j + 8 <= width)
+		{
+			acc = _mm_add_epi32(acc, _mm_sad_epu8(_mm_loadl_epi64((const __m128i*)(a + j)), _mm_loadl_epi64((const __m128i*)(b + j))));
+			j += 8;
+		}
+		tail += SIMD::sad_scalar(a + j, a_stride, b + j, b_stride, width - j, 1);
+	}
+	return l_hsum_sse2(acc) + tail;
+}
+
+// mpsadbw computes, for 8 consecutive offsets of its first operand, the SAD against one 4-byte group of the second.
+// Summing it over the 4-byte groups of a row scores 8 adjacent candidates at once. The 16-bit sums are widened
+// every 16 rows (16 rows of 16 pixels is at most 65280) so any height works.
+// None of the loads reach past the last byte of the last candidate: the second half of a 16-byte row is read one
+// byte early and shifted down instead.
+// Adds a group's SADs to the running ones and returns the smallest, as SAD_ROW_FUNC_T does
+static SIMD_TARGET("sse4.1") inline unsigned int l_accumulate_row8_sse41(__m128i total_lo, __m128i total_hi, unsigned int* sads, const unsigned int* floors)
+{
+	total_lo = _mm_add_epi32(total_lo, _mm_loadu_si128((const __m128i*)sads));
+	total_hi = _mm_add_epi32(total_hi, _mm_loadu_si128((const __m128i*)(sads + 4)));
+	_mm_storeu_si128((__m128i*)sads, total_lo);
+	_mm_storeu_si128((__m128i*)(sads + 4), total_hi);
+	if(floors)
+	{
+		total_lo = _mm_max_epu32(total_lo, _mm_loadu_si128((const __m128i*)floors));
+		total_hi = _mm_max_epu32(total_hi, _mm_loadu_si128((const __m128i*)(floors + 4)));
+	}
+	__m128i m = _mm_min_epu32(total_lo, total_hi);
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(m);
+}
+
+static SIMD_TARGET("sse4.1") unsigned int l_sad_row8_w16_sse41(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int height, unsigned int* sads, const unsigned int* floors)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i total_lo = zero;
+	__m128i total_hi = zero;
+	for(unsigned int i = 0; i < height; )
+	{
+		__m128i acc = zero;
+		for(unsigned int end = (height - i > 16) ? i + 16 : height; i < end; ++i, cur += cur_stride, ref += ref_stride)
+		{
+			__m128i c = _mm_loadu_si128((const __m128i*)cur);
+			__m128i r0 = _mm_loadu_si128((const __m128i*)ref);
+			__m128i r1 = _mm_srli_si128(_mm_loadu_si128((const __m128i*)(ref + 7)), 1);
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r0, c, 0));
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r0, c, 5));
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r1, c, 2));
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r1, c, 7));
+		}
+		total_lo = _mm_add_epi32(total_lo, _mm_unpacklo_epi16(acc, zero));
+		total_hi = _mm_add_epi32(total_hi, _mm_unpackhi_epi16(acc, zero));
+	}
+	return l_accumulate_row8_sse41(total_lo, total_hi, sads, floors);
+}
+
+static SIMD_TARGET("sse4.1") unsigned int l_sad_row8_w8_sse41(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int height, unsigned int* sads, const unsigned int* floors)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i total_lo = zero;
+	__m128i total_hi = zero;
+	for(unsigned int i = 0; i < height; )
+	{
+		__m128i acc = zero;
+		for(unsigned int end = (height - i > 16) ? i + 16 : height; i < end; ++i, cur += cur_stride, ref += ref_stride)
+		{
+			__m128i c = _mm_loadl_epi64((const __m128i*)cur);
+			// The 8 candidates span 15 bytes
+			__m128i r = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)ref), _mm_srli_epi64(_mm_loadl_epi64((const __m128i*)(ref + 7)), 8));
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r, c, 0));
+			acc = _mm_add_epi16(acc, _mm_mpsadbw_epu8(r, c, 5));
+		}
+		total_lo = _mm_add_epi32(total_lo, _mm_unpacklo_epi16(acc, zero));
+		total_hi = _mm_add_epi32(total_hi, _mm_unpackhi_epi16(acc, zero));
+	}
+	return l_accumulate_row8_sse41(total_lo, total_hi, sads, floors);
+}
+
+// The AVX2 kernels leave whatever doesn't fill a 256-bit register to the SSE ones, which aren't VEX encoded. Those
+// pay for any upper halves of the ymm registers left dirty (a state transition, or a false dependency on every
+// instruction, depending on the CPU), and the compiler doesn't clear them before a tail call, so each kernel does.
+static SIMD_TARGET("avx2") inline unsigned int l_hsum_avx2(__m256i acc)
+{
+	__m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	return (unsigned int)_mm_cvtsi128_si32(sum) + (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+
+static SIMD_TARGET("avx2") inline __m256i l_load_2x16_avx2(const BYTE_T* row0, const BYTE_T* row1)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)row0)), _mm_loadu_si128((const __m128i*)row1), 1);
+}
+
+static SIMD_TARGET("avx2") inline __m256i l_load_4x8_avx2(const BYTE_T* p, unsigned int stride)
+{
+	__m128i lo = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)p), _mm_loadl_epi64((const __m128i*)(p + stride)));
+	__m128i hi = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(p + 2*stride)), _mm_loadl_epi64((const __m128i*)(p + 3*stride)));
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+}
+
+static SIMD_TARGET("avx2") unsigned int l_sad_w8_avx2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int i = 0;
+	for(; i + 4 <= height; i += 4, a += 4*a_stride, b += 4*b_stride)
+	{
+		acc = _mm256_add_epi32(acc, _mm256_sad_epu8(l_load_4x8_avx2(a, a_stride), l_load_4x8_avx2(b, b_stride)));
+	}
+	unsigned int ret = l_hsum_avx2(acc);
+	_mm256_zeroupper();
+	return ret + l_sad_w8_sse2(a, a_stride, b, b_stride, width, height - i);
+}
+
+static SIMD_TARGET("avx2") unsigned int l_sad_w16_avx2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int i = 0;
+	for(; i + 2 <= height; i += 2, a += 2*a_stride, b += 2*b_stride)
+	{
+		acc = _mm256_add_epi32(acc, _mm256_sad_epu8(l_load_2x16_avx2(a, a + a_stride), l_load_2x16_avx2(b, b + b_stride)));
+	}
+	unsigned int ret = l_hsum_avx2(acc);
+	_mm256_zeroupper();
+	return ret + l_sad_w16_sse2(a, a_stride, b, b_stride, width, height - i);
+}
+
+static SIMD_TARGET("avx2") unsigned int l_sad_generic_avx2(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	__m256i acc = _mm256_setzero_si256();
+	unsigned int aligned_width = width & ~31u;
+	for(unsigned int i = 0; i < height; ++i)
+	{
+		for(unsigned int j = 0; j < aligned_width; j += 32)
+		{
+			acc = _mm256_add_epi32(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(a + i*a_stride + j)), _mm256_loadu_si256((const __m256i*)(b + i*b_stride + j))));
+		}
+	}
+	// Whatever doesn't fill a 32-byte register is handled by the narrower kernel
+	unsigned int ret = l_hsum_avx2(acc);
+	_mm256_zeroupper();
+	return ret + l_sad_generic_sse2(a + aligned_width, a_stride, b + aligned_width, b_stride, width - aligned_width, height);
+}
+
+// The 256-bit mpsadbw works on each 128-bit lane independently: the low lane scores candidates 0-7 and the
+// high lane candidates 8-15 against the same current row, broadcast to both lanes. total_lo then holds candidates
+// 0-3 and 8-11, and total_hi 4-7 and 12-15.
+static SIMD_TARGET("avx2") inline __m256i l_load_row16_avx2(const unsigned int* p)
+{
+	return l_load_2x16_avx2((const BYTE_T*)p, (const BYTE_T*)(p + 8));
+}
+
+static SIMD_TARGET("avx2") inline unsigned int l_accumulate_row16_avx2(__m256i total_lo, __m256i total_hi, unsigned int* sads, const unsigned int* floors)
+{
+	total_lo = _mm256_add_epi32(total_lo, l_load_row16_avx2(sads));
+	total_hi = _mm256_add_epi32(total_hi, l_load_row16_avx2(sads + 4));
+	_mm_storeu_si128((__m128i*)sads, _mm256_castsi256_si128(total_lo));
+	_mm_storeu_si128((__m128i*)(sads + 4), _mm256_castsi256_si128(total_hi));
+	_mm_storeu_si128((__m128i*)(sads + 8), _mm256_extracti128_si256(total_lo, 1));
+	_mm_storeu_si128((__m128i*)(sads + 12), _mm256_extracti128_si256(total_hi, 1));
+	if(floors)
+	{
+		total_lo = _mm256_max_epu32(total_lo, l_load_row16_avx2(floors));
+		total_hi = _mm256_max_epu32(total_hi, l_load_row16_avx2(floors + 4));
+	}
+	__m256i m256 = _mm256_min_epu32(total_lo, total_hi);
+	__m128i m = _mm_min_epu32(_mm256_castsi256_si128(m256), _mm256_extracti128_si256(m256, 1));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+	m = _mm_min_epu32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (unsigned int)_mm_cvtsi128_si32(m);
+}
+
+static SIMD_TARGET("avx2") unsigned int l_sad_row16_w16_avx2(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int height, unsigned int* sads, const unsigned int* floors)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total_lo = zero;
+	__m256i total_hi = zero;
+	for(unsigned int i = 0; i < height; )
+	{
+		__m256i acc = zero;
+		for(unsigned int end = (height - i > 16) ? i + 16 : height; i < end; ++i, cur += cur_stride, ref += ref_stride)
+		{
+			__m256i c = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cur));
+			__m256i r0 = l_load_2x16_avx2(ref, ref + 8);
+			__m256i r1 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(ref + 8))),
+				_mm_srli_si128(_mm_loadu_si128((const __m128i*)(ref + 15)), 1), 1);
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r0, c, 0));
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r0, c, 5 | (5 << 3)));
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r1, c, 2 | (2 << 3)));
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r1, c, 7 | (7 << 3)));
+		}
+		total_lo = _mm256_add_epi32(total_lo, _mm256_unpacklo_epi16(acc, zero));
+		total_hi = _mm256_add_epi32(total_hi, _mm256_unpackhi_epi16(acc, zero));
+	}
+	return l_accumulate_row16_avx2(total_lo, total_hi, sads, floors);
+}
+
+static SIMD_TARGET("avx2") unsigned int l_sad_row16_w8_avx2(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int height, unsigned int* sads, const unsigned int* floors)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i total_lo = zero;
+	__m256i total_hi = zero;
+	for(unsigned int i = 0; i < height; )
+	{
+		__m256i acc = zero;
+		for(unsigned int end = (height - i > 16) ? i + 16 : height; i < end; ++i, cur += cur_stride, ref += ref_stride)
+		{
+			__m256i c = _mm256_broadcastsi128_si256(_mm_loadl_epi64((const __m128i*)cur));
+			__m256i r = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)ref)),
+				_mm_srli_si128(_mm_loadu_si128((const __m128i*)(ref + 7)), 1), 1);
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r, c, 0));
+			acc = _mm256_add_epi16(acc, _mm256_mpsadbw_epu8(r, c, 5 | (5 << 3)));
+		}
+		total_lo = _mm256_add_epi32(total_lo, _mm256_unpacklo_epi16(acc, zero));
+		total_hi = _mm256_add_epi32(total_hi, _mm256_unpackhi_epi16(acc, zero));
+	}
+	return l_accumulate_row16_avx2(total_lo, total_hi, sads, floors);
+}
+
+// cvtps2dq rounds in the current (round-to-nearest-even) mode, just like rint
+static SIMD_TARGET("sse2") void l_quantize_sse2(const int* coefs, const float* recips, int* out, unsigned int n)
+{
+	unsigned int k = 0;
+	for(; k + 4 <= n; k += 4)
+	{
+		__m128 c = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(coefs + k)));
+		_mm_storeu_si128((__m128i*)(out + k), _mm_cvtps_epi32(_mm_mul_ps(c, _mm_loadu_ps(recips + k))));
+	}
+	SIMD::quantize_scalar(coefs + k, recips + k, out + k, n - k);
+}
+
+static SIMD_TARGET("avx2") void l_quantize_avx2(const int* coefs, const float* recips, int* out, unsigned int n)
+{
+	unsigned int k = 0;
+	for(; k + 8 <= n; k += 8)
+	{
+		__m256 c = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(coefs + k)));
+		_mm256_storeu_si256((__m256i*)(out + k), _mm256_cvtps_epi32(_mm256_mul_ps(c, _mm256_loadu_ps(recips + k))));
+	}
+	_mm256_zeroupper();
+	l_quantize_sse2(coefs + k, recips + k, out + k, n - k);
+}
+
+// SSE2 has no 32-bit multiply keeping the low halves, so rescaling starts at SSE4.1
+static SIMD_TARGET("sse4.1") void l_rescale_sse41(const int* qcoefs, const int* steps, int* out, unsigned int n)
+{
+	unsigned int k = 0;
+	for(; k + 4 <= n; k += 4)
+	{
+		__m128i q = _mm_loadu_si128((const __m128i*)(qcoefs + k));
+		_mm_storeu_si128((__m128i*)(out + k), _mm_mullo_epi32(q, _mm_loadu_si128((const __m128i*)(steps + k))));
+	}
+	SIMD::rescale_scalar(qcoefs + k, steps + k, out + k, n - k);
+}
+
+static SIMD_TARGET("avx2") void l_rescale_avx2(const int* qcoefs, const int* steps, int* out, unsigned int n)
+{
+	unsigned int k = 0;
+	for(; k + 8 <= n; k += 8)
+	{
+		__m256i q = _mm256_loadu_si256((const __m256i*)(qcoefs + k));
+		_mm256_storeu_si256((__m256i*)(out + k), _mm256_mullo_epi32(q, _mm256_loadu_si256((const __m256i*)(steps + k))));
+	}
+	_mm256_zeroupper();
+	l_rescale_sse41(qcoefs + k, steps + k, out + k, n - k);
+}
+
+// An unsigned x <= bound is min(x, bound) == x
+static SIMD_TARGET("sse4.1") unsigned int l_within_mask_sse41(const unsigned int* values, unsigned int n, unsigned int bound)
+{
+	const __m128i bounds = _mm_set1_epi32((int)bound);
+	unsigned int mask = 0;
+	for(unsigned int k = 0; k < n; k += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(values + k));
+		mask |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_min_epu32(v, bounds), v))) << k;
+	}
+	return mask;
+}
+
+static SIMD_TARGET("avx2") unsigned int l_within_mask_avx2(const unsigned int* values, unsigned int n, unsigned int bound)
+{
+	const __m256i bounds = _mm256_set1_epi32((int)bound);
+	unsigned int mask = 0;
+	for(unsigned int k = 0; k < n; k += 8)
+	{
+		__m256i v = _mm256_loadu_si256((const __m256i*)(values + k));
+		mask |= (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_min_epu32(v, bounds), v))) << k;
+	}
+	return mask;
+}
+
+static SIMD_TARGET("sse4.1") void l_block_sum_distances_sse41(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out)
+{
+	const __m128i sums_from = _mm_set1_epi32((int)sum);
+	unsigned int k = 0;
+	for(; k + 4 <= n; k += 4)
+	{
+		__m128i block_sums = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(sums + k)));
+		__m128i distances = _mm_abs_epi32(_mm_sub_epi32(block_sums, sums_from));
+		_mm_storeu_si128((__m128i*)(out + k), _mm_add_epi32(_mm_loadu_si128((const __m128i*)(out + k)), distances));
+	}
+	SIMD::block_sum_distances_scalar(sums + k, sum, n - k, out + k);
+}
+
+static SIMD_TARGET("avx2") void l_block_sum_distances_avx2(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out)
+{
+	const __m256i sums_from = _mm256_set1_epi32((int)sum);
+	unsigned int k = 0;
+	for(; k + 8 <= n; k += 8)
+	{
+		__m256i block_sums = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(sums + k)));
+		__m256i distances = _mm256_abs_epi32(_mm256_sub_epi32(block_sums, sums_from));
+		_mm256_storeu_si256((__m256i*)(out + k), _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(out + k)), distances));
+	}
+	_mm256_zeroupper();
+	l_block_sum_distances_sse41(sums + k, sum, n - k, out + k);
+}
+
+#endif //SIMD_X86
+
+static SimdKernels l_make_kernels(SIMD::SIMD_LEVEL_T level)
+{
+	SimdKernels k = { SIMD::SIMD_NONE, SIMD::sad_scalar, SIMD::sad_scalar, SIMD::sad_scalar, SIMD::sad_scalar, nullptr, nullptr, nullptr, nullptr, nullptr, SIMD::quantize_scalar, SIMD::rescale_scalar, SIMD::block_sum_distances_scalar };
+#ifdef SIMD_X86
+	if(level >= SIMD::SIMD_SSE2)
+	{
+		k.level = SIMD::SIMD_SSE2;
+		k.w4 = l_sad_w4_sse2;
+		k.w8 = l_sad_w8_sse2;
+		k.w16 = l_sad_w16_sse2;
+		k.generic = l_sad_generic_sse2;
+		k.quantize = l_quantize_sse2;
+	}
+	if(level >= SIMD::SIMD_SSE41)
+	{
+		k.level = SIMD::SIMD_SSE41;
+		k.row8_w8 = l_sad_row8_w8_sse41;
+		k.row8_w16 = l_sad_row8_w16_sse41;
+		k.within_mask = l_within_mask_sse41;
+		k.rescale = l_rescale_sse41;
+		k.sum_distances = l_block_sum_distances_sse41;
+	}
+	if(level >= SIMD::SIMD_AVX2)
+	{
+		k.level = SIMD::SIMD_AVX2;
+		k.w8 = l_sad_w8_avx2;
+		k.w16 = l_sad_w16_avx2;
+		k.generic = l_sad_generic_avx2;
+		k.row16_w8 = l_sad_row16_w8_avx2;
+		k.row16_w16 = l_sad_row16_w16_avx2;
+		k.within_mask = l_within_mask_avx2;
+		k.quantize = l_quantize_avx2;
+		k.rescale = l_rescale_avx2;
+		k.sum_distances = l_block_sum_distances_avx2;
+	}
+#endif
+	return k;
+}
+
+static SimdKernels& l_kernels()
+{
+	static SimdKernels kernels = l_make_kernels(SIMD::detect_level());
+	return kernels;
+}
+
+SIMD::SIMD_LEVEL_T SIMD::detect_level()
+{
+	SIMD_LEVEL_T level = SIMD_NONE;
+#ifdef SIMD_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool sse41 = (info[2] & (1 << 19)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	bool avx2 = false;
+	// AVX2 is only usable if the OS saves the upper halves of the ymm registers
+	if(max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 0x6) == 0x6)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2");
+	bool sse41 = __builtin_cpu_supports("sse4.1");
+	bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+	if(sse2)
+		level = SIMD_SSE2;
+	if(sse2 && sse41)
+		level = SIMD_SSE41;
+	if(sse2 && sse41 && avx2)
+		level = SIMD_AVX2;
+#endif
+	return level;
+}
+
+void SIMD::init(SIMD_LEVEL_T max_level)
+{
+	SIMD_LEVEL_T supported = detect_level();
+	l_kernels() = l_make_kernels(max_level < supported ? max_level : supported);
+}
+
+SIMD::SIMD_LEVEL_T SIMD::get_level()
+{
+	return l_kernels().level;
+}
+
+const char* SIMD::level_name(SIMD_LEVEL_T level)
+{
+	switch(level)
+	{
+		case SIMD_SSE2: return "sse2";
+		case SIMD_SSE41: return "sse4.1";
+		case SIMD_AVX2: return "avx2";
+		default: 		return "scalar";
+	}
+}
+
+// How many rows are summed between checks of a bounded SAD against its bound
+const unsigned int SAD_BOUND_CHECK_ROWS = 4;
+
+static unsigned int l_sad_unbounded(const SimdKernels& k, const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height)
+{
+	switch(width)
+	{
+		case 4:		return k.w4(a, a_stride, b, b_stride, width, height);
+		case 8:		return k.w8(a, a_stride, b, b_stride, width, height);
+		case 16:	return k.w16(a, a_stride, b, b_stride, width, height);
+		default:	return k.generic(a, a_stride, b, b_stride, width, height);
+	}
+}
+
+unsigned int SIMD::sad(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height, unsigned int bound)
+{
+	const SimdKernels& k = l_kernels();
+	if(bound == SAD_NO_BOUND)
+	{
+		return l_sad_unbounded(k, a, a_stride, b, b_stride, width, height);
+	}
+	
+	unsigned int ret = 0;
+	for(unsigned int i = 0; i < height && ret <= bound; i += SAD_BOUND_CHECK_ROWS)
+	{
+		unsigned int rows = std::min(SAD_BOUND_CHECK_ROWS, height - i);
+		ret += l_sad_unbounded(k, a + i*a_stride, a_stride, b + i*b_stride, b_stride, width, rows);
+	}
+	return ret;
+}
+
+// A group of adjacent candidates with no more than this many left after their lower bounds is scored one by one
+const unsigned int SAD_ROW_MAX_SINGLES = 3;
+
+// Index of the lowest set bit of a nonzero mask
+static inline unsigned int l_lowest_bit(unsigned int mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+static inline bool l_more_bits_than(unsigned int mask, unsigned int n)
+{
+	for(; mask && n > 0; --n)
+	{
+		mask &= mask - 1;
+	}
+	return mask != 0;
+}
+
+// Scores a group of group_size candidates with a row kernel, a few rows at a time when there's a bound. The candidates
+// ruled out by their lower bounds (a bit each) don't keep the group going, and end up with at least their lower bound.
+static void l_sad_row_group(SAD_ROW_FUNC_T row_func, unsigned int group_size, const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int height, unsigned int* sads, unsigned int bound, const unsigned int* lower_bounds, unsigned int ruled_out)
+{
+	std::fill(sads, sads + group_size, 0u);
+	if(bound == SIMD::SAD_NO_BOUND)
+	{
+		row_func(cur, cur_stride, ref, ref_stride, height, sads, nullptr);
+		return;
+	}
+	
+	for(unsigned int i = 0; i < height; i += SAD_BOUND_CHECK_ROWS)
+	{
+		unsigned int rows = std::min(SAD_BOUND_CHECK_ROWS, height - i);
+		if(row_func(cur + i*cur_stride, cur_stride, ref + i*ref_stride, ref_stride, rows, sads, lower_bounds) > bound)
+		{
+			break;
+		}
+	}
+	for(; ruled_out; ruled_out &= ruled_out - 1)
+	{
+		unsigned int c = l_lowest_bit(ruled_out);
+		sads[c] = std::max(sads[c], lower_bounds[c]);
+	}
+}
+
+// Scores only the candidates left (a bit each), one by one; the others get their lower bound
+static void l_sad_survivors(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int width, unsigned int height, unsigned int group_size, unsigned int* sads, unsigned int bound, const unsigned int* lower_bounds, unsigned int survivors)
+{
+	std::copy(lower_bounds, lower_bounds + group_size, sads);
+	for(; survivors; survivors &= survivors - 1)
+	{
+		unsigned int c = l_lowest_bit(survivors);
+		sads[c] = SIMD::sad(cur, cur_stride, ref + c, ref_stride, width, height, bound);
+	}
+}
+
+void SIMD::sad_row(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int width, unsigned int height, unsigned int num_candidates, unsigned int* sads, unsigned int bound, const unsigned int* lower_bounds)
+{
+	const SimdKernels& k = l_kernels();
+	SAD_ROW_FUNC_T row16 = (width == 16) ? k.row16_w16 : (width == 8) ? k.row16_w8 : nullptr;
+	SAD_ROW_FUNC_T row8 = (width == 16) ? k.row8_w16 : (width == 8) ? k.row8_w8 : nullptr;
+	if(bound == SAD_NO_BOUND)
+	{
+		lower_bounds = nullptr;
+	}
+	// Groups with next to nothing left in them go one candidate at a time instead, and are skipped when there's nothing
+	auto score_group = [&](SAD_ROW_FUNC_T row_func, unsigned int group_size, unsigned int i)
+	{
+		if(!lower_bounds)
+		{
+			l_sad_row_group(row_func, group_size, cur, cur_stride, ref + i, ref_stride, height, sads + i, bound, nullptr, 0);
+			return;
+		}
+		unsigned int survivors = k.within_mask(lower_bounds + i, group_size, bound);
+		if(l_more_bits_than(survivors, SAD_ROW_MAX_SINGLES))
+		{
+			unsigned int ruled_out = ~survivors & ((1u << group_size) - 1);
+			l_sad_row_group(row_func, group_size, cur, cur_stride, ref + i, ref_stride, height, sads + i, bound, lower_bounds + i, ruled_out);
+		}
+		else
+		{
+			l_sad_survivors(cur, cur_stride, ref + i, ref_stride, width, height, group_size, sads + i, bound, lower_bounds + i, survivors);
+		}
+	};
+	unsigned int i = 0;
+	if(row16)
+	{
+		for(; i + 16 <= num_candidates; i += 16)
+		{
+			score_group(row16, 16, i);
+		}
+	}
+	if(row8)
+	{
+		for(; i + 8 <= num_candidates; i += 8)
+		{
+			score_group(row8, 8, i);
+		}
+	}
+	for(; i < num_candidates; ++i)
+	{
+		sads[i] = (lower_bounds && lower_bounds[i] > bound) ? lower_bounds[i] : sad(cur, cur_stride, ref + i, ref_stride, width, height, bound);
+	}
+}
+
+void SIMD::quantize(const int* coefs, const float* recips, int* out, unsigned int n)
+{
+	l_kernels().quantize(coefs, recips, out, n);
+}
+
+void SIMD::rescale(const int* qcoefs, const int* steps, int* out, unsigned int n)
+{
+	l_kernels().rescale(qcoefs, steps, out, n);
+}
+
+void SIMD::block_sum_distances(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out)
+{
+	l_kernels().sum_distances(sums, sum, n, out);
+}
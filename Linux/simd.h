@@ -0,0 +1,67 @@
+#include "util.h"
+#include <limits>
+#include <cstdint>
+
+#ifndef _SIMD_H
+#define _SIMD_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define SIMD_X86
+#endif
+
+namespace SIMD
+{
+	// Instruction set extensions the kernels can use, in increasing order of preference
+	enum SIMD_LEVEL_T
+	{
+		SIMD_NONE = 0,
+		SIMD_SSE2,
+		SIMD_SSE41,
+		SIMD_AVX2
+	};
+
+	// Best level supported by the CPU (and OS) we're running on, as reported by CPUID
+	SIMD_LEVEL_T detect_level();
+
+	// Select the kernels used from here on; anything above what the CPU supports is clamped.
+	// Without a call to init, the best supported level is used.
+	void init(SIMD_LEVEL_T max_level);
+	SIMD_LEVEL_T get_level();
+	const char* level_name(SIMD_LEVEL_T level);
+
+	// No bound on a SAD; it's always computed in full
+	const unsigned int SAD_NO_BOUND = std::numeric_limits<unsigned int>::max();
+	
+	// Sum of absolute differences between two width x height blocks given row pointers and strides. With a bound, the
+	// sum is checked every few rows and given up on once it's past the bound: the result is then some partial sum
+	// greater than bound rather than the full SAD. Results up to the bound are always exact.
+	unsigned int sad(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height, unsigned int bound = SAD_NO_BOUND);
+
+	// SADs of one block against num_candidates horizontally adjacent blocks of a reference row band,
+	// i.e. sads[k] = sad(cur, ref + k). The current block is loaded once per row and scored against
+	// 8 (SSE4.1) or 16 (AVX2) candidate positions at a time, like the 16 PEs of the hardware model.
+	// A bound works as for sad, except that a group of candidates scored together is only given up on once all
+	// of them are past it. Given lower bounds on the SADs, candidates whose lower bound is already past the bound aren't
+	// scored at all (their result is then the lower bound), and groups with only a few candidates left go one by one.
+	void sad_row(const BYTE_T* cur, unsigned int cur_stride, const BYTE_T* ref, unsigned int ref_stride, unsigned int width, unsigned int height, unsigned int num_candidates, unsigned int* sads, unsigned int bound = SAD_NO_BOUND, const unsigned int* lower_bounds = nullptr);
+
+	// Quantize n coefficients: out[k] = coefs[k] * recips[k], rounded to nearest (ties to even, as rint does).
+	// The vector kernels multiply in single precision, which is exact when each reciprocal is a power of two and
+	// |coefs[k]| < 2^24; a transform coefficient of an 8-bit block is at most 255*64*2^8.
+	void quantize(const int* coefs, const float* recips, int* out, unsigned int n);
+	
+	// Undo quantize: out[k] = qcoefs[k] * steps[k]
+	void rescale(const int* qcoefs, const int* steps, int* out, unsigned int n);
+
+	// Adds how far sum is from each of n block sums: out[k] += |sum - sums[k]|. When sum is that of another block of
+	// the same size, that's a lower bound on their SAD.
+	void block_sum_distances(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out);
+
+	// Scalar implementations, always available and used as the reference for the vector kernels
+	unsigned int sad_scalar(const BYTE_T* a, unsigned int a_stride, const BYTE_T* b, unsigned int b_stride, unsigned int width, unsigned int height);
+	void quantize_scalar(const int* coefs, const float* recips, int* out, unsigned int n);
+	void rescale_scalar(const int* qcoefs, const int* steps, int* out, unsigned int n);
+	void block_sum_distances_scalar(const std::uint16_t* sums, unsigned int sum, unsigned int n, unsigned int* out);
+}
+
+#endif //_SIMD_H
@@ -0,0 +1,108 @@
+#include "thread_pool.h"
+#include <cassert>
+#include <algorithm>
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shutdown = true;
+	}
+	m_job_ready.notify_all();
+	for(auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+void ThreadPool::init(unsigned int num_threads)
+{
+	assert(m_workers.empty());
+	if(num_threads == 0)
+	{
+		num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+	for(unsigned int i = 1; i < num_threads; ++i)
+	{
+		m_workers.emplace_back(&ThreadPool::worker_loop, this);
+	}
+}
+
+void ThreadPool::parallel_for(unsigned int begin, unsigned int end, const std::function<void(unsigned int)>& fn)
+{
+	if(begin >= end)
+	{
+		return;
+	}
+	
+	if(m_workers.empty() || end - begin == 1)
+	{
+		for(unsigned int i = begin; i < end; ++i)
+		{
+			fn(i);
+		}
+		return;
+	}
+
+	Job job;
+	job.fn = &fn;
+	job.end = end;
+	job.next = begin;
+	job.num_active = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(&job);
+	}
+	m_job_ready.notify_all();
+
+	run_job(job);
+
+	// Every index has been claimed by now; stop handing the job out and wait for the workers still running theirs
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), &job));
+	m_job_done.wait(lock, [&job] { return job.num_active == 0; });
+}
+
+void ThreadPool::run_job(Job& job)
+{
+	for(unsigned int i = job.next++; i < job.end; i = job.next++)
+	{
+		(*job.fn)(i);
+	}
+}
+
+ThreadPool::Job* ThreadPool::find_open_job() const
+{
+	for(auto it = m_jobs.rbegin(); it != m_jobs.rend(); ++it)
+	{
+		if((*it)->next < (*it)->end)
+		{
+			return *it;
+		}
+	}
+	return nullptr;
+}
+
+void ThreadPool::worker_loop()
+{
+	while(true)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		Job* job = nullptr;
+		m_job_ready.wait(lock, [this, &job] { return m_shutdown || (job = find_open_job()) != nullptr; });
+		if(m_shutdown)
+		{
+			return;
+		}
+		++job->num_active;
+		lock.unlock();
+
+		run_job(*job);
+
+		lock.lock();
+		if(--job->num_active == 0)
+		{
+			m_job_done.notify_all();
+		}
+	}
+}
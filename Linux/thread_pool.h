@@ -0,0 +1,115 @@
+#include <vector>
+#include <deque>
+#include <cassert>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+// Fixed set of worker threads shared by the whole encoder/decoder. Work is handed out as index ranges;
+// the calling thread takes part in the work too, so a pool of N threads has N-1 workers.
+class ThreadPool
+{
+private:
+	ThreadPool() : m_shutdown(false) {};
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+public:
+	static ThreadPool& inst() {
+		static ThreadPool instance;
+		return instance;
+	}
+
+	// Start num_threads - 1 workers; 0 means one thread per hardware thread. Without a call to init
+	// everything runs on the calling thread.
+	void init(unsigned int num_threads);
+	unsigned int get_num_threads() const { return m_workers.size() + 1; }
+
+	// Call fn(i) for every i in [begin, end) and return once all of them are done. The order the indices
+	// run in is unspecified. Calls may be made from several threads at once and from inside fn; idle
+	// workers pick up the most recently started work first, so nested calls fill in behind outer ones.
+	void parallel_for(unsigned int begin, unsigned int end, const std::function<void(unsigned int)>& fn);
+
+private:
+	struct Job
+	{
+		const std::function<void(unsigned int)>* fn;
+		unsigned int end;
+		std::atomic<unsigned int> next;
+		unsigned int num_active;
+	};
+
+	void worker_loop();
+	void run_job(Job& job);
+	Job* find_open_job() const;
+
+	std::vector<std::thread> m_workers;
+	std::mutex m_mutex;
+	std::condition_variable m_job_ready;
+	std::condition_variable m_job_done;
+	std::vector<Job*> m_jobs;
+	bool m_shutdown;
+};
+
+// FIFO handing items from one pipeline stage to the next. push blocks while the queue is full, pop blocks while
+// it's empty; once the producer calls close, pop drains what's left and then returns false.
+template <typename T>
+class BoundedQueue
+{
+public:
+	BoundedQueue(std::size_t capacity) : m_capacity(capacity), m_closed(false) { assert(m_capacity > 0); };
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	void push(T item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_not_full.wait(lock, [this] { return m_items.size() < m_capacity; });
+			assert(!m_closed);
+			m_items.push_back(std::move(item));
+		}
+		m_not_empty.notify_one();
+	}
+
+	bool pop(T& item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+			if(m_items.empty())
+			{
+				return false;
+			}
+			item = std::move(m_items.front());
+			m_items.pop_front();
+		}
+		m_not_full.notify_one();
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+		}
+		m_not_empty.notify_all();
+	}
+
+private:
+	std::size_t m_capacity;
+	bool m_closed;
+	std::deque<T> m_items;
+	std::mutex m_mutex;
+	std::condition_variable m_not_full;
+	std::condition_variable m_not_empty;
+};
+
+#endif //_THREAD_POOL_H
@@ -32,6 +32,35 @@ void CFG::init(const char* filename)
 	}
 }
 
+PARAMS::PARAMS() :
+rdo_estimation(0), rdo_estimation_c1(900), rdo_estimation_c2(900), debug_res_est(false), debug_colour_blocks(false),
+fast_me(false), predictive_me(false), vbs_enable(false), hw_enable(false), me_good_enough(0), me_pyramid_levels(0), me_successive_elimination(false), subpel_precision(1), mv_prediction(false)
+{
+}
+
+void PARAMS::load()
+{
+	CFG_LOAD_OPT_DEFAULT("rdo_estimation", rdo_estimation, 0);
+	CFG_LOAD_OPT_DEFAULT("rdo_estimation_c1", rdo_estimation_c1, 900); //882
+	CFG_LOAD_OPT_DEFAULT("rdo_estimation_c2", rdo_estimation_c2, 900);
+	CFG_LOAD_OPT_DEFAULT("debug_res_est", debug_res_est, false);
+	CFG_LOAD_OPT_DEFAULT("debug_colour_blocks", debug_colour_blocks, false);
+	CFG_LOAD_OPT_DEFAULT("FastFME", fast_me, false);
+	CFG_LOAD_OPT_DEFAULT("PredictiveME", predictive_me, false);
+	CFG_LOAD_OPT_DEFAULT("VBSEnable", vbs_enable, false);
+	CFG_LOAD_OPT_DEFAULT("HwModeEnable", hw_enable, false);
+	CFG_LOAD_OPT_DEFAULT("MEGoodEnough", me_good_enough, 0);
+	CFG_LOAD_OPT_DEFAULT("MEPyramidLevels", me_pyramid_levels, 0);
+	CFG_LOAD_OPT_DEFAULT("MESuccessiveElimination", me_successive_elimination, false);
+	CFG_LOAD_OPT_DEFAULT("SubPelPrecision", subpel_precision, 1);
+	CFG_LOAD_OPT_DEFAULT("MVPrediction", mv_prediction, false);
+	if(subpel_precision != 1 && subpel_precision != 2 && subpel_precision != 4)
+	{
+		std::cout << "WARNING: SubPelPrecision must be 1, 2 or 4, not " << subpel_precision << "; using whole-pel vectors" << std::endl;
+		subpel_precision = 1;
+	}
+}
+
 bool CFG::load_opt(const std::string& opt, std::string& str_opt)
 {
 	auto it = m_config_map.find(opt);
@@ -3,6 +3,9 @@
 #include <string>
 #include <fstream>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
 
 #ifndef _UTIL_H
 #define _UTIL_H
@@ -12,6 +15,38 @@ typedef unsigned char BYTE_T;
 typedef std::vector<BYTE_T> BYTEVEC_T;
 typedef std::pair<unsigned int, unsigned int> COORD_T;
 
+// Minimal allocator handing out storage aligned to ALIGN bytes so that rows of pixel
+// data can be fed straight to aligned vector loads
+template <typename T, std::size_t ALIGN>
+struct AlignedAllocator
+{
+	typedef T value_type;
+	template <typename U> struct rebind { typedef AlignedAllocator<U, ALIGN> other; };
+	
+	AlignedAllocator() {}
+	template <typename U> AlignedAllocator(const AlignedAllocator<U, ALIGN>&) {}
+	
+	T* allocate(std::size_t n)
+	{
+		// Over-allocate and stash the pointer we got from operator new just in front of the aligned block
+		void* raw = ::operator new(n*sizeof(T) + ALIGN + sizeof(void*));
+		std::uintptr_t aligned = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + ALIGN - 1) & ~(std::uintptr_t)(ALIGN - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+	
+	void deallocate(T* p, std::size_t)
+	{
+		::operator delete(reinterpret_cast<void**>(p)[-1]);
+	}
+	
+	template <typename U> bool operator==(const AlignedAllocator<U, ALIGN>&) const { return true; }
+	template <typename U> bool operator!=(const AlignedAllocator<U, ALIGN>&) const { return false; }
+};
+
+const std::size_t BYTE_ALIGNMENT = 32;
+typedef std::vector<BYTE_T, AlignedAllocator<BYTE_T, BYTE_ALIGNMENT> > ALIGNED_BYTEVEC_T;
+
 // Used in entropy encoding and compression manipulations
 typedef std::vector<int> INT_VEC_T;
 
@@ -36,6 +71,51 @@ public:
 	bool load_opt(const std::string& opt, bool& bool_val);
 };
 
+// Options consulted from the encoding/decoding loops, converted from the cfg map once up front so that
+// the inner loops never have to go through string lookups
+class PARAMS
+{
+private:
+	PARAMS();
+	
+public:
+	static PARAMS& inst() {
+		static PARAMS instance;
+		return instance;
+	}
+	
+	// Re-read every option from CFG; call after CFG::inst().init()
+	void load();
+	
+	// 0 = No RDO factor, aka SAD only
+	// 1 = Simple RDO factor, based on the spatial-domain residuals
+	// 2 = Complex RDO factor, based on the actual bytes written to disk
+	unsigned int rdo_estimation;
+	unsigned int rdo_estimation_c1;
+	unsigned int rdo_estimation_c2;
+	bool debug_res_est;
+	bool debug_colour_blocks;
+	bool fast_me;
+	bool predictive_me;
+	bool vbs_enable;
+	bool hw_enable;
+	
+	// Motion search stops at the first vector costing at most this much per pixel; 0 = always search in full
+	unsigned int me_good_enough;
+	
+	// Pyramid levels below full resolution to start motion search from; 0 = no pyramid search
+	unsigned int me_pyramid_levels;
+	
+	// Skip the SADs of exhaustive search candidates whose block sums alone rule them out (same result, less work)
+	bool me_successive_elimination;
+	
+	// Motion vector precision: 1 = whole pixels, 2 = half-pel, 4 = quarter-pel
+	unsigned int subpel_precision;
+	
+	// Code motion vectors against the median of their neighbours' instead of the previous block's
+	bool mv_prediction;
+};
+
 //Helpful macros for loading in mandatory settings, tracking their success, and printing an error when they're missing
 #define CFG_LOAD_OPT_MANDATORY(name, var, ret)	\
 if (!CFG::inst().load_opt(name, var)) { ret = false; std::cout << "ERROR: Missing cfg opt \"" << name << "\"!" << std::endl; }